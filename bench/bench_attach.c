@@ -0,0 +1,62 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "../src/pouch.h"
+
+/*
+   Uploads attachments of increasing size with doc_add_attachment()
+   and reports throughput and peak resident memory. The files are
+   sparse temporaries, so they cost no disk space. Peak memory
+   should stay flat however large the attachment is.
+
+	./bench_attach [server] [db] [sizes in MB...]
+*/
+
+static double now_s(void){
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec/1e6;
+}
+static long max_rss_kb(void){
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_maxrss;
+}
+
+int main(int argc, char *argv[]){
+	char *server = argc > 1 ? argv[1] : "http://127.0.0.1:5984";
+	char *db = argc > 2 ? argv[2] : "bench";
+	long default_sizes[] = {1, 100, 2048};
+	int nsizes = argc > 3 ? argc - 3 : 3;
+	int i;
+
+	PouchReq *pr = pr_init();
+	pr_set_timeout(pr, 0);	// large uploads may take a while
+	for (i = 0; i < nsizes; i++){
+		long mb = argc > 3 ? atol(argv[3 + i]) : default_sizes[i];
+		char path[] = "/tmp/bench_attachXXXXXX";
+		int fd = mkstemp(path);
+		if (fd < 0 || ftruncate(fd, (off_t)mb << 20) != 0){
+			fprintf(stderr, "could not create %ld MB file\n", mb);
+			return 1;
+		}
+		close(fd);
+
+		char doc[64];
+		snprintf(doc, sizeof(doc), "attach-%ldMB", mb);
+		double t0 = now_s();
+		pr_do(doc_add_attachment(pr, server, db, doc, path));
+		double dt = now_s() - t0;
+		unlink(path);
+
+		printf("%6ld MB: http %ld, %.2fs, %.1f MB/s, max rss %ld KB\n",
+				mb, pr->httpresponse, dt, mb/dt, max_rss_kb());
+	}
+	pr_free(pr);
+	return 0;
+}
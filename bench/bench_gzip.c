@@ -0,0 +1,136 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "../src/pouch.h"
+
+/*
+   Shows what gzip costs and saves. Sends count _bulk_docs
+   POSTs of batch documents each, uncompressed and then gzipped
+   at levels 1, 6 and 9, and reads count responses from path
+   (a large _all_docs, _changes or view) with and without
+   Accept-Encoding. Reports the client CPU time and the bytes
+   that went over the wire. Responses are only compressed if
+   the server (or a proxy in front of it) supports it.
+
+	./bench_gzip [server] [db] [count] [batch] [path]
+*/
+
+typedef struct {
+	double wall;
+	double cpu;		// user + system seconds of this process
+	double bytes;	// sent or received on the wire
+	size_t body;	// body size before compression
+	int failed;
+} BenchRun;
+
+static double now_s(void){
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec/1e6;
+}
+static double cpu_s(void){
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec/1e6
+		+ ru.ru_stime.tv_sec + ru.ru_stime.tv_usec/1e6;
+}
+static char *make_batch(int batch){
+	// sensor readings, about as repetitive as real documents
+	size_t cap = 64 + batch*160, len;
+	char *body = malloc(cap);
+	int i;
+	len = sprintf(body, "{\"docs\":[");
+	for (i = 0; i < batch; i++){
+		len += sprintf(body + len,
+				"%s{\"_id\":\"reading:%08d\",\"type\":\"reading\",\"sensor\":\"s-%03d\","
+				"\"time\":%d,\"value\":%d.%02d,\"unit\":\"celsius\",\"ok\":true}",
+				i ? "," : "", i, i%50, 1500000000 + i*60, 15 + rand()%10, rand()%100);
+	}
+	sprintf(body + len, "]}");
+	return body;
+}
+static void upload(BenchRun *r, PouchReq *pr, char *server, char *db, char *body, int count, size_t min, int level){
+	curl_off_t up;
+	int i;
+	memset(r, 0, sizeof(*r));
+	r->body = strlen(body);
+	pr_set_gzip(pr, min, level);
+	r->wall = now_s();
+	r->cpu = cpu_s();
+	for (i = 0; i < count; i++){
+		pr_set_method(pr, POST);
+		pr_set_path(pr, server, db, "_bulk_docs", NULL);
+		pr_borrow_data(pr, body, r->body);
+		pr_do(pr);
+		if (pr->curlcode || pr->httpresponse >= 300){
+			r->failed++;
+		}
+		curl_easy_getinfo(pr->easy, CURLINFO_SIZE_UPLOAD_T, &up);
+		r->bytes += up;
+	}
+	r->cpu = cpu_s() - r->cpu;
+	r->wall = now_s() - r->wall;
+}
+static void download(BenchRun *r, PouchReq *pr, char *server, char *db, char *path, int count, const char *encodings){
+	curl_off_t down;
+	int i;
+	memset(r, 0, sizeof(*r));
+	pr_set_encodings(pr, encodings);
+	r->wall = now_s();
+	r->cpu = cpu_s();
+	for (i = 0; i < count; i++){
+		pr_set_method(pr, GET);
+		pr_set_path(pr, server, db, NULL);
+		pr->url = combine(&pr->url, pr->url, path, "/");
+		pr_do(pr);
+		if (pr->curlcode || pr->httpresponse != 200){
+			r->failed++;
+		}
+		curl_easy_getinfo(pr->easy, CURLINFO_SIZE_DOWNLOAD_T, &down);
+		r->bytes += down;
+		r->body = pr->resp.size;
+	}
+	r->cpu = cpu_s() - r->cpu;
+	r->wall = now_s() - r->wall;
+}
+static void report(const char *name, BenchRun *r, int count){
+	printf("%-12s body %7zu B  wire %7.0f B/req (%5.1f%%)  cpu %6.1f us/req  wall %6.1f us/req  failed %d\n",
+			name, r->body, r->bytes/count, r->body ? 100*r->bytes/count/r->body : 0,
+			r->cpu*1e6/count, r->wall*1e6/count, r->failed);
+}
+
+int main(int argc, char *argv[]){
+	char *server = argc > 1 ? argv[1] : "http://127.0.0.1:5984";
+	char *db = argc > 2 ? argv[2] : "benchmark_database";
+	int count = argc > 3 ? atoi(argv[3]) : 200;
+	int batch = argc > 4 ? atoi(argv[4]) : 1000;
+	char *path = argc > 5 ? argv[5] : "_all_docs?include_docs=true";
+	char *body = make_batch(batch);
+	PouchReq *pr = pr_init();
+	BenchRun r;
+	int levels[] = {1, 6, 9};
+	char name[16];
+	int i;
+
+	pr_do(db_create(pr, server, db));
+
+	upload(&r, pr, server, db, body, count, 0, 0);
+	report("POST plain", &r, count);
+	for (i = 0; i < 3; i++){
+		upload(&r, pr, server, db, body, count, 1024, levels[i]);
+		snprintf(name, sizeof(name), "POST gzip -%d", levels[i]);
+		report(name, &r, count);
+	}
+
+	download(&r, pr, server, db, path, count, NULL);
+	report("GET identity", &r, count);
+	download(&r, pr, server, db, path, count, "");
+	report("GET gzip", &r, count);
+
+	pr_free(pr);
+	free(body);
+	return 0;
+}
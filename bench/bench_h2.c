@@ -0,0 +1,74 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "../src/multi_pouch.h"
+
+/*
+   Sends count concurrent doc_get() requests through the multi
+   interface, at most concurrency at a time, once over HTTP/1.1
+   and once multiplexed over HTTP/2, and reports the throughput
+   and how many connections were opened. https servers get
+   HTTP/2 through ALPN, plain http ones get cleartext h2c. The
+   server must speak both, e.g. nghttpx in front of CouchDB:
+
+	nghttpx -f'127.0.0.1,8769' -b'127.0.0.1,5984' key.pem cert.pem
+
+	./bench_h2 [server] [db] [docid] [count] [concurrency]
+*/
+
+typedef struct {
+	int left;
+	int failed;
+	long connects;
+} BenchState;
+
+static double now_s(void){
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec/1e6;
+}
+static void finished(PouchReq *pr, PouchMInfo *pmi){
+	BenchState *st = (BenchState *)pmi->custom;
+	long connects = 0;
+	curl_easy_getinfo(pr->easy, CURLINFO_NUM_CONNECTS, &connects);
+	st->connects += connects;
+	if (pr->curlcode || pr->httpresponse != 200){
+		st->failed++;
+	}
+	st->left--;
+	pr_free(pr);
+}
+static void run(const char *name, int mode, char *server, char *db, char *id, int count, int concurrency){
+	BenchState st = {count, 0, 0};
+	struct event_base *base = event_base_new();
+	PouchMInfo *pmi = pr_mk_pmi(base, NULL, finished, &st);
+	int i;
+	pmi_set_limits(pmi, concurrency, 0, 0);
+	pmi_set_http2(pmi, mode, concurrency);
+	double t0 = now_s();
+	for (i = 0; i < count; i++){
+		PouchReq *pr = pr_init();
+		pmi_submit(pmi, doc_get(pr, server, db, id));
+	}
+	while (st.left > 0){
+		event_base_loop(base, EVLOOP_ONCE);
+	}
+	double dt = now_s() - t0;
+	printf("%-8s n=%d concurrency=%d %.2fs %.0f req/s connections=%ld failed=%d\n",
+			name, count, concurrency, dt, count/dt, st.connects, st.failed);
+	pr_del_pmi(pmi);	// frees base too
+}
+
+int main(int argc, char *argv[]){
+	char *server = argc > 1 ? argv[1] : "https://127.0.0.1:8769";
+	char *db = argc > 2 ? argv[2] : "bench";
+	char *id = argc > 3 ? argv[3] : "doc";
+	int count = argc > 4 ? atoi(argv[4]) : 10000;
+	int concurrency = argc > 5 ? atoi(argv[5]) : 100;
+
+	run("HTTP/1.1", POUCH_HTTP1, server, db, id, count, concurrency);
+	run("HTTP/2", strncmp(server, "https:", 6) ? POUCH_HTTP2_PRIOR : POUCH_HTTP2, server, db, id, count, concurrency);
+	return 0;
+}
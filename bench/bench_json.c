@@ -0,0 +1,172 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+
+// the parser's scanning functions are static
+#include "../example/lib/json.c"
+
+/*
+   json_decode() throughput in MB/s, scanning strings and
+   whitespace with SSE2 (bench_json) or the scalar loops
+   (bench_json_scalar, built with -DJSON_NO_SIMD), then
+   json_decode() + json_delete() against an arena decode
+   + json_arena_reset(), counting the allocations of each
+   (link with -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc).
+   The payload is an _all_docs?include_docs=true response as
+   CouchDB writes it (rows separated by ",\r\n"), or a file,
+   e.g. saved with curl; a pretty-printed copy of it is
+   decoded too.
+
+	./bench_json [rows | file] [runs]
+*/
+
+static volatile size_t allocs;	// malloc() is assumed not to touch globals
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+void *__wrap_malloc(size_t size){
+	allocs++;
+	return __real_malloc(size);
+}
+void *__wrap_calloc(size_t n, size_t size){
+	allocs++;
+	return __real_calloc(n, size);
+}
+void *__wrap_realloc(void *ptr, size_t size){
+	allocs++;
+	return __real_realloc(ptr, size);
+}
+
+static double now_s(void){
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec/1e6;
+}
+static char *make_all_docs(int rows){
+	// documents with the usual mix of ids, revs, text, numbers and a little UTF-8
+	SB sb;
+	char row[1024];
+	int i;
+	sb_init(&sb);
+	sb_puts(&sb, "{\"total_rows\":");
+	snprintf(row, sizeof(row), "%d,\"offset\":0,\"rows\":[\r\n", rows);
+	sb_puts(&sb, row);
+	for (i = 0; i < rows; i++){
+		snprintf(row, sizeof(row), "%s{\"id\":\"user:%08x\",\"key\":\"user:%08x\",\"value\":{\"rev\":\"3-%08x9f2c41d07be5a3e19c0d4b2a\"},"
+				"\"doc\":{\"_id\":\"user:%08x\",\"_rev\":\"3-%08x9f2c41d07be5a3e19c0d4b2a\",\"type\":\"user\","
+				"\"name\":\"User number %d\",\"email\":\"user%d@example.com\",\"city\":\"Z\xc3\xbcrich\","
+				"\"bio\":\"Writes software, reads a lot and has opinions about \\\"tabs\\\" versus spaces. "
+				"Lives near the lake with two cats and a bicycle that is older than most of the code here.\","
+				"\"age\":%d,\"score\":%d.%02d,\"active\":%s,\"tags\":[\"couchdb\",\"c\",\"json\"],"
+				"\"created\":\"2024-0%d-1%dT08:30:00Z\"}}",
+				i ? ",\r\n" : "", i, i, i*7, i, i*7, i, i, 20 + i%50, i%100, i%97,
+				i%3 ? "true" : "false", 1 + i%9, i%10);
+		sb_puts(&sb, row);
+	}
+	sb_puts(&sb, "\r\n]}\n");
+	return sb_finish(&sb);
+}
+static char *read_file(const char *path){
+	FILE *f = fopen(path, "rb");
+	char *buf;
+	long len;
+	if (!f){
+		return NULL;
+	}
+	fseek(f, 0, SEEK_END);
+	len = ftell(f);
+	rewind(f);
+	buf = malloc(len + 1);
+	if (fread(buf, 1, len, f) != (size_t)len){
+		len = 0;
+	}
+	buf[len] = '\0';
+	fclose(f);
+	return buf;
+}
+static void run(const char *name, const char *payload, int runs){
+	size_t len = strlen(payload);
+	double best = 1e9;
+	int i;
+	for (i = 0; i < runs; i++){
+		double t0 = now_s();
+		JsonNode *node = json_decode(payload);
+		double t = now_s() - t0;
+		if (!node){
+			printf("%s: not valid JSON\n", name);
+			return;
+		}
+		json_delete(node);
+		if (t < best){
+			best = t;
+		}
+	}
+	printf("  %-7s %8.1f MB/s\n", name, len/best/1e6);
+}
+static void run_alloc(const char *payload, JsonArena *arena, int runs){
+	/*
+	   Decoding and freeing, with malloc or an arena;
+	   the first arena decode is reported on its own.
+	 */
+	size_t len = strlen(payload), first = 0;
+	double best = 1e9;
+	int i;
+	allocs = 0;
+	for (i = 0; i < runs; i++){
+		double t0 = now_s(), t;
+		JsonNode *node = arena ? json_decode_arena(payload, arena) : json_decode(payload);
+		if (arena){
+			json_arena_reset(arena);
+		} else {
+			json_delete(node);
+		}
+		t = now_s() - t0;
+		if (i == 0 && arena){
+			first = allocs;
+			allocs = 0;
+		} else if (t < best){
+			best = t;
+		}
+	}
+	if (arena){
+		printf("  %-7s %8.1f MB/s  %zu allocations in the first decode, %.1f per decode after it\n",
+				"arena", len/best/1e6, first, (double)allocs/(runs - 1));
+	} else {
+		printf("  %-7s %8.1f MB/s  %.0f allocations per decode\n", "malloc", len/best/1e6, (double)allocs/runs);
+	}
+}
+static void bench(const char *what, const char *payload, int runs){
+	printf("%s, %.1f MB\n", what, strlen(payload)/1e6);
+#ifdef JSON_SIMD
+	run("sse2", payload, runs);
+#else
+	run("scalar", payload, runs);
+#endif
+}
+
+int main(int argc, char *argv[]){
+	char *arg = argc > 1 ? argv[1] : "20000";
+	int runs = argc > 2 ? atoi(argv[2]) : 10;
+	char *payload = atoi(arg) > 0 ? make_all_docs(atoi(arg)) : read_file(arg);
+	JsonNode *node;
+	char *pretty;
+	JsonArena *arena = json_arena_new();
+
+	if (!payload || !(node = json_decode(payload))){
+		fprintf(stderr, "bench_json: no JSON in %s\n", arg);
+		return 1;
+	}
+	pretty = json_stringify(node, "    ");
+	json_delete(node);
+
+	bench("_all_docs", payload, runs);
+	bench("pretty-printed", pretty, runs);
+	printf("allocation, _all_docs\n");
+	run_alloc(payload, NULL, runs);
+	run_alloc(payload, arena, runs + 1);
+	json_arena_free(arena);
+	free(payload);
+	free(pretty);
+	return 0;
+}
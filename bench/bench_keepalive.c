@@ -0,0 +1,67 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "../src/pouch.h"
+
+/*
+   Measures per-request latency of sequential doc_get() calls,
+   once with a fresh PouchReq for every call (a new connection
+   each time, as pr_do() used to behave) and once reusing a
+   single PouchReq (kept-alive connection).
+
+	./bench_keepalive [server] [db] [docid] [count]
+*/
+
+static double now_us(void){
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec*1e6 + tv.tv_usec;
+}
+static int cmp_double(const void *a, const void *b){
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+static void report(const char *name, double *lat, int n){
+	double total = 0;
+	int i;
+	for (i = 0; i < n; i++){
+		total += lat[i];
+	}
+	qsort(lat, n, sizeof(double), cmp_double);
+	printf("%-10s n=%d mean=%.1fus p50=%.1fus p99=%.1fus total=%.2fs\n",
+			name, n, total/n, lat[n/2], lat[(int)(n*0.99)], total/1e6);
+}
+
+int main(int argc, char *argv[]){
+	char *server = argc > 1 ? argv[1] : "http://127.0.0.1:5984";
+	char *db = argc > 2 ? argv[2] : "bench";
+	char *id = argc > 3 ? argv[3] : "doc";
+	int count = argc > 4 ? atoi(argv[4]) : 10000;
+	double *lat = malloc(count*sizeof(double));
+	int i;
+
+	// before: a new PouchReq (and connection) per request
+	for (i = 0; i < count; i++){
+		double t0 = now_us();
+		PouchReq *pr = pr_init();
+		pr_do(doc_get(pr, server, db, id));
+		pr_free(pr);
+		lat[i] = now_us() - t0;
+	}
+	report("fresh", lat, count);
+
+	// after: one PouchReq, connection kept alive
+	PouchReq *pr = pr_init();
+	for (i = 0; i < count; i++){
+		double t0 = now_us();
+		pr_do(doc_get(pr, server, db, id));
+		lat[i] = now_us() - t0;
+	}
+	report("reused", lat, count);
+	pr_free(pr);
+
+	free(lat);
+	return 0;
+}
@@ -0,0 +1,88 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "../src/multi_pouch.h"
+#include "../src/pouch_json.h"
+
+/*
+   Sends count doc GETs through a PouchPool of 1, 2, 4, ...
+   up to max_workers threads, pinned to consecutive CPUs, and
+   walks every response work times in the callback to stand in
+   for CPU-heavy JSON handling. With enough cores, throughput
+   should grow with the number of workers until the server
+   or the network is the bottleneck.
+
+	./bench_pool [server] [db] [docid] [count] [max_workers] [work]
+*/
+
+typedef struct {
+	int work;
+	size_t tokens;	// JSON tokens seen by all threads (atomic)
+	int failed;		// (atomic)
+} BenchState;
+
+static double now_s(void){
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec/1e6;
+}
+static int count_event(PouchJsonParser *p, int event, const char *text, size_t len){
+	(*(size_t *)p->custom)++;
+	return 0;
+}
+static void finished(PouchReq *pr, PouchMInfo *pmi){
+	BenchState *st = (BenchState *)pmi->custom;
+	size_t tokens = 0;
+	int i;
+	if (pr->curlcode || pr->httpresponse != 200 || !pr->resp.data){
+		__atomic_fetch_add(&st->failed, 1, __ATOMIC_RELAXED);
+	} else {
+		PouchJsonParser *p = pj_parser_new(count_event, NULL, 0, &tokens);
+		for (i = 0; i < st->work; i++){
+			pj_parser_reset(p);
+			pj_feed(p, pr->resp.data, pr->resp.size);
+			pj_finish(p);
+		}
+		pj_parser_free(p);
+	}
+	__atomic_fetch_add(&st->tokens, tokens, __ATOMIC_RELAXED);
+	pr_free(pr);
+}
+static void run(int workers, char *server, char *db, char *id, int count, int work){
+	BenchState st = {work, 0, 0};
+	PouchPool *pool = pp_init(workers, POUCH_POOL_LEAST, finished, &st);
+	double t0;
+	int i;
+	for (i = 0; i < workers; i++){
+		pmi_set_limits(pool->workers[i].pmi, 50, 0, 0);
+	}
+	pp_set_affinity(pool, 0);
+	pp_start(pool);
+	t0 = now_s();
+	for (i = 0; i < count; i++){
+		PouchReq *pr = pr_init();
+		pp_submit(pool, doc_get(pr, server, db, id));
+	}
+	pp_wait(pool);
+	t0 = now_s() - t0;
+	printf("workers=%d n=%d work=%d %.2fs %.0f req/s failed=%d tokens=%zu\n",
+			workers, count, work, t0, count/t0, st.failed, st.tokens);
+	pp_free(pool);
+}
+
+int main(int argc, char *argv[]){
+	char *server = argc > 1 ? argv[1] : "http://127.0.0.1:5984";
+	char *db = argc > 2 ? argv[2] : "bench";
+	char *id = argc > 3 ? argv[3] : "doc";
+	int count = argc > 4 ? atoi(argv[4]) : 20000;
+	int max_workers = argc > 5 ? atoi(argv[5]) : 8;
+	int work = argc > 6 ? atoi(argv[6]) : 200;
+	int workers;
+
+	for (workers = 1; workers <= max_workers; workers *= 2){
+		run(workers, server, db, id, count, work);
+	}
+	return 0;
+}
@@ -0,0 +1,77 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "../src/pouch.h"
+
+/*
+   Feeds a synthetic 50 MB _all_docs response through
+   recv_data_callback() in 16 KB pieces (libcurl's
+   CURL_MAX_WRITE_SIZE) and counts the reallocations it
+   causes. Link with -Wl,--wrap=realloc (see Makefile).
+
+	./bench_recv [megabytes]
+*/
+
+static size_t reallocs;
+void *__real_realloc(void *ptr, size_t size);
+void *__wrap_realloc(void *ptr, size_t size){
+	reallocs++;
+	return __real_realloc(ptr, size);
+}
+
+static double now_s(void){
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec/1e6;
+}
+static char *make_all_docs(size_t bytes, size_t *length){
+	/*
+	   Builds {"total_rows":N,"offset":0,"rows":[...]} of
+	   roughly the requested size.
+	 */
+	char *buf = malloc(bytes + 256);
+	size_t len = sprintf(buf, "{\"total_rows\":0,\"offset\":0,\"rows\":[\n");
+	int i = 0;
+	while (len < bytes){
+		len += sprintf(buf + len, "%s{\"id\":\"doc%08d\",\"key\":\"doc%08d\",\"value\":{\"rev\":\"1-%032x\"}}",
+				i ? ",\n" : "", i, i, i*2654435761u);
+		i++;
+	}
+	len += sprintf(buf + len, "\n]}\n");
+	*length = len;
+	return buf;
+}
+static void run(const char *name, PouchReq *pr, char *body, size_t length, int announce){
+	size_t off, chunk = 16*1024;
+	double t0 = now_s();
+	reallocs = 0;
+	pr_clear_resp(pr);
+	if (announce){
+		char header[64];
+		int n = sprintf(header, "Content-Length: %zu\r\n", length);
+		recv_header_callback(header, 1, n, pr);
+	}
+	for (off = 0; off < length; off += chunk){
+		recv_data_callback(body + off, 1, length - off < chunk ? length - off : chunk, pr);
+	}
+	double dt = now_s() - t0;
+	printf("%-22s reallocs=%-6zu %.1f MB/s\n", name, reallocs, length/dt/1e6);
+}
+
+int main(int argc, char *argv[]){
+	size_t mb = argc > 1 ? atoi(argv[1]) : 50;
+	size_t length;
+	char *body = make_all_docs(mb*1024*1024, &length);
+	PouchReq *pr = pr_init();
+	pr_set_method(pr, GET);
+	pr_set_resp_keep(pr, 0);
+	run("chunked, fresh", pr, body, length, 0);
+	run("content-length, fresh", pr, body, length, 1);
+	pr_set_resp_keep(pr, (size_t)-1);
+	run("reused", pr, body, length, 0);
+	pr_free(pr);
+	free(body);
+	return 0;
+}
@@ -0,0 +1,78 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "../src/multi_pouch.h"
+
+/*
+   Measures what pstats_record() costs per request, then
+   sends count GETs and PUTs through a PouchMInfo with a
+   PouchStats attached and prints the latency table.
+
+	./bench_stats [server] [db] [count]
+*/
+
+static int left;
+
+static double now_s(void){
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec/1e6;
+}
+static void finished(PouchReq *pr, PouchMInfo *pmi){
+	left--;
+	pr_free(pr);
+}
+
+int main(int argc, char *argv[]){
+	char *server = argc > 1 ? argv[1] : "http://127.0.0.1:5984";
+	char *db = argc > 2 ? argv[2] : "bench";
+	int count = argc > 3 ? atoi(argv[3]) : 10000;
+	PouchStats *stats = pstats_init();
+	PouchReq *pr = pr_init();
+	struct event_base *base;
+	PouchMInfo *pmi;
+	char id[32];
+	double t0;
+	int i, n = 1000000;
+
+	// recording alone, with made-up timings
+	doc_get(pr, server, db, "some-document");
+	t0 = now_s();
+	for (i = 0; i < n; i++){
+		pr->times.namelookup = 10;
+		pr->times.connect = 50;
+		pr->times.pretransfer = 60;
+		pr->times.starttransfer = 200 + (i & 1023);
+		pr->times.total = 250 + (i & 4095);
+		pstats_record(stats, pr);
+	}
+	printf("pstats_record: %.1f ns/request\n\n", (now_s() - t0)*1e9/n);
+	pstats_reset(stats);
+	pr_free(pr);
+
+	// a real workload
+	base = event_base_new();
+	pmi = pr_mk_pmi(base, NULL, finished, NULL);
+	pmi_set_limits(pmi, 20, 0, 0);
+	pmi_set_stats(pmi, stats);
+	for (i = 0; i < count; i++){
+		pr = pr_init();
+		snprintf(id, sizeof(id), "doc%d", i % 100);
+		if (i % 4){
+			doc_get(pr, server, db, id);
+		} else {
+			doc_create_id(pr, server, db, id, "{\"value\":1}");
+		}
+		pmi_submit(pmi, pr);
+		left++;
+	}
+	while (left > 0){
+		event_base_loop(base, EVLOOP_ONCE);
+	}
+	pstats_print(stats, stdout);
+	pr_del_pmi(pmi);	// frees base too
+	pstats_free(stats);
+	return 0;
+}
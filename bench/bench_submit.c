@@ -0,0 +1,150 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/eventfd.h>
+
+#include "../src/multi_pouch.h"
+
+/*
+   Hands requests from producer threads to a running event
+   loop, once with pmi_send() (a lock-free list) and once with
+   a mutex-protected list plus an eventfd, the usual way of
+   doing it. Reports how long the producers spend per request
+   and the end-to-end throughput.
+
+	./bench_submit [server] [db] [docid] [producers] [count per producer]
+*/
+
+typedef struct {
+	PouchMInfo *pmi;
+	int done;
+	int failed;
+	// the mutex-protected list
+	pthread_mutex_t lock;
+	PouchReq *head;
+	PouchReq *tail;
+	int fd;
+	int signalled;
+} BenchState;
+
+static char *server, *db, *id;
+static int count;
+static int use_mutex;
+static BenchState st;
+
+static double now_s(void){
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec/1e6;
+}
+static void finished(PouchReq *pr, PouchMInfo *pmi){
+	if (pr->curlcode || pr->httpresponse != 200){
+		st.failed++;
+	}
+	st.done++;
+	pr_free(pr);
+}
+static void mutex_send(PouchReq *pr){
+	uint64_t one = 1;
+	int wake;
+	pr->next = NULL;
+	pthread_mutex_lock(&st.lock);
+	if (st.tail){
+		st.tail->next = pr;
+	} else {
+		st.head = pr;
+	}
+	st.tail = pr;
+	wake = !st.signalled;
+	st.signalled = 1;
+	pthread_mutex_unlock(&st.lock);
+	if (wake && write(st.fd, &one, sizeof(one)) < 0){
+		perror("write");
+	}
+}
+static void mutex_cb(int fd, short kind, void *arg){
+	PouchReq *pr, *next;
+	uint64_t n;
+	if (read(fd, &n, sizeof(n)) < 0){
+		return;
+	}
+	pthread_mutex_lock(&st.lock);
+	pr = st.head;
+	st.head = st.tail = NULL;
+	st.signalled = 0;
+	pthread_mutex_unlock(&st.lock);
+	for (; pr; pr = next){
+		next = pr->next;
+		pmi_submit(st.pmi, pr);
+	}
+}
+static void *producer(void *arg){
+	double *spent = (double *)arg;
+	double t0 = now_s();
+	int i;
+	for (i = 0; i < count; i++){
+		PouchReq *pr = doc_get(pr_init(), server, db, id);
+		if (use_mutex){
+			mutex_send(pr);
+		} else {
+			pmi_send(st.pmi, pr);
+		}
+	}
+	*spent = now_s() - t0;
+	return NULL;
+}
+static void run(const char *name, int mutex, int producers){
+	struct event_base *base = event_base_new();
+	struct event *ev = NULL;
+	pthread_t threads[producers];
+	double spent[producers], total = 0, t0;
+	int i;
+	memset(&st, 0, sizeof(st));
+	use_mutex = mutex;
+	st.pmi = pr_mk_pmi(base, NULL, finished, NULL);
+	pmi_set_limits(st.pmi, 50, 0, 0);
+	if (mutex){
+		pthread_mutex_init(&st.lock, NULL);
+		st.fd = eventfd(0, EFD_NONBLOCK);
+		ev = event_new(base, st.fd, EV_READ | EV_PERSIST, mutex_cb, NULL);
+		event_add(ev, NULL);
+	} else {
+		pmi_open_inbox(st.pmi);
+	}
+	t0 = now_s();
+	for (i = 0; i < producers; i++){
+		pthread_create(&threads[i], NULL, producer, &spent[i]);
+	}
+	while (st.done < producers*count){
+		event_base_loop(base, EVLOOP_ONCE);
+	}
+	t0 = now_s() - t0;
+	for (i = 0; i < producers; i++){
+		pthread_join(threads[i], NULL);
+		total += spent[i];
+	}
+	printf("%-8s producers=%d n=%d  %.0f ns/submit (incl. building the request)  %.0f req/s  failed=%d\n",
+			name, producers, producers*count, total*1e9/(producers*count),
+			producers*count/t0, st.failed);
+	if (mutex){
+		event_free(ev);
+		close(st.fd);
+		pthread_mutex_destroy(&st.lock);
+	}
+	pr_del_pmi(st.pmi);	// frees base too
+}
+
+int main(int argc, char *argv[]){
+	server = argc > 1 ? argv[1] : "http://127.0.0.1:5984";
+	db = argc > 2 ? argv[2] : "bench";
+	id = argc > 3 ? argv[3] : "doc";
+	int producers = argc > 4 ? atoi(argv[4]) : 4;
+	count = argc > 5 ? atoi(argv[5]) : 10000;
+
+	run("mutex", 1, producers);
+	run("pmi_send", 0, producers);
+	return 0;
+}
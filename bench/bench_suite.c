@@ -0,0 +1,221 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include "../src/multi_pouch.h"
+
+/*
+   Throughput and latency of the three ways of talking to a
+   server, against a local mock_couch so that the numbers
+   measure pouch rather than CouchDB or the network:
+	- pr_do() from 1, 4 and 16 threads, one PouchReq each
+	- a PouchMInfo with 1 to 256 requests in flight
+	- PouchBulk writes, synchronous and through a PouchMInfo
+   Every line gives requests (or documents) per second and the
+   p50/p99/p99.9 of the request time, in microseconds.
+
+	./bench_suite [count] [latency_ms] [port]
+
+   mock_couch is started from the directory of bench_suite,
+   with latency_ms added to every response, and stopped at
+   the end. Exits with 1 if any request failed.
+*/
+
+static char server[64];
+static int count;
+static int done;
+static PouchHist hist;
+static int total_failed;
+
+static double now_s(void){
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec/1e6;
+}
+static void report(const char *name, int level, double secs, const char *unit, int n, int failed){
+	printf("%-12s %5d %10.0f %-7s %8llu %8llu %8llu %7d\n", name, level, n/secs, unit,
+			(unsigned long long)phist_percentile(&hist, 50),
+			(unsigned long long)phist_percentile(&hist, 99),
+			(unsigned long long)phist_percentile(&hist, 99.9), failed);
+	phist_reset(&hist);
+	total_failed += failed;
+}
+static pid_t start_mock(const char *self, const char *port, const char *latency){
+	/*
+	   Runs mock_couch and waits until it answers;
+	   returns its pid, or 0 if it never came up.
+	 */
+	char path[512];
+	const char *slash = strrchr(self, '/');
+	PouchReq *pr = pr_init();
+	pid_t pid;
+	int i;
+	snprintf(path, sizeof(path), "%.*smock_couch", slash ? (int)(slash - self + 1) : 0, self);
+	if ((pid = fork()) == 0){
+		execl(path, path, "-p", port, "-l", latency, (char *)NULL);
+		perror(path);
+		_exit(1);
+	}
+	for (i = 0; i < 100; i++){
+		usleep(20000);
+		if (pid < 0 || waitpid(pid, NULL, WNOHANG) != 0){
+			break;
+		}
+		if (pr_do(get_all_dbs(pr, server))->httpresponse == 200){
+			pr_free(pr);
+			return pid;
+		}
+	}
+	pr_free(pr);
+	return 0;
+}
+
+// pr_do(), one PouchReq per thread
+typedef struct {
+	int n;
+	int failed;
+	PouchHist hist;
+} Worker;
+
+static void *sync_worker(void *arg){
+	Worker *w = (Worker *)arg;
+	PouchReq *pr = pr_init();
+	int i;
+	for (i = 0; i < w->n; i++){
+		pr_do(doc_get(pr, server, "db", "doc"));
+		if (pr->curlcode || pr->httpresponse != 200){
+			w->failed++;
+		}
+		phist_record(&w->hist, pr->times.total);
+	}
+	pr_free(pr);
+	return NULL;
+}
+static void run_sync(int threads){
+	pthread_t tid[threads];
+	Worker *w = calloc(threads, sizeof(Worker));
+	double t0 = now_s();
+	int i, failed = 0;
+	for (i = 0; i < threads; i++){
+		w[i].n = count/threads;
+		pthread_create(&tid[i], NULL, sync_worker, &w[i]);
+	}
+	for (i = 0; i < threads; i++){
+		pthread_join(tid[i], NULL);
+		phist_merge(&hist, &w[i].hist);
+		failed += w[i].failed;
+	}
+	report("pr_do", threads, now_s() - t0, "req/s", count/threads*threads, failed);
+	free(w);
+}
+
+// a PouchMInfo
+static int failed;
+
+static void multi_done(PouchReq *pr, PouchMInfo *pmi){
+	if (pr->curlcode || pr->httpresponse != 200){
+		failed++;
+	}
+	phist_record(&hist, pr->times.total);
+	done++;
+	pr_free(pr);
+}
+static void run_multi(int inflight){
+	struct event_base *base = event_base_new();
+	PouchMInfo *pmi = pr_mk_pmi(base, NULL, multi_done, NULL);
+	double t0 = now_s();
+	int i;
+	pmi_set_limits(pmi, inflight, 0, 0);
+	done = failed = 0;
+	for (i = 0; i < count; i++){
+		pmi_submit(pmi, doc_get(pr_init(), server, "db", "doc"));
+	}
+	while (done < count){
+		event_base_loop(base, EVLOOP_ONCE);
+	}
+	report("pr_domulti", inflight, now_s() - t0, "req/s", count, failed);
+	pr_del_pmi(pmi);	// frees base too
+}
+
+// PouchBulk
+static void bulk_result(PouchBulk *pb, size_t i, char *id, char *rev, char *error, char *reason){
+	if (error){
+		failed++;
+	}
+	if (i == 0 && !pb->submit){	// pb->pr made the request
+		phist_record(&hist, pb->pr->times.total);
+	}
+	done++;
+}
+static void run_bulk(int batch, int async){
+	struct event_base *base = NULL;
+	PouchMInfo *pmi = NULL;
+	PouchStats *stats = NULL;
+	PouchBulk *pb = pb_init(server, "db", bulk_result, NULL);
+	double t0;
+	char doc[64];
+	int i, n = count*10/batch*batch;	// documents are cheaper than requests
+	pb_set_limits(pb, batch, 0, 0);
+	if (async){
+		base = event_base_new();
+		pmi = pr_mk_pmi(base, NULL, NULL, NULL);
+		pmi_set_limits(pmi, 64, 0, 0);	// flushes are all submitted at once
+		stats = pstats_init();
+		pmi_set_stats(pmi, stats);
+		pb_use_pmi(pb, pmi);
+	}
+	done = failed = 0;
+	t0 = now_s();
+	for (i = 0; i < n; i++){
+		snprintf(doc, sizeof(doc), "{\"_id\":\"doc%d\",\"value\":%d}", i, i);
+		pb_add(pb, doc);
+	}
+	pb_free(pb);
+	while (done < n){
+		event_base_loop(base, EVLOOP_ONCE);
+	}
+	if (async){
+		phist_merge(&hist, pstats_hist(stats, POUCH_M_POST, POUCH_EP_BULK, POUCH_T_TOTAL));
+	}
+	report(async ? "pb+pmi" : "pb", batch, now_s() - t0, "docs/s", n, failed);
+	if (async){
+		pr_del_pmi(pmi);
+		pstats_free(stats);
+	}
+}
+
+int main(int argc, char *argv[]){
+	char *latency = argc > 2 ? argv[2] : "0";
+	char *port = argc > 3 ? argv[3] : "5985";
+	int levels[] = {1, 8, 64, 256}, i;
+	pid_t mock;
+
+	count = argc > 1 ? atoi(argv[1]) : 20000;
+	snprintf(server, sizeof(server), "http://127.0.0.1:%s", port);
+	pr_global_init();	// before any thread is started
+	if (!(mock = start_mock(argv[0], port, latency))){
+		fprintf(stderr, "bench_suite: mock_couch did not start on port %s\n", port);
+		return 1;
+	}
+	printf("%d requests, %sms server latency\n", count, latency);
+	printf("%-12s %5s %18s %8s %8s %8s %7s\n", "path", "conc", "throughput", "p50", "p99", "p99.9", "failed");
+	for (i = 1; i <= 16; i *= 4){
+		run_sync(i);
+	}
+	for (i = 0; i < 4; i++){
+		run_multi(levels[i]);
+	}
+	run_bulk(100, 0);
+	run_bulk(1000, 0);
+	run_bulk(100, 1);
+	run_bulk(1000, 1);
+
+	kill(mock, SIGTERM);
+	waitpid(mock, NULL, 0);
+	return total_failed ? 1 : 0;	// for make test
+}
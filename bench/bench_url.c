@@ -0,0 +1,90 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "../src/pouch.h"
+
+/*
+   Measures request construction alone (no network): a
+   doc_get_rev()-style URL plus a few parameters, once built
+   with the old pr_set_url() + combine() chain and strcat
+   parameters, once with pr_set_path() and pr_add_param(),
+   and once through a PouchDb handle.
+
+	./bench_url [count]
+*/
+
+static double now_s(void){
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec/1e6;
+}
+static PouchReq *old_add_param(PouchReq *pr, char *key, char *value){
+	// pr_add_param() as it used to be
+	pr->url = (char *)realloc(pr->url,
+			strlen(pr->url) + 3 + sizeof(char)*(strlen(key)+strlen(value)));
+	if (strchr(pr->url, '?') == NULL){
+		strcat(pr->url, "?");
+	}
+	else{
+		strcat(pr->url, "&");
+	}
+	strcat(pr->url, key);
+	strcat(pr->url, "=");
+	strcat(pr->url, value);
+	return pr;
+}
+static void old_build(PouchReq *pr, char *server, char *db, char *id, char *rev){
+	pr_set_method(pr, GET);
+	pr_set_url(pr, server);
+	pr->url = combine(&(pr->url), pr->url, db, "/");
+	pr->url = combine(&(pr->url), pr->url, id, "/");
+	old_add_param(pr, "rev", rev);
+	old_add_param(pr, "revs_info", "true");
+	old_add_param(pr, "conflicts", "true");
+}
+static void new_build(PouchReq *pr, char *server, char *db, char *id, char *rev){
+	doc_get_rev(pr, server, db, id, rev);
+	pr_add_param(pr, "revs_info", "true");
+	pr_add_param(pr, "conflicts", "true");
+}
+static void pdb_build(PouchReq *pr, PouchDb *pdb, char *id, char *rev){
+	pdb_doc_get_rev(pr, pdb, id, rev);
+	pr_add_param(pr, "revs_info", "true");
+	pr_add_param(pr, "conflicts", "true");
+}
+
+int main(int argc, char *argv[]){
+	int count = argc > 1 ? atoi(argv[1]) : 1000000;
+	char *server = "http://127.0.0.1:5984";
+	char *db = "benchmark_database";
+	char *id = "user:0123456789abcdef";
+	char *rev = "12-0123456789abcdef0123456789abcdef";
+	PouchReq *pr = pr_init();
+	PouchDb *pdb = pdb_init(server, db, NULL);
+	double t0;
+	int i;
+
+	t0 = now_s();
+	for (i = 0; i < count; i++){
+		old_build(pr, server, db, id, rev);
+	}
+	printf("combine:  %.1f ns/request  %s\n", (now_s() - t0)*1e9/count, pr->url);
+
+	t0 = now_s();
+	for (i = 0; i < count; i++){
+		new_build(pr, server, db, id, rev);
+	}
+	printf("set_path: %.1f ns/request  %s\n", (now_s() - t0)*1e9/count, pr->url);
+
+	t0 = now_s();
+	for (i = 0; i < count; i++){
+		pdb_build(pr, pdb, id, rev);
+	}
+	printf("pouchdb:  %.1f ns/request  %s\n", (now_s() - t0)*1e9/count, pr->url);
+
+	pdb_free(pdb);
+	pr_free(pr);
+	return 0;
+}
@@ -0,0 +1,404 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <signal.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <zlib.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/queue.h>
+
+#include <event2/event.h>
+#include <event2/http.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/listener.h>
+#include <event2/keyvalq_struct.h>
+
+#include "../src/pouch_json.h"
+
+/*
+   A stand-in for CouchDB, for benchmarks that must not
+   depend on a real server or the network. It answers the
+   requests pouch makes with canned but well-formed
+   responses: documents (with ETags), writes, _bulk_docs,
+   _bulk_get, _all_docs, _changes and attachments. Nothing
+   is stored; _bulk_get reports ids starting with "deleted"
+   as deleted and those starting with "missing" as not found.
+
+	./mock_couch [-p port] [-l latency_ms] [-s status] [-e error_pct]
+	             [-b doc_bytes] [-r rows]
+
+   -l delays every response, -s answers every request with
+   that status, -e fails that percentage of requests with a 503,
+   -b pads documents (and sizes attachments), -r is the number
+   of rows _all_docs returns without keys or limit. A request
+   can override them with the query parameters mock_delay,
+   mock_status and mock_size.
+*/
+
+typedef struct {
+	long latency;	// ms
+	int status;		// 0 = answer normally
+	int error_pct;
+	size_t doc_bytes;
+	int rows;
+	unsigned long served;
+} MockConfig;
+
+typedef struct {
+	struct evhttp_request *req;
+	int status;
+	struct evbuffer *body;
+} MockReply;
+
+static MockConfig cfg = {0, 0, 0, 200, 100, 0};
+static struct event_base *base;
+
+static void send_reply(MockReply *r){
+	evhttp_add_header(evhttp_request_get_output_headers(r->req), "Content-Type", "application/json");
+	evhttp_send_reply(r->req, r->status, NULL, r->body);
+	evbuffer_free(r->body);
+	free(r);
+}
+static void delayed_cb(evutil_socket_t fd, short kind, void *arg){
+	send_reply((MockReply *)arg);
+}
+static void finish(MockReply *r, long delay){
+	if (delay > 0){
+		struct timeval tv = {delay/1000, (delay%1000)*1000};
+		event_base_once(base, -1, EV_TIMEOUT, delayed_cb, r, &tv);
+	} else {
+		send_reply(r);
+	}
+}
+static void add_doc(struct evbuffer *out, const char *id, size_t bytes){
+	// a document padded to about bytes bytes
+	static char pad[4096];
+	size_t len = strlen(id) + 40;
+	if (!pad[0]){
+		memset(pad, 'x', sizeof(pad));
+	}
+	evbuffer_add_printf(out, "{\"_id\":\"%s\",\"_rev\":\"1-mock\",\"pad\":\"", id);
+	for (len = bytes > len ? bytes - len : 0; len; ){
+		size_t n = len < sizeof(pad) ? len : sizeof(pad);
+		evbuffer_add(out, pad, n);
+		len -= n;
+	}
+	evbuffer_add_printf(out, "\"}");
+}
+static char *request_body(struct evhttp_request *req, size_t *len){
+	/*
+	   The body as one malloc()'d, null terminated string,
+	   inflated if it was sent with Content-Encoding: gzip.
+	   NULL if that isn't a complete gzip stream.
+	 */
+	struct evbuffer *in = evhttp_request_get_input_buffer(req);
+	const char *enc = evhttp_find_header(evhttp_request_get_input_headers(req), "Content-Encoding");
+	size_t n = evbuffer_get_length(in);
+	unsigned char *raw = evbuffer_pullup(in, -1);
+	char *out;
+	if (enc && !strcasecmp(enc, "gzip")){
+		z_stream zs;
+		size_t cap = n*8 + 1024;
+		int ret;
+		memset(&zs, 0, sizeof(zs));
+		if (inflateInit2(&zs, 15 + 16) != Z_OK || !(out = malloc(cap))){
+			return NULL;
+		}
+		zs.next_in = raw;
+		zs.avail_in = n;
+		do {
+			if (zs.total_out + 1 >= cap){
+				char *grown = realloc(out, cap *= 2);
+				if (!grown){
+					break;
+				}
+				out = grown;
+			}
+			zs.next_out = (Bytef *)out + zs.total_out;
+			zs.avail_out = cap - zs.total_out - 1;
+			ret = inflate(&zs, Z_NO_FLUSH);
+		} while (ret == Z_OK);
+		*len = zs.total_out;
+		inflateEnd(&zs);
+		if (ret != Z_STREAM_END){
+			free(out);
+			return NULL;
+		}
+	} else {
+		if (!(out = malloc(n + 1))){
+			return NULL;
+		}
+		memcpy(out, raw, n);
+		*len = n;
+	}
+	out[*len] = '\0';
+	return out;
+}
+static void bulk_docs(struct evbuffer *out, const char *body, size_t len){
+	// one result per document, with the _id it was sent with
+	const char *end = body + len, *doc;
+	int i = 0;
+	evbuffer_add(out, "[", 1);
+	for (doc = pj_array_first(pj_find_member(body, end, "docs"), end); doc; doc = pj_array_next(doc, end), i++){
+		char *id = pj_dup_string(pj_find_member(doc, end, "_id"), end);
+		if (id){
+			evbuffer_add_printf(out, "%s{\"ok\":true,\"id\":\"%s\",\"rev\":\"1-mock\"}", i ? "," : "", id);
+		} else {
+			evbuffer_add_printf(out, "%s{\"ok\":true,\"id\":\"mock-%d\",\"rev\":\"1-mock\"}", i ? "," : "", i);
+		}
+		free(id);
+	}
+	evbuffer_add(out, "]", 1);
+}
+static void bulk_get(struct evbuffer *out, const char *body, size_t len, size_t doc_bytes){
+	// one result per {"id","rev"} asked for, in order
+	const char *end = body + len, *doc;
+	int i = 0;
+	evbuffer_add_printf(out, "{\"results\":[");
+	for (doc = pj_array_first(pj_find_member(body, end, "docs"), end); doc; doc = pj_array_next(doc, end), i++){
+		char *id = pj_dup_string(pj_find_member(doc, end, "id"), end);
+		const char *k = id ? id : "";
+		evbuffer_add_printf(out, "%s{\"id\":\"%s\",\"docs\":[", i ? "," : "", k);
+		if (!strncmp(k, "deleted", 7)){
+			evbuffer_add_printf(out, "{\"ok\":{\"_id\":\"%s\",\"_rev\":\"2-mock\",\"_deleted\":true}}", k);
+		} else if (!strncmp(k, "missing", 7)){
+			evbuffer_add_printf(out, "{\"error\":{\"id\":\"%s\",\"rev\":\"undefined\",\"error\":\"not_found\",\"reason\":\"missing\"}}", k);
+		} else {
+			evbuffer_add(out, "{\"ok\":", 6);
+			add_doc(out, k, doc_bytes);
+			evbuffer_add(out, "}", 1);
+		}
+		evbuffer_add(out, "]}", 2);
+		free(id);
+	}
+	evbuffer_add(out, "]}", 2);
+}
+static void all_docs_row(struct evbuffer *out, int first, const char *id, size_t doc_bytes){
+	evbuffer_add_printf(out, "%s{\"id\":\"%s\",\"key\":\"%s\",\"value\":{\"rev\":\"1-mock\"}",
+			first ? "" : ",", id, id);
+	if (doc_bytes){	// include_docs
+		evbuffer_add(out, ",\"doc\":", 7);
+		add_doc(out, id, doc_bytes);
+	}
+	evbuffer_add(out, "}", 1);
+}
+static void all_docs(struct evbuffer *out, const char *body, size_t len, int rows, size_t doc_bytes){
+	/*
+	   The rows for the keys POSTed in body, or rows made-up
+	   ones (doc000000, doc000001, ...) without a body.
+	 */
+	const char *end = body ? body + len : NULL, *key;
+	char id[32];
+	int i = 0;
+	evbuffer_add_printf(out, "{\"total_rows\":%d,\"offset\":0,\"rows\":[", rows);
+	if (body && (key = pj_find_member(body, end, "keys"))){
+		for (key = pj_array_first(key, end); key; key = pj_array_next(key, end), i++){
+			char *k = pj_dup_string(key, end);
+			all_docs_row(out, !i, k ? k : "", doc_bytes);
+			free(k);
+		}
+	} else {
+		for (; i < rows; i++){
+			snprintf(id, sizeof(id), "doc%06d", i);
+			all_docs_row(out, !i, id, doc_bytes);
+		}
+	}
+	evbuffer_add(out, "]}", 2);
+}
+static void handle(struct evhttp_request *req, void *arg){
+	MockReply *r = calloc(1, sizeof(MockReply));
+	const struct evhttp_uri *uri = evhttp_request_get_evhttp_uri(req);
+	const char *path = evhttp_uri_get_path(uri), *query = evhttp_uri_get_query(uri), *v;
+	enum evhttp_cmd_type cmd = evhttp_request_get_command(req);
+	struct evkeyvalq params;
+	char seg[3][256];
+	int n = 0, status = cfg.status;
+	long delay = cfg.latency;
+	size_t bytes = cfg.doc_bytes, len = 0;
+	char *body = NULL;
+
+	/*
+	   Without TCP_NODELAY a response written in two parts
+	   waits for the client's delayed ACK (40ms on Linux).
+	 */
+	if (evhttp_request_get_connection(req)){
+		int one = 1;
+		evutil_socket_t fd = bufferevent_getfd(evhttp_connection_get_bufferevent(evhttp_request_get_connection(req)));
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	}
+	r->req = req;
+	r->body = evbuffer_new();
+	r->status = 200;
+	cfg.served++;
+
+	// per-request overrides
+	memset(&params, 0, sizeof(params));
+	evhttp_parse_query_str(query ? query : "", &params);
+	if ((v = evhttp_find_header(&params, "mock_delay"))){
+		delay = atol(v);
+	}
+	if ((v = evhttp_find_header(&params, "mock_status"))){
+		status = atoi(v);
+	}
+	if ((v = evhttp_find_header(&params, "mock_size"))){
+		bytes = strtoul(v, NULL, 10);
+	}
+	if (!status && cfg.error_pct && rand()%100 < cfg.error_pct){
+		status = 503;
+	}
+	if (status){
+		r->status = status;
+		evbuffer_add_printf(r->body, "{\"error\":\"mock\",\"reason\":\"status %d\"}", status);
+		evhttp_clear_headers(&params);
+		finish(r, delay);
+		return;
+	}
+
+	// split the path into at most 3 segments
+	for (path = path ? path : "/"; *path && n < 3; ){
+		size_t l;
+		path += strspn(path, "/");
+		l = strcspn(path, "/");
+		if (!l){
+			break;
+		}
+		if (n == 1 && (!strncmp(path, "_design/", 8) || !strncmp(path, "_local/", 7))){
+			l += 1 + strcspn(path + l + 1, "/");	// the id includes the prefix
+		}
+		snprintf(seg[n++], sizeof(seg[0]), "%.*s", (int)l, path);
+		path += l;
+	}
+
+	if ((cmd == EVHTTP_REQ_PUT || cmd == EVHTTP_REQ_POST) && !(body = request_body(req, &len))){
+		r->status = 400;
+		evbuffer_add_printf(r->body, "{\"error\":\"bad_request\",\"reason\":\"invalid gzip body\"}");
+	} else if (n == 0){
+		evbuffer_add_printf(r->body, "{\"couchdb\":\"Welcome\",\"version\":\"3.3.0\",\"vendor\":{\"name\":\"mock\"}}");
+	} else if (seg[0][0] == '_'){
+		evbuffer_add_printf(r->body, !strcmp(seg[0], "_all_dbs") ? "[\"db\"]" : "{\"ok\":true}");
+	} else if (n == 1){
+		if (cmd == EVHTTP_REQ_PUT){
+			r->status = 201;
+			evbuffer_add_printf(r->body, "{\"ok\":true}");
+		} else if (cmd == EVHTTP_REQ_POST){
+			r->status = 201;
+			evbuffer_add_printf(r->body, "{\"ok\":true,\"id\":\"mock-%lu\",\"rev\":\"1-mock\"}", cfg.served);
+		} else {
+			evbuffer_add_printf(r->body, "{\"db_name\":\"%s\",\"doc_count\":%d,\"update_seq\":\"0\"}", seg[0], cfg.rows);
+		}
+	} else if (!strcmp(seg[1], "_bulk_docs")){
+		r->status = 201;
+		bulk_docs(r->body, body ? body : "", len);
+	} else if (!strcmp(seg[1], "_bulk_get")){
+		bulk_get(r->body, body ? body : "", len, bytes);
+	} else if (!strcmp(seg[1], "_all_docs")){
+		int rows = cfg.rows;
+		if ((v = evhttp_find_header(&params, "limit"))){
+			rows = atoi(v);
+		}
+		v = evhttp_find_header(&params, "include_docs");
+		all_docs(r->body, body, len, rows, v && !strcmp(v, "true") ? bytes : 0);
+	} else if (!strcmp(seg[1], "_changes")){
+		evbuffer_add_printf(r->body, "{\"results\":[],\"last_seq\":\"0\"}");
+	} else if (n == 3){	// an attachment
+		static char blob[65536];
+		if (cmd == EVHTTP_REQ_PUT){
+			r->status = 201;
+			evbuffer_add_printf(r->body, "{\"ok\":true,\"id\":\"%s\",\"rev\":\"2-mock\"}", seg[1]);
+		} else {
+			for (len = bytes; len; ){
+				size_t k = len < sizeof(blob) ? len : sizeof(blob);
+				evbuffer_add(r->body, blob, k);
+				len -= k;
+			}
+		}
+	} else if (cmd == EVHTTP_REQ_PUT){
+		r->status = 201;
+		evbuffer_add_printf(r->body, "{\"ok\":true,\"id\":\"%s\",\"rev\":\"2-mock\"}", seg[1]);
+	} else if (cmd == EVHTTP_REQ_DELETE){
+		evbuffer_add_printf(r->body, "{\"ok\":true,\"id\":\"%s\",\"rev\":\"3-mock\"}", seg[1]);
+	} else {	// GET or HEAD of a document
+		const char *inm = NULL;
+		struct evkeyval *h;
+		int inms = 0;
+		TAILQ_FOREACH(h, evhttp_request_get_input_headers(req), next){
+			if (!strcasecmp(h->key, "If-None-Match")){
+				inm = h->value;
+				inms++;
+			}
+		}
+		// a quoted header ahead of the ETag, as a proxy may add
+		evhttp_add_header(evhttp_request_get_output_headers(req), "X-Mock-Via", "\"proxy\"");
+		evhttp_add_header(evhttp_request_get_output_headers(req), "ETag", "\"1-mock\"");
+		if (inms > 1){	// a client that never resets its headers
+			r->status = 400;
+			evbuffer_add_printf(r->body, "{\"error\":\"bad_request\",\"reason\":\"repeated If-None-Match\"}");
+		} else if (inm && !strcmp(inm, "\"1-mock\"")){
+			r->status = 304;
+		} else {
+			add_doc(r->body, seg[1], bytes);
+		}
+	}
+	free(body);
+	evhttp_clear_headers(&params);
+	finish(r, delay);
+}
+static void stop_cb(evutil_socket_t sig, short kind, void *arg){
+	event_base_loopbreak(base);
+}
+
+int main(int argc, char *argv[]){
+	struct evhttp *http;
+	struct evconnlistener *listener;
+	struct sockaddr_in sin;
+	struct event *term, *intr;
+	int port = 5985, opt;
+
+	while ((opt = getopt(argc, argv, "p:l:s:e:b:r:")) != -1){
+		switch (opt){
+			case 'p': port = atoi(optarg); break;
+			case 'l': cfg.latency = atol(optarg); break;
+			case 's': cfg.status = atoi(optarg); break;
+			case 'e': cfg.error_pct = atoi(optarg); break;
+			case 'b': cfg.doc_bytes = strtoul(optarg, NULL, 10); break;
+			case 'r': cfg.rows = atoi(optarg); break;
+			default:
+				fprintf(stderr, "usage: %s [-p port] [-l latency_ms] [-s status] [-e error_pct] [-b doc_bytes] [-r rows]\n", argv[0]);
+				return 1;
+		}
+	}
+	signal(SIGPIPE, SIG_IGN);
+	base = event_base_new();
+	http = evhttp_new(base);
+	evhttp_set_allowed_methods(http, EVHTTP_REQ_GET | EVHTTP_REQ_HEAD | EVHTTP_REQ_PUT
+			| EVHTTP_REQ_POST | EVHTTP_REQ_DELETE);
+	evhttp_set_max_body_size(http, 256*1024*1024);
+	evhttp_set_gencb(http, handle, NULL);
+	// a deep accept queue: a burst of connects would otherwise see SYN retries (1s)
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(port);
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	listener = evconnlistener_new_bind(base, NULL, NULL, LEV_OPT_CLOSE_ON_FREE | LEV_OPT_REUSEABLE,
+			4096, (struct sockaddr *)&sin, sizeof(sin));
+	if (!listener || !evhttp_bind_listener(http, listener)){
+		fprintf(stderr, "mock_couch: can't listen on 127.0.0.1:%d\n", port);
+		return 1;
+	}
+	term = evsignal_new(base, SIGTERM, stop_cb, NULL);
+	intr = evsignal_new(base, SIGINT, stop_cb, NULL);
+	event_add(term, NULL);
+	event_add(intr, NULL);
+	event_base_dispatch(base);
+	fprintf(stderr, "mock_couch: served %lu requests\n", cfg.served);
+	event_free(term);
+	event_free(intr);
+	evhttp_free(http);
+	event_base_free(base);
+	return 0;
+}
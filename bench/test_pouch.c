@@ -0,0 +1,335 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+
+#include "../src/multi_pouch.h"
+
+/*
+   Regression checks run by make test, against a local
+   mock_couch. Each check prints ok or FAIL; the exit
+   status is the number of failures.
+
+	./test_pouch [port]
+*/
+
+static char server[64];
+static int failures;
+static int finished;
+
+#define check(what, cond) do { \
+		printf("%-4s %s\n", (cond) ? "ok" : "FAIL", what); \
+		failures += !(cond); \
+	} while (0)
+
+static pid_t start_mock(const char *self, const char *port){
+	// as in bench_suite: runs mock_couch and waits until it answers
+	char path[512];
+	const char *slash = strrchr(self, '/');
+	PouchReq *pr = pr_init();
+	pid_t pid;
+	int i;
+	snprintf(path, sizeof(path), "%.*smock_couch", slash ? (int)(slash - self + 1) : 0, self);
+	if ((pid = fork()) == 0){
+		execl(path, path, "-p", port, (char *)NULL);
+		perror(path);
+		_exit(1);
+	}
+	for (i = 0; i < 100; i++){
+		usleep(20000);
+		if (pid < 0 || waitpid(pid, NULL, WNOHANG) != 0){
+			break;
+		}
+		if (pr_do(get_all_dbs(pr, server))->httpresponse == 200){
+			pr_free(pr);
+			return pid;
+		}
+	}
+	pr_free(pr);
+	return 0;
+}
+
+// the PouchReqs stay with the caller, to be reused
+static void keep_cb(PouchReq *pr, PouchMInfo *pmi){
+	finished++;
+}
+static PouchReq *run_multi(PouchMInfo *pmi, PouchReq *pr){
+	// sends pr through pmi and waits for it
+	finished = 0;
+	pmi_submit(pmi, pr);
+	while (!finished){
+		event_base_loop(pmi->base, EVLOOP_ONCE);
+	}
+	return pr;
+}
+
+static void test_multi_reuse(PouchMInfo *pmi){
+	/*
+	   A gzipped PUT adds Content-Encoding: gzip to the
+	   request's headers; a small PUT sent with the same
+	   PouchReq afterwards must not carry it, or the
+	   server fails to inflate its body.
+	 */
+	PouchReq *pr = pr_init();
+	char big[4096];
+	memset(big, ' ', sizeof(big));
+	memcpy(big, "{\"pad\":\"", 8);
+	strcpy(big + sizeof(big) - 3, "\"}");
+	pr_set_gzip(pr, 1024, 6);
+	run_multi(pmi, doc_create_id(pr, server, "db", "big", big));
+	check("multi: gzipped PUT", pr->httpresponse == 201);
+	run_multi(pmi, doc_create_id(pr, server, "db", "small", "{}"));
+	check("multi: small PUT after a gzipped one, same PouchReq", pr->httpresponse == 201);
+	check("multi: no headers left after a request", !pr->headers);
+	pr_free(pr);
+}
+
+static void test_conditional_get(PouchMInfo *pmi){
+	/*
+	   pdb_doc_get() adds If-None-Match for a cached
+	   document. Every mock document has the same ETag,
+	   so if that header outlived its request, reading
+	   an uncached document with the same PouchReq would
+	   get a 304 and no body.
+	 */
+	PouchDb *pdb = pdb_init(server, "db", NULL);
+	PouchReq *pr = pr_init();
+	pdb_set_doccache(pdb, 1 << 20);
+	run_multi(pmi, pdb_doc_get(pr, pdb, "a"));
+	check("multi: pdb_doc_get() of a new document", pr->httpresponse == 200);
+	run_multi(pmi, pdb_doc_get(pr, pdb, "a"));
+	check("multi: pdb_doc_get() of a cached document is served from the cache",
+			pr->httpresponse == 200 && pdb->docs->not_modified == 1
+			&& strstr(pr->resp.data, "\"_id\":\"a\""));
+	run_multi(pmi, pdb_doc_get(pr, pdb, "b"));
+	check("multi: pdb_doc_get() of another document, same PouchReq",
+			pr->httpresponse == 200 && pdb->docs->not_modified == 1);
+	run_multi(pmi, pdb_doc_get(pr, pdb, "a"));
+	check("multi: and the cached one again", pr->httpresponse == 200 && pdb->docs->not_modified == 2);
+	pr_free(pr);
+	pdb_free(pdb);
+}
+
+static void test_pdb_free_in_flight(PouchMInfo *pmi){
+	/*
+	   pdb_free() while a request made through a cached
+	   PouchDb is running: the request's hook must still
+	   find the handle when it finishes, and must not run
+	   again if pr is sent once more.
+	 */
+	PouchDb *pdb = pdb_init(server, "db", NULL);
+	PouchReq *pr = pr_init();
+	pdb_set_doccache(pdb, 1 << 20);
+	pr_add_param(pdb_doc_get(pr, pdb, "inflight"), "mock_delay", "100");
+	finished = 0;
+	pmi_submit(pmi, pr);
+	pdb_free(pdb);
+	while (!finished){
+		event_base_loop(pmi->base, EVLOOP_ONCE);
+	}
+	check("multi: pdb_free() with a request in flight", pr->httpresponse == 200 && !pr->done);
+	check("pr_do() again after pdb_free()", pr_do(pr)->httpresponse == 200);
+	pr_free(pr);
+}
+
+static void test_fdsink_short_write(void){
+	/*
+	   A response smaller than the fd sink's buffer is
+	   only written when it ends; if that write fails
+	   the request must not look successful.
+	 */
+	PouchReq *pr = pr_init();
+	int fd = open("/dev/full", O_WRONLY);
+	if (fd < 0){
+		return;
+	}
+	pr_do(doc_get(pr_set_fdsink(pr, fd), server, "db", "a"));
+	check("pr_set_fdsink(): a failed final write is reported", pr->curlcode == CURLE_WRITE_ERROR);
+	pr_free(pr);
+	close(fd);
+}
+
+static void test_bulk_get_deleted(void){
+	/*
+	   doc_parse_many() reports a deleted document the
+	   same way whether it came from _all_docs or from
+	   _bulk_get: error "deleted", and no doc.
+	 */
+	PouchReq *pr = pr_init();
+	char *ids[] = {"a", "deleted-b", "missing-c"};
+	char *revs[] = {NULL, NULL, NULL};
+	PouchDoc *d;
+	pr_do(doc_get_many(pr, server, "db", ids, revs, 3));
+	d = doc_parse_many(pr, 3);
+	check("_bulk_get: a document", d && d[0].doc && !d[0].error && !strcmp(d[0].rev, "1-mock"));
+	check("_bulk_get: a deleted document has no doc", d && d[1].deleted && !d[1].doc
+			&& d[1].error && !strcmp(d[1].error, "deleted") && !strcmp(d[1].rev, "2-mock"));
+	check("_bulk_get: a missing document", d && !d[2].doc && d[2].error && !strcmp(d[2].error, "not_found"));
+	doc_free_many(d, 3);
+	pr_free(pr);
+}
+
+static void test_escaped_urls(void){
+	/*
+	   Path segments are percent-encoded, except for the
+	   slashes of a _design/ path and the one after _local/.
+	 */
+	struct { char *db, *id, *name, *path; } cases[] = {
+		{"db", "plain-id_1.x~", NULL, "/db/plain-id_1.x~"},
+		{"db", "a/b", NULL, "/db/a%2Fb"},
+		{"db", "user:1", NULL, "/db/user%3A1"},
+		{"db", "caf\xc3\xa9 ok?", NULL, "/db/caf%C3%A9%20ok%3F"},
+		{"my/db", "a", NULL, "/my%2Fdb/a"},
+		{"db", "_design/app", NULL, "/db/_design/app"},
+		{"db", "_design/app/_view/by_x", NULL, "/db/_design/app/_view/by_x"},
+		{"db", "_design/app:1/_view/by x", NULL, "/db/_design/app%3A1/_view/by%20x"},
+		{"db", "_local/a/b", NULL, "/db/_local/a%2Fb"},
+		{"db", "a/b", "c/d.txt", "/db/a%2Fb/c%2Fd.txt"},
+		{"db", "_design/app", "logo.png", "/db/_design/app/logo.png"},
+	};
+	PouchReq *pr = pr_init();
+	char what[128], url[256];
+	size_t i;
+	for (i = 0; i < sizeof(cases)/sizeof(*cases); i++){
+		if (cases[i].name){
+			doc_get_attachment(pr, server, cases[i].db, cases[i].id, cases[i].name);
+		} else {
+			doc_get(pr, server, cases[i].db, cases[i].id);
+		}
+		snprintf(url, sizeof(url), "%s%s", server, cases[i].path);
+		snprintf(what, sizeof(what), "URL %s", cases[i].path);
+		check(what, !strcmp(pr->url, url));
+	}
+	pr_free(pr);
+}
+
+static void test_cur_rev(void){
+	/*
+	   pdb_doc_cur_rev() reads the revision from the ETag
+	   header, not from the first quote in the headers:
+	   mock_couch sends a quoted header ahead of it.
+	 */
+	PouchDb *pdb = pdb_init(server, "db", NULL);
+	PouchReq *pr = pr_init();
+	char *rev;
+	pdb_set_revcache(pdb, 1 << 20);
+	rev = pdb_doc_cur_rev(pr, pdb, "x");
+	check("pdb_doc_cur_rev() reads the ETag", rev && !strcmp(rev, "1-mock"));
+	free(rev);
+	rev = pdb_doc_cur_rev(pr, pdb, "x");
+	check("pdb_doc_cur_rev() caches it", rev && !strcmp(rev, "1-mock"));
+	free(rev);
+	pr_free(pr);
+	pdb_free(pdb);
+}
+
+static int aborted;
+static void abort_cb(PouchReq *pr, PouchMInfo *pmi){
+	aborted += pr->curlcode == CURLE_ABORTED_BY_CALLBACK && !pr->httpresponse;
+	pr_free(pr);
+}
+static void test_teardown(void){
+	/*
+	   pr_del_pmi() with requests waiting in a host queue
+	   and in the inbox: none of them may be sent (the
+	   multi handle is about to go), and each must reach
+	   the callback, failed.
+	 */
+	struct event_base *base = event_base_new();
+	PouchMInfo *pmi = pr_mk_pmi(base, NULL, abort_cb, NULL);
+	PouchReq *running = pr_init();
+	char url[128];
+	int i;
+	snprintf(url, sizeof(url), "%s/db/slow?mock_delay=1000", server);
+	pmi_set_limits(pmi, 1, 0, 0);
+	pmi_open_inbox(pmi);
+	pmi_submit(pmi, pr_set_url(pr_set_method(running, GET), url));
+	for (i = 0; i < 3; i++){
+		pmi_submit(pmi, doc_get(pr_init(), server, "db", "queued"));
+		pmi_send(pmi, doc_get(pr_init(), server, "db", "sent"));
+	}
+	pr_del_pmi(pmi);
+	check("pr_del_pmi() fails the queued and sent requests", aborted == 6);
+	// running was dropped with the multi handle it was in
+}
+static void test_retry_teardown(void){
+	/*
+	   pr_del_pmi() while a request waits out its backoff:
+	   the retry timer must not fire into the freed multi
+	   handle, and the request must reach the callback.
+	 */
+	struct event_base *base = event_base_new();
+	PouchMInfo *pmi = pr_mk_pmi(base, NULL, abort_cb, NULL);
+	PouchReq *pr = pr_init();
+	char url[128];
+	snprintf(url, sizeof(url), "%s/db/busy?mock_status=503", server);
+	pr_set_retry(pr_set_url(pr_set_method(pr, GET), url), 5, 5000, 5000, 0);
+	pmi_submit(pmi, pr);
+	while (!pmi->retries){
+		event_base_loop(base, EVLOOP_ONCE);
+	}
+	aborted = 0;
+	pr_del_pmi(pmi);
+	check("pr_del_pmi() fails a request waiting to be retried", aborted == 1);
+}
+
+static int pj_valid(PouchJsonParser *p, const char *doc){
+	// fed in two chunks, so the checks also run across a boundary
+	size_t len = strlen(doc), half = len/2;
+	pj_parser_reset(p);
+	return !pj_feed(p, doc, half) && !pj_feed(p, doc + half, len - half) && !pj_finish(p);
+}
+static void test_pj_feed(void){
+	const char *bad[] = {"{\"a\" 1 \"b\"}", "{\"a\":1 \"b\":2}", "[1 2]", "{\"a\":1,}", "[1,]", "[,1]",
+			"{\"a\"}", "{1:2}", "-abc", "01", "1.", ".5", "1e", "--1", "tru", "{} {}", ""};
+	const char *good[] = {"{\"a\":1,\"b\":[true,false,null]}", "[]", "{}", "-0.5e+3", "\"s\"",
+			" {\"rows\" : [ {\"id\":\"x\"} , 2 ] } "};
+	PouchJsonParser *p = pj_parser_new(NULL, NULL, 2, NULL);
+	char what[96];
+	size_t i;
+	for (i = 0; i < sizeof(bad)/sizeof(*bad); i++){
+		snprintf(what, sizeof(what), "pj_feed() rejects '%s'", bad[i]);
+		check(what, !pj_valid(p, bad[i]));
+	}
+	for (i = 0; i < sizeof(good)/sizeof(*good); i++){
+		snprintf(what, sizeof(what), "pj_feed() accepts '%s'", good[i]);
+		check(what, pj_valid(p, good[i]));
+	}
+	pj_parser_free(p);
+}
+
+int main(int argc, char *argv[]){
+	char *port = argc > 1 ? argv[1] : "5986";
+	struct event_base *base;
+	PouchMInfo *pmi;
+	pid_t mock;
+
+	test_pj_feed();	// needs no server
+
+	snprintf(server, sizeof(server), "http://127.0.0.1:%s", port);
+	test_escaped_urls();	// only builds them
+	pr_global_init();
+	if (!(mock = start_mock(argv[0], port))){
+		fprintf(stderr, "test_pouch: mock_couch did not start on port %s\n", port);
+		return 1;
+	}
+	base = event_base_new();
+	pmi = pr_mk_pmi(base, NULL, keep_cb, NULL);
+
+	test_multi_reuse(pmi);
+	test_conditional_get(pmi);
+	test_pdb_free_in_flight(pmi);
+
+	pr_del_pmi(pmi);	// frees base too
+	test_fdsink_short_write();
+	test_bulk_get_deleted();
+	test_cur_rev();
+	test_teardown();
+	test_retry_teardown();
+	kill(mock, SIGTERM);
+	waitpid(mock, NULL, 0);
+	return failures;
+}
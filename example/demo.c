@@ -171,35 +171,35 @@ int main(int argc, char* argv[]){
 	
 	free(rev); // all done with this revision
 
-	// Delete all the documents on newdb
-	pr = get_all_docs(pr, server, newdb);
+	// Delete all the documents on newdb. Going through a PouchDb
+	// with a revision cache, the revisions listed by _all_docs are
+	// remembered, so deleting needs no HEAD request per document.
+	PouchDb *pdb = pdb_init(server, newdb, NULL);
+	pdb_set_revcache(pdb, 1024*1024);
+	pr = pdb_get_all_docs(pr, pdb);
 	pr_do(pr);
 
 	JsonNode *response = json_decode(pr->resp.data);
 	JsonNode *all_docs = json_find_member(response, "rows");
 	printf("Deleting all docs on %s/%s\n", server, newdb);
 	JsonNode *doc, *del_resp;
-	char *_rev;
 	json_foreach(doc, all_docs){
 		char *id = json_get_string(json_find_member(doc, "id")); // get the doc's id
 		
-		_rev = doc_get_cur_rev(pr, server, newdb, id); // get the doc's revision
-		
-		pr = doc_delete(pr, server, newdb, id, _rev); // delete the doc
-		pr_do(pr);
+		pr = pdb_doc_remove(pr, pdb, id); // delete the doc at its current revision
 
 		del_resp = json_decode(pr->resp.data); // check the response
 		bool ok = json_get_bool(json_find_member(del_resp, "ok"));
 		if (ok)
-			printf("\tDeleted \"%s\"\t(rev= %s )\n", id, _rev);
+			printf("\tDeleted \"%s\"\n", id);
 		else {
-			printf("Unable to delete \"%s\"\t(rev= %s )\n", id, _rev);
+			printf("Unable to delete \"%s\"\n", id);
 			printf("server returned: %s\n", pr->resp.data);
 		}
 		// clean up
 		json_delete(del_resp);
-		free(_rev);
 	}
+	pdb_free(pdb);
 
 	json_delete(doc);
 	json_delete(response);
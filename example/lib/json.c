@@ -29,6 +29,11 @@
 #include <stdlib.h>
 #include <string.h>
 
+#if defined(__GNUC__) && defined(__x86_64__) && !defined(JSON_NO_SIMD)
+#define JSON_SIMD 1
+#include <emmintrin.h>
+#endif
+
 #define out_of_memory() do {                    \
     fprintf(stderr, "Out of memory.\n");    \
     exit(EXIT_FAILURE);                     \
@@ -114,6 +119,112 @@ static void sb_free(SB *sb)
     free(sb->start);
 }
 
+/*
+ * Arena
+ *
+ * json_decode_arena() carves nodes and strings out of large blocks.
+ * Strings are built in a scratch buffer kept by the arena, then copied
+ * in.  json_arena_reset() frees all of it at once but keeps the memory:
+ * if the last decodes needed several blocks, they are replaced by one
+ * block as large as all of them, so decoding the same amount again
+ * calls malloc no more.
+ */
+
+#define ARENA_MIN_BLOCK 65536
+
+typedef struct ArenaBlock ArenaBlock;
+struct ArenaBlock
+{
+    ArenaBlock *next;
+    size_t size;
+    /* followed by size bytes */
+};
+
+struct JsonArena
+{
+    ArenaBlock *blocks; /* newest first; only the newest has free space */
+    char *cur;
+    char *end;
+    SB scratch;
+};
+
+static void arena_grow(JsonArena *arena, size_t need)
+{
+    size_t size = arena->blocks != NULL ? arena->blocks->size * 2 : ARENA_MIN_BLOCK;
+    ArenaBlock *block;
+
+    while (size < need)
+        size *= 2;
+
+    block = (ArenaBlock*) malloc(sizeof(ArenaBlock) + size);
+    if (block == NULL)
+        out_of_memory();
+    block->next = arena->blocks;
+    block->size = size;
+    arena->blocks = block;
+    arena->cur = (char*) (block + 1);
+    arena->end = arena->cur + size;
+}
+
+static void *arena_alloc(JsonArena *arena, size_t size)
+{
+    char *ret;
+
+    size = (size + 7) & ~(size_t)7; /* keep nodes aligned */
+    if ((size_t)(arena->end - arena->cur) < size)
+        arena_grow(arena, size);
+    ret = arena->cur;
+    arena->cur += size;
+    return ret;
+}
+
+JsonArena *json_arena_new(void)
+{
+    JsonArena *arena = (JsonArena*) calloc(1, sizeof(JsonArena));
+    if (arena == NULL)
+        out_of_memory();
+    sb_init(&arena->scratch);
+    return arena;
+}
+
+void json_arena_reset(JsonArena *arena)
+{
+    ArenaBlock *block = arena->blocks;
+    size_t total = 0;
+
+    if (block == NULL)
+        return;
+
+    if (block->next == NULL) {
+        arena->cur = (char*) (block + 1);
+        arena->end = arena->cur + block->size;
+        return;
+    }
+
+    while (block != NULL) {
+        ArenaBlock *next = block->next;
+        total += block->size;
+        free(block);
+        block = next;
+    }
+    arena->blocks = NULL;
+    arena_grow(arena, total);
+}
+
+void json_arena_free(JsonArena *arena)
+{
+    ArenaBlock *block, *next;
+
+    if (arena == NULL)
+        return;
+    for (block = arena->blocks; block != NULL; block = next) {
+        next = block->next;
+        free(block);
+    }
+    sb_free(&arena->scratch);
+    free(arena);
+}
+
 /*
  * Unicode helper functions
  *
@@ -328,11 +439,84 @@ static void to_surrogate_pair(uchar_t unicode, uint16_t *uc, uint16_t *lc)
 #define is_space(c) ((c) == '\t' || (c) == '\n' || (c) == '\r' || (c) == ' ')
 #define is_digit(c) ((c) >= '0' && (c) <= '9')
 
-static bool parse_value     (const char **sp, JsonNode        **out);
-static bool parse_string    (const char **sp, char            **out);
+/*
+ * Fast scanning
+ *
+ * Most bytes of a string are printable ASCII that parse_string only
+ * has to copy, and pretty-printed input has long runs of whitespace.
+ * scan_plain() and skip_space_run() find the end of such a run 16 bytes
+ * at a time with SSE2, which every x86-64 CPU has.  (32 bytes at a time
+ * with AVX2 measured no faster: most runs are shorter than that.)  The
+ * loads are aligned, so they never reach into the page after the
+ * terminating NUL, which ends every run.  Define JSON_NO_SIMD to use the
+ * scalar loops, as other architectures do.
+ */
+
+/* Return the first byte at or after @s that is '"', '\\', a control character or non-ASCII. */
+static inline const char *scan_plain_scalar(const char *s)
+{
+    while ((unsigned char)*s >= 0x20 && (unsigned char)*s < 0x80 && *s != '"' && *s != '\\')
+        s++;
+    return s;
+}
+
+/* Return the first byte at or after @s that is not whitespace. */
+static inline const char *skip_space_scalar(const char *s)
+{
+    while (is_space(*s))
+        s++;
+    return s;
+}
+
+#ifdef JSON_SIMD
+__attribute__((no_sanitize_address))
+static const char *scan_plain_sse2(const char *s)
+{
+    const char *p = (const char*) ((uintptr_t)s & ~(uintptr_t)15);
+    unsigned int skip = s - p;
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i space = _mm_set1_epi8(' ');
+
+    for (;; p += 16, skip = 0) {
+        __m128i v = _mm_load_si128((const __m128i*) p);
+        /* As signed bytes, both control characters and 0x80..0xFF are below ' '. */
+        __m128i stop = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, backslash)),
+                                    _mm_cmplt_epi8(v, space));
+        unsigned int mask = (unsigned int)_mm_movemask_epi8(stop) >> skip << skip;
+        if (mask)
+            return p + __builtin_ctz(mask);
+    }
+}
+
+__attribute__((no_sanitize_address))
+static const char *skip_space_sse2(const char *s)
+{
+    const char *p = (const char*) ((uintptr_t)s & ~(uintptr_t)15);
+    unsigned int skip = s - p;
+
+    for (;; p += 16, skip = 0) {
+        __m128i v = _mm_load_si128((const __m128i*) p);
+        __m128i sp = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\t'))),
+                                  _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\r'))));
+        unsigned int mask = (~(unsigned int)_mm_movemask_epi8(sp) & 0xFFFF) >> skip << skip;
+        if (mask)
+            return p + __builtin_ctz(mask);
+    }
+}
+
+#define scan_plain(s)       scan_plain_sse2(s)
+#define skip_space_run(s)   skip_space_sse2(s)
+#else
+#define scan_plain(s)       scan_plain_scalar(s)
+#define skip_space_run(s)   skip_space_scalar(s)
+#endif
+
+static bool parse_value     (const char **sp, JsonNode        **out, JsonArena *arena);
+static bool parse_string    (const char **sp, char            **out, JsonArena *arena);
 static bool parse_number    (const char **sp, double           *out);
-static bool parse_array     (const char **sp, JsonNode        **out);
-static bool parse_object    (const char **sp, JsonNode        **out);
+static bool parse_array     (const char **sp, JsonNode        **out, JsonArena *arena);
+static bool parse_object    (const char **sp, JsonNode        **out, JsonArena *arena);
 static bool parse_hex16     (const char **sp, uint16_t         *out);
 
 static bool expect_literal  (const char **sp, const char *str);
@@ -350,6 +534,7 @@ static void emit_object_indented    (SB *out, const JsonNode *object, const char
 static int write_hex16(char *out, uint16_t val);
 
 static JsonNode *mknode(JsonTag tag);
+static JsonNode *mknode_in(JsonArena *arena, JsonTag tag);
 static void append_node(JsonNode *parent, JsonNode *child);
 static void prepend_node(JsonNode *parent, JsonNode *child);
 static void append_member(JsonNode *object, char *key, JsonNode *value);
@@ -358,24 +543,35 @@ static void append_member(JsonNode *object, char *key, JsonNode *value);
 static bool tag_is_valid(unsigned int tag);
 static bool number_is_valid(const char *num);
 
-JsonNode *json_decode(const char *json)
+static JsonNode *decode(const char *json, JsonArena *arena)
 {
     const char *s = json;
     JsonNode *ret;
 
     skip_space(&s);
-    if (!parse_value(&s, &ret))
+    if (!parse_value(&s, &ret, arena))
         return NULL;
 
     skip_space(&s);
     if (*s != 0) {
-        json_delete(ret);
+        if (arena == NULL)
+            json_delete(ret);
         return NULL;
     }
 
     return ret;
 }
 
+JsonNode *json_decode(const char *json)
+{
+    return decode(json, NULL);
+}
+
+JsonNode *json_decode_arena(const char *json, JsonArena *arena)
+{
+    return decode(json, arena);
+}
+
 char *json_encode(const JsonNode *node)
 {
     return json_stringify(node, NULL);
@@ -435,7 +631,7 @@ bool json_validate(const char *json)
     const char *s = json;
 
     skip_space(&s);
-    if (!parse_value(&s, NULL))
+    if (!parse_value(&s, NULL, NULL))
         return false;
 
     skip_space(&s);
@@ -492,6 +688,19 @@ static JsonNode *mknode(JsonTag tag)
     return ret;
 }
 
+/* mknode(), or from @arena if it is not NULL. */
+static JsonNode *mknode_in(JsonArena *arena, JsonTag tag)
+{
+    JsonNode *ret;
+
+    if (arena == NULL)
+        return mknode(tag);
+    ret = (JsonNode*) arena_alloc(arena, sizeof(JsonNode));
+    memset(ret, 0, sizeof(JsonNode));
+    ret->tag = tag;
+    return ret;
+}
+
 JsonNode *json_mknull(void)
 {
     return mknode(JSON_NULL);
@@ -620,7 +829,7 @@ void json_remove_from_parent(JsonNode *node)
     }
 }
 
-static bool parse_value(const char **sp, JsonNode **out)
+static bool parse_value(const char **sp, JsonNode **out, JsonArena *arena)
 {
     const char *s = *sp;
 
@@ -628,7 +837,7 @@ static bool parse_value(const char **sp, JsonNode **out)
         case 'n':
             if (expect_literal(&s, "null")) {
                 if (out)
-                    *out = json_mknull();
+                    *out = mknode_in(arena, JSON_NULL);
                 *sp = s;
                 return true;
             }
@@ -636,8 +845,10 @@ static bool parse_value(const char **sp, JsonNode **out)
 
         case 'f':
             if (expect_literal(&s, "false")) {
-                if (out)
-                    *out = json_mkbool(false);
+                if (out) {
+                    *out = mknode_in(arena, JSON_BOOL);
+                    (*out)->bool_ = false;
+                }
                 *sp = s;
                 return true;
             }
@@ -645,8 +856,10 @@ static bool parse_value(const char **sp, JsonNode **out)
 
         case 't':
             if (expect_literal(&s, "true")) {
-                if (out)
-                    *out = json_mkbool(true);
+                if (out) {
+                    *out = mknode_in(arena, JSON_BOOL);
+                    (*out)->bool_ = true;
+                }
                 *sp = s;
                 return true;
             }
@@ -654,9 +867,11 @@ static bool parse_value(const char **sp, JsonNode **out)
 
         case '"': {
                       char *str;
-                      if (parse_string(&s, out ? &str : NULL)) {
-                          if (out)
-                              *out = mkstring(str);
+                      if (parse_string(&s, out ? &str : NULL, arena)) {
+                          if (out) {
+                              *out = mknode_in(arena, JSON_STRING);
+                              (*out)->string_ = str;
+                          }
                           *sp = s;
                           return true;
                       }
@@ -664,14 +879,14 @@ static bool parse_value(const char **sp, JsonNode **out)
                   }
 
         case '[':
-                  if (parse_array(&s, out)) {
+                  if (parse_array(&s, out, arena)) {
                       *sp = s;
                       return true;
                   }
                   return false;
 
         case '{':
-                  if (parse_object(&s, out)) {
+                  if (parse_object(&s, out, arena)) {
                       *sp = s;
                       return true;
                   }
@@ -680,8 +895,10 @@ static bool parse_value(const char **sp, JsonNode **out)
         default: {
                      double num;
                      if (parse_number(&s, out ? &num : NULL)) {
-                         if (out)
-                             *out = json_mknumber(num);
+                         if (out) {
+                             *out = mknode_in(arena, JSON_NUMBER);
+                             (*out)->number_ = num;
+                         }
                          *sp = s;
                          return true;
                      }
@@ -690,10 +907,10 @@ static bool parse_value(const char **sp, JsonNode **out)
     }
 }
 
-static bool parse_array(const char **sp, JsonNode **out)
+static bool parse_array(const char **sp, JsonNode **out, JsonArena *arena)
 {
     const char *s = *sp;
-    JsonNode *ret = out ? json_mkarray() : NULL;
+    JsonNode *ret = out ? mknode_in(arena, JSON_ARRAY) : NULL;
     JsonNode *element;
 
     if (*s++ != '[')
@@ -706,7 +923,7 @@ static bool parse_array(const char **sp, JsonNode **out)
     }
 
     for (;;) {
-        if (!parse_value(&s, out ? &element : NULL))
+        if (!parse_value(&s, out ? &element : NULL, arena))
             goto failure;
         skip_space(&s);
 
@@ -730,14 +947,15 @@ success:
     return true;
 
 failure:
-    json_delete(ret);
+    if (arena == NULL)
+        json_delete(ret);
     return false;
 }
 
-static bool parse_object(const char **sp, JsonNode **out)
+static bool parse_object(const char **sp, JsonNode **out, JsonArena *arena)
 {
     const char *s = *sp;
-    JsonNode *ret = out ? json_mkobject() : NULL;
+    JsonNode *ret = out ? mknode_in(arena, JSON_OBJECT) : NULL;
     char *key;
     JsonNode *value;
 
@@ -751,7 +969,7 @@ static bool parse_object(const char **sp, JsonNode **out)
     }
 
     for (;;) {
-        if (!parse_string(&s, out ? &key : NULL))
+        if (!parse_string(&s, out ? &key : NULL, arena))
             goto failure;
         skip_space(&s);
 
@@ -759,7 +977,7 @@ static bool parse_object(const char **sp, JsonNode **out)
             goto failure_free_key;
         skip_space(&s);
 
-        if (!parse_value(&s, out ? &value : NULL))
+        if (!parse_value(&s, out ? &value : NULL, arena))
             goto failure_free_key;
         skip_space(&s);
 
@@ -783,14 +1001,15 @@ success:
     return true;
 
 failure_free_key:
-    if (out)
+    if (out && arena == NULL)
         free(key);
 failure:
-    json_delete(ret);
+    if (arena == NULL)
+        json_delete(ret);
     return false;
 }
 
-bool parse_string(const char **sp, char **out)
+bool parse_string(const char **sp, char **out, JsonArena *arena)
 {
     const char *s = *sp;
     SB sb;
@@ -802,7 +1021,12 @@ bool parse_string(const char **sp, char **out)
         return false;
 
     if (out) {
-        sb_init(&sb);
+        if (arena != NULL) {
+            sb = arena->scratch;
+            sb.cur = sb.start;
+        } else {
+            sb_init(&sb);
+        }
         sb_need(&sb, 4);
         b = sb.cur;
     } else {
@@ -810,7 +1034,21 @@ bool parse_string(const char **sp, char **out)
     }
 
     while (*s != '"') {
-        unsigned char c = *s++;
+        const char *run = scan_plain(s);
+        unsigned char c;
+
+        /* Copy a run of plain ASCII in one go. */
+        if (run != s) {
+            if (out) {
+                sb.cur = b;
+                sb_need(&sb, (int)(run - s) + 4);
+                memcpy(sb.cur, s, run - s);
+                b = sb.cur += run - s;
+            }
+            s = run;
+            continue;
+        }
+        c = *s++;
 
         /* Parse next character, and write it to b. */
         if (c == '\\') {
@@ -894,13 +1132,23 @@ bool parse_string(const char **sp, char **out)
     }
     s++;
 
-    if (out)
+    if (out && arena != NULL) {
+        /* Copy from the scratch buffer, keeping it (it may have grown). */
+        size_t length = sb.cur - sb.start;
+        arena->scratch = sb;
+        *out = (char*) arena_alloc(arena, length + 1);
+        memcpy(*out, sb.start, length);
+        (*out)[length] = 0;
+    } else if (out) {
         *out = sb_finish(&sb);
+    }
     *sp = s;
     return true;
 
 failed:
-    if (out)
+    if (out && arena != NULL)
+        arena->scratch = sb;
+    else if (out)
         sb_free(&sb);
     return false;
 }
@@ -966,7 +1214,10 @@ bool parse_number(const char **sp, double *out)
 static void skip_space(const char **sp)
 {
     const char *s = *sp;
-    while (is_space(*s))
+    /* Single spaces are common; only scan wider for a run. */
+    if (is_space(s[0]) && is_space(s[1]))
+        s = skip_space_run(s + 2);
+    else if (is_space(*s))
         s++;
     *sp = s;
 }
@@ -77,6 +77,23 @@ void        json_delete         (JsonNode *node);
 
 bool        json_validate       (const char *json);
 
+/*** Arena decoding ***/
+
+/*
+ * json_decode_arena() puts the whole tree in @arena, a few large blocks,
+ * instead of calling malloc for every node, key and string.  Such a tree
+ * must not be given to json_delete() or modified; json_arena_reset()
+ * releases every tree decoded since the last reset in one go and keeps
+ * the memory, so that steady-state decoding does not call malloc at all.
+ * An arena is not thread safe: use one per thread.
+ */
+typedef struct JsonArena JsonArena;
+
+JsonArena  *json_arena_new      (void);
+JsonNode   *json_decode_arena   (const char *json, JsonArena *arena);
+void        json_arena_reset    (JsonArena *arena);
+void        json_arena_free     (JsonArena *arena);
+
 /*** Lookup and traversal ***/
 
 JsonNode   *json_find_element   (JsonNode *array, int index);
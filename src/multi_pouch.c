@@ -1,3 +1,5 @@
+#define _GNU_SOURCE		// pthread_setaffinity_np(), pipe2()
+
 // Standard libraries
 #include <sys/stat.h>
 #include <ctype.h>
@@ -6,6 +8,11 @@
 #include <stdio.h>
 #include <fcntl.h>
 #include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sched.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
 
 // Libevent and Libcurl
 #include <event.h>
@@ -19,54 +26,61 @@
 #include <curl/curl.h>
 
 #include "multi_pouch.h"
+#include "pouch_json.h"
+
+static void pmi_feed(PouchMInfo *pmi);
+static void pmi_take_inbox(PouchMInfo *pmi);
+static void pmi_free_inbox(PouchMInfo *pmi);
+static void pw_finished(PouchWorker *w);
 
 // PouchReq functions
 PouchReq *pr_domulti(PouchReq *pr, CURLM *multi){
 	// empty the response buffer
-	if (pr->resp.data){
-		free(pr->resp.data);
-	}
-	pr->resp.data = NULL;
-	pr->resp.size = 0;
+	pr_clear_resp(pr);
 
-	// initialize the CURL object
-	if (pr->easy){ // get rid of the old one?
-		printf("EXISTING EASY\n");
-		curl_multi_remove_handle(multi, pr->easy);
-		curl_easy_cleanup(pr->easy);
+	// initialize the CURL object, reusing the old one if there is one
+	if (pr->easy){
+		if (pr->multi){
+			curl_multi_remove_handle(pr->multi, pr->easy);
+		}
+		curl_easy_reset(pr->easy);
+	}
+	else {
+		pr->easy = curl_easy_init();
 	}
-	pr->easy = curl_easy_init();
 	pr->multi = multi;
 	
 	// setup the CURL object/request
 	curl_easy_setopt(pr->easy, CURLOPT_USERAGENT, "pouch/0.1");				// add user-agent
 	curl_easy_setopt(pr->easy, CURLOPT_URL, pr->url);						// where to send this request
 	curl_easy_setopt(pr->easy, CURLOPT_CONNECTTIMEOUT, 2);					// Timeouts
-	curl_easy_setopt(pr->easy, CURLOPT_TIMEOUT, 2);
+	curl_easy_setopt(pr->easy, CURLOPT_TIMEOUT, pr->has_timeout ? pr->timeout : 2);
 	curl_easy_setopt(pr->easy, CURLOPT_NOSIGNAL, 1);
 	curl_easy_setopt(pr->easy, CURLOPT_WRITEFUNCTION, recv_data_callback);	// where to store the response
 	curl_easy_setopt(pr->easy, CURLOPT_WRITEDATA, (void *)pr);
+	curl_easy_setopt(pr->easy, CURLOPT_HEADERFUNCTION, recv_header_callback);	// sizes the response buffer
+	curl_easy_setopt(pr->easy, CURLOPT_HEADERDATA, (void *)pr);
 	curl_easy_setopt(pr->easy, CURLOPT_PRIVATE, (void *)pr);				// associate this request with the PouchReq holding it
 	curl_easy_setopt(pr->easy, CURLOPT_NOPROGRESS, 1L);						// Don't use a progress function to watch this request
 	curl_easy_setopt(pr->easy, CURLOPT_ERRORBUFFER, pr->errorstr);			// Store multi error descriptions in pr->errorstr
+	curl_easy_setopt(pr->easy, CURLOPT_ACCEPT_ENCODING, pr->encodings);	// decompress responses
+	if (pr->http_version){
+		curl_easy_setopt(pr->easy, CURLOPT_HTTP_VERSION, pr->http_version);
+		if (pr->http_version >= CURL_HTTP_VERSION_2_0){
+			curl_easy_setopt(pr->easy, CURLOPT_PIPEWAIT, 1L);	// rather share a connection than open one
+		}
+	}
 	
+	if(pr->share){	// use the shared DNS/TLS/connection caches
+		curl_easy_setopt(pr->easy, CURLOPT_SHARE, pr->share->share);
+	}
 	if(pr->usrpwd){	// if there's a valid auth string, use it
 		curl_easy_setopt(pr->easy, CURLOPT_USERPWD, pr->usrpwd);
 	}
 
-	if (pr->req.data && pr->req.size > 0){ // check for data upload
-		//printf("--> %s\n", pr->req.data);
-		// let CURL know what data to send
-		curl_easy_setopt(pr->easy, CURLOPT_READFUNCTION, send_data_callback);
-		curl_easy_setopt(pr->easy, CURLOPT_READDATA, (void *)pr);
-	}
-
-	if (!strncmp(pr->method, PUT, 3)){ // PUT-specific option
-		curl_easy_setopt(pr->easy, CURLOPT_UPLOAD, 1);
-		// Note: Content-Type: application/json is automatically assumed
-	}
-	else if (!strncmp(pr->method, POST, 4)){ // POST-specific options
-		curl_easy_setopt(pr->easy, CURLOPT_POST, 1);
+	// let CURL know what data to send
+	pr_setopt_body(pr, pr->easy);
+	if (!strncmp(pr->method, POST, 4)){ // POST-specific options
 		pr_add_header(pr, "Content-Type: application/json");
 	}
 
@@ -79,32 +93,18 @@ PouchReq *pr_domulti(PouchReq *pr, CURLM *multi){
 	} 
 
 	// add the custom headers
-	pr_add_header(pr, "Transfer-Encoding: chunked");
 	curl_easy_setopt(pr->easy, CURLOPT_HTTPHEADER, pr->headers);
 
 	// start the request by adding it to the multi handle
+	pr_start_tries(pr);
+	pr->attempts = 1;
+	pr->httpresponse = 0;
+	pr->retry_after = -1;
 	pr->curlmcode = curl_multi_add_handle(pr->multi, pr->easy);
 	//printf("pr->curlmcode = %d\n", pr->curlmcode);
 	debug_mcode("pr_domulti: ", pr->curlmcode);
 	
 	return pr;
-	/*
-	if (pr->headers){
-		curl_slist_free_all(pr->headers);	// free headers
-		pr->headers = NULL;
-	}
-	if (!pr->curlcode){
-		pr->curlcode = curl_easy_getinfo(pr->easy, CURLINFO_RESPONSE_CODE, &pr->httpresponse);
-		if (pr->curlcode != CURLE_OK)
-			pr->httpresponse = 500; //  Internal Server Error (no specific error)
-	}
-	curl_easy_cleanup(curl);		// clean up the curl object
-
-	// Print the response
-	//printf("Received %d bytes, status = %d\n",
-	//		(int)pr->resp.size, pr->curlcode);
-	//printf("--> %s\n", pr->resp.data);
-	*/
 }
 
 
@@ -126,6 +126,70 @@ void debug_mcode(const char *desc, CURLMcode code){
 		fprintf(stderr, "ERROR: %s returns %s\n", desc, s);
 	}
 }
+static void pmi_release(PouchMInfo *pmi, PouchReq *pr);
+static void pmi_admit(PouchMInfo *pmi);
+struct _PouchRetry {
+	/*
+		A request waiting out its backoff, kept
+		on pmi->retries so that pr_del_pmi() can
+		cancel it.
+	*/
+	PouchReq *pr;
+	struct event *ev;	// fires once, when the backoff has passed
+	PouchRetry *next;
+	PouchRetry **pprev;	// whatever points at this one
+};
+static void pmi_retry_free(PouchRetry *r){
+	if ((*r->pprev = r->next)){
+		r->next->pprev = r->pprev;
+	}
+	event_free(r->ev);
+	free(r);
+}
+static void pmi_retry_cb(evutil_socket_t fd, short kind, void *arg){
+	/*
+		Sends a request that failed again, once its
+		backoff has passed.
+	*/
+	PouchRetry *r = (PouchRetry *)arg;
+	PouchReq *pr = r->pr;
+	pmi_retry_free(r);
+	pr_clear_resp(pr);
+	pr_setopt_body(pr, pr->easy);	// rewinds the body
+	pr->httpresponse = 0;
+	pr->retry_after = -1;
+	pr->attempts++;
+	pr->curlmcode = curl_multi_add_handle(pr->multi, pr->easy);
+	debug_mcode("pmi_retry_cb: ", pr->curlmcode);
+}
+static int pmi_retry(PouchMInfo *pmi, PouchReq *pr){
+	/*
+		Schedules another try of a finished request if
+		pr_retry_delay() allows it. A request that
+		pmi_submit() started keeps its slot meanwhile.
+	*/
+	long delay = pr_retry_delay(pr);
+	struct timeval tv;
+	PouchRetry *r;
+	if (delay < 0 || !(r = (PouchRetry *)malloc(sizeof(PouchRetry)))){
+		return 0;
+	}
+	if (!(r->ev = evtimer_new(pmi->base, pmi_retry_cb, r))){
+		free(r);
+		return 0;
+	}
+	r->pr = pr;
+	if ((r->next = pmi->retries)){
+		r->next->pprev = &r->next;
+	}
+	r->pprev = &pmi->retries;
+	pmi->retries = r;
+	tv.tv_sec = delay/1000;
+	tv.tv_usec = (delay%1000)*1000;
+	evtimer_add(r->ev, &tv);
+	curl_multi_remove_handle(pmi->multi, pr->easy);
+	return 1;
+}
 void check_multi_info(PouchMInfo *pmi /*, function pointer process_func*/){
 	CURLMsg *msg;
 	CURL *easy;
@@ -133,6 +197,7 @@ void check_multi_info(PouchMInfo *pmi /*, function pointer process_func*/){
 	
 	int msgs_left;
 	PouchReq *pr;
+	int pooled;
 
 	while ((msg = curl_multi_info_read(pmi->multi, &msgs_left))){
 		if(msg->msg == CURLMSG_DONE){ // if this action is done
@@ -141,15 +206,41 @@ void check_multi_info(PouchMInfo *pmi /*, function pointer process_func*/){
 			res = msg->data.result;
 			curl_easy_getinfo(easy, CURLINFO_PRIVATE, &pr);
 			//printf("Finished request (easy=%p, url=%s)\n", easy, pr->url);
-			// process the result
-			if(pmi->has_cb){
-				pmi->cb(pr, pmi);
+			pr->curlcode = res;
+			if (res == CURLE_OK){
+				curl_easy_getinfo(easy, CURLINFO_RESPONSE_CODE, &pr->httpresponse);
+			}
+			pr_read_times(pr);
+			if (pmi->stats){
+				pstats_record(pmi->stats, pr);
 			}
-			else {
-				pr_free(pr);
+			if (pmi_retry(pmi, pr)){ // transient failure, try again later
+				continue;
+			}
+			if (pr->sink){ // tell the sink the body is complete
+				pr->sink(pr, NULL, 0, pr->sink_data);
+			}
+			pr_clear_data(pr); // a body is only sent once
+			pr_clear_headers(pr); // as in pr_do(), before pr may be reused
+			pooled = pmi->worker && pr->host; // came from pp_submit()
+			pmi_release(pmi, pr); // make room for a queued request
+			// let pouch finish its own requests first
+			if (!pr->done || !pr->done(pr, pr->done_data)){
+				// process the result
+				if(pmi->has_cb){
+					pmi->cb(pr, pmi);
+				}
+				else {
+					pr_free(pr);
+				}
+			}
+			if (pooled){
+				pw_finished(pmi->worker);
 			}
 		}
 	}
+	pmi_admit(pmi);
+	pmi_feed(pmi);
 }
 int multi_timer_cb(CURLM *multi, long timeout_ms, void *data){
 	/*
@@ -164,7 +255,9 @@ int multi_timer_cb(CURLM *multi, long timeout_ms, void *data){
 	if (evtimer_pending(&pmi->timer_event, NULL)){
 		evtimer_del(&pmi->timer_event);
 	}
-	evtimer_add(&pmi->timer_event, &timeout);
+	if (timeout_ms >= 0){ // -1 means no timer is needed
+		evtimer_add(&pmi->timer_event, &timeout);
+	}
 	return 0;
 }
 void event_cb(int fd, short kind, void *userp){
@@ -181,12 +274,13 @@ void event_cb(int fd, short kind, void *userp){
 	
 	debug_mcode("event_cb: curl_multi_socket_action", rc);
 	
-	check_multi_info(pmi);
 	if (pmi->still_running <= 0){ // last transfer is done
 		if (evtimer_pending(&pmi->timer_event, NULL)){
 			evtimer_del(&pmi->timer_event); // get rid of the libevent timer
 		}
 	}
+	// after the timer is gone, as this may start new transfers
+	check_multi_info(pmi);
 }
 void timer_cb(int fd, short kind, void *userp){
 	/*
@@ -265,6 +359,7 @@ PouchMInfo *pr_mk_pmi(struct event_base *base, struct evdns_base *dns_base, pr_p
 		libevent event_base for use as a sort of "global" base throughout
 		all of the callbacks, so that the user can define their own base.
 	*/
+	pr_global_init();
 	PouchMInfo *pmi = (PouchMInfo *)malloc(sizeof(PouchMInfo));
 	if(!pmi){
 		return NULL;
@@ -279,6 +374,7 @@ PouchMInfo *pr_mk_pmi(struct event_base *base, struct evdns_base *dns_base, pr_p
 		pmi->has_cb = 1;
 	}
 	pmi->custom = custom;
+	pmi->inbox_fd = -1;
 	pmi->multi = curl_multi_init();
 	evtimer_set(&pmi->timer_event, timer_cb, (void *)pmi);
 	event_base_set(pmi->base, &pmi->timer_event);
@@ -337,6 +433,204 @@ void pmi_multi_cleanup(PouchMInfo *pmi){
 	//printf("msg->data.result = %d\n", msg->data.result);
 	printf("msgs_left = %d\n", msgs_left);
 }
+// Bounded submission
+static PouchHost *pmi_host(PouchMInfo *pmi, const char *url){
+	/*
+		Finds (or adds) the host entry for the
+		scheme://host:port part of url.
+	*/
+	const char *start = strstr(url, "://");
+	size_t len;
+	PouchHost *h;
+	start = start ? start + 3 : url;
+	len = start - url + strcspn(start, "/?#");
+	for (h = pmi->hosts; h; h = h->next){
+		if (strlen(h->name) == len && !strncmp(h->name, url, len)){
+			return h;
+		}
+	}
+	if (!(h = (PouchHost *)calloc(1, sizeof(PouchHost)))){
+		return NULL;
+	}
+	if (!(h->name = strndup(url, len))){
+		free(h);
+		return NULL;
+	}
+	h->next = pmi->hosts;
+	pmi->hosts = h;
+	return h;
+}
+static int pmi_host_full(PouchMInfo *pmi, PouchHost *h){
+	return pmi->max_per_host && h->inflight >= pmi->max_per_host;
+}
+static int pmi_full(PouchMInfo *pmi){
+	return pmi->max_inflight && pmi->inflight >= pmi->max_inflight;
+}
+static void pmi_start(PouchMInfo *pmi, PouchHost *h, PouchReq *pr){
+	if (!pr->http_version){
+		pr->http_version = pmi->http_version;
+	}
+	pr->host = h;
+	h->inflight++;
+	pmi->inflight++;
+	pr_domulti(pr, pmi->multi);
+}
+static void pmi_release(PouchMInfo *pmi, PouchReq *pr){
+	if (pr->host){
+		pr->host->inflight--;
+		pmi->inflight--;
+		pr->host = NULL;
+	}
+}
+static void pmi_admit(PouchMInfo *pmi){
+	/*
+		Starts queued requests while there is room,
+		taking one from each host in turn so that a
+		busy host doesn't starve the others.
+	*/
+	while (pmi->queued && !pmi_full(pmi)){
+		PouchHost *h = pmi->next_host ? pmi->next_host : pmi->hosts;
+		PouchHost *first = h;
+		PouchReq *pr;
+		while (!h->head || pmi_host_full(pmi, h)){
+			h = h->next ? h->next : pmi->hosts;
+			if (h == first){
+				return;	// every host with waiting requests is at its limit
+			}
+		}
+		pr = h->head;
+		if (!(h->head = pr->next)){
+			h->tail = NULL;
+		}
+		pr->next = NULL;
+		h->queued--;
+		pmi->queued--;
+		pmi->next_host = h->next;
+		pmi_start(pmi, h, pr);
+	}
+}
+PouchMInfo *pmi_set_limits(PouchMInfo *pmi, size_t max_inflight, size_t max_per_host, size_t max_queued){
+	/*
+		Limits the requests sent with pmi_submit():
+		at most max_inflight run at once, at most
+		max_per_host of them to the same host, and at
+		most max_queued wait for their turn. 0 means
+		no limit. Requests sent with pr_domulti()
+		are not counted.
+	*/
+	pmi->max_inflight = max_inflight;
+	pmi->max_per_host = max_per_host;
+	pmi->max_queued = max_queued;
+	pmi_admit(pmi);	// the limits may have been raised
+	return pmi;
+}
+int pmi_submit(PouchMInfo *pmi, PouchReq *pr){
+	/*
+		Sends pr through the multi interface like
+		pr_domulti(), or queues it until the limits
+		set with pmi_set_limits() allow it to run.
+		Queued requests start as others finish.
+		Returns 0, or -1 if the queue is full; pr
+		is then left untouched and the caller should
+		retry later. Returns -2, also leaving pr be,
+		if out of memory or while pr_del_pmi() is
+		deleting pmi; waiting won't help then.
+	*/
+	PouchHost *h;
+	if (pmi->closing || !(h = pmi_host(pmi, pr->url))){
+		return -2;
+	}
+	if (!pmi_full(pmi) && !pmi_host_full(pmi, h) && !h->head){
+		pmi_start(pmi, h, pr);
+		return 0;
+	}
+	if (pmi->max_queued && pmi->queued >= pmi->max_queued){
+		return -1;
+	}
+	pr->next = NULL;
+	if (h->tail){
+		h->tail->next = pr;
+	} else {
+		h->head = pr;
+	}
+	h->tail = pr;
+	h->queued++;
+	pmi->queued++;
+	return 0;
+}
+int pmi_submit_wait(PouchMInfo *pmi, PouchReq *pr){
+	/*
+		Like pmi_submit(), but runs pmi->base until
+		there is room in the queue instead of failing.
+		Don't call it from inside an event callback.
+		Returns 0, -1 if the event loop fails, or -2
+		as pmi_submit() does.
+	*/
+	int res;
+	while ((res = pmi_submit(pmi, pr)) == -1){
+		if (event_base_loop(pmi->base, EVLOOP_ONCE) < 0){
+			return -1;
+		}
+	}
+	return res;
+}
+PouchMInfo *pmi_set_http2(PouchMInfo *pmi, int mode, long max_streams){
+	/*
+		With POUCH_HTTP2 or POUCH_HTTP2_PRIOR, requests
+		started by pmi_submit() (and any PouchReq given the
+		same version with pr_set_http_version()) ask for
+		HTTP/2 and are multiplexed as streams over a single
+		connection per host, at most max_streams at once
+		(0 = libcurl's default of 100). POUCH_HTTP1
+		goes back to one connection per request in flight.
+	*/
+	pmi->http_version = mode == POUCH_HTTP2 ? CURL_HTTP_VERSION_2TLS
+		: mode == POUCH_HTTP2_PRIOR ? CURL_HTTP_VERSION_2_PRIOR_KNOWLEDGE
+		: 0;
+	curl_multi_setopt(pmi->multi, CURLMOPT_PIPELINING,
+			mode == POUCH_HTTP1 ? CURLPIPE_NOTHING : CURLPIPE_MULTIPLEX);
+	curl_multi_setopt(pmi->multi, CURLMOPT_MAX_CONCURRENT_STREAMS,
+			max_streams > 0 ? max_streams : 100L);
+	return pmi;
+}
+PouchMInfo *pmi_set_stats(PouchMInfo *pmi, PouchStats *stats){
+	/*
+		Records the timings of every try of every request
+		that finishes on pmi in stats (NULL stops). Query,
+		print or reset stats on the thread running pmi->base,
+		e.g. from a timer. stats is not freed by pr_del_pmi().
+	*/
+	pmi->stats = stats;
+	return pmi;
+}
+static void pmi_abandon(PouchMInfo *pmi, PouchReq *pr){
+	/*
+		Finishes a request that pr_del_pmi() found
+		waiting to be sent (again), with CURLE_ABORTED_BY_CALLBACK
+		and no response, as check_multi_info() would.
+	*/
+	if (pr->easy && pr->multi == pmi->multi){	// left there by an earlier transfer
+		curl_multi_remove_handle(pmi->multi, pr->easy);
+		pr->multi = NULL;
+	}
+	pr->next = NULL;
+	pr->curlcode = CURLE_ABORTED_BY_CALLBACK;
+	pr->httpresponse = 0;
+	pr_clear_resp(pr);
+	pr_clear_data(pr);
+	pr_clear_headers(pr);
+	if (!pr->done || !pr->done(pr, pr->done_data)){
+		if(pmi->has_cb){
+			pmi->cb(pr, pmi);
+		}
+		else {
+			pr_free(pr);
+		}
+	}
+	if (pmi->worker){	// everything a worker queues came from pp_submit()
+		pw_finished(pmi->worker);
+	}
+}
 void pr_del_pmi(PouchMInfo *pmi){
 	/*
 		Cleans up and deletes a PouchMInfo struct.
@@ -344,15 +638,53 @@ void pr_del_pmi(PouchMInfo *pmi){
 		(don't do this manually after calling pr_del_pmi!)
 		and cleans up the CURLM handle. Afterwards, it frees
 		the object. Don't try to free it again.
+		Requests that were sent with pmi_send() or queued
+		by pmi_submit() but never started, and those waiting
+		to be retried, are not sent: they go to pmi->cb (or
+		are freed) with curlcode CURLE_ABORTED_BY_CALLBACK.
+		Let requests in flight finish first; they are dropped.
 	*/
+	PouchHost *h;
+	PouchReq *pr;
 	if(pmi){
-		printf("pmi %p exists!\n", pmi);
 		event_del(&pmi->timer_event); // TODO: figure out how to check if this is valid
+		pmi->closing = 1;
+		// take the inbox without submitting it
+		if (pmi->inbox_fd >= 0){
+			pmi_take_inbox(pmi);
+			pmi_free_inbox(pmi);
+		}
+		while (pmi->retries){
+			pr = pmi->retries->pr;
+			pmi_retry_free(pmi->retries);
+			pmi_release(pmi, pr);
+			pmi_abandon(pmi, pr);
+		}
+		while ((pr = pmi->backlog)){
+			pmi->backlog = pr->next;
+			pmi_abandon(pmi, pr);
+		}
+		pmi->backlog_tail = NULL;
+		for (h = pmi->hosts; h; h = h->next){
+			while ((pr = h->head)){
+				h->head = pr->next;
+				h->queued--;
+				pmi->queued--;
+				pmi_abandon(pmi, pr);
+			}
+			h->tail = NULL;
+		}
+		// only now that nothing can be added to it
 		if(pmi->multi){
-			printf("pmi %p multi %p exists!\n", pmi, pmi->multi);
 			//pmi_multi_cleanup(pmi);
 			curl_multi_cleanup(pmi->multi);
 		}
+		while (pmi->hosts){
+			PouchHost *h = pmi->hosts;
+			pmi->hosts = h->next;
+			free(h->name);
+			free(h);
+		}
 		if(pmi->dnsbase){
 			evdns_base_free(pmi->dnsbase, 0);
 		} if (pmi->base){
@@ -361,3 +693,660 @@ void pr_del_pmi(PouchMInfo *pmi){
 		free(pmi);
 	}
 }
+
+
+// Thread-safe submission
+static void pmi_feed(PouchMInfo *pmi){
+	// hands the backlog to pmi_submit(), oldest first
+	while (pmi->backlog){
+		PouchReq *pr = pmi->backlog;
+		PouchReq *next = pr->next;
+		if (pmi_submit(pmi, pr)){
+			return;	// full (or out of memory); try again when a request finishes
+		}
+		if (!(pmi->backlog = next)){
+			pmi->backlog_tail = NULL;
+		}
+	}
+}
+static void pmi_wake(PouchMInfo *pmi){
+	uint64_t one = 1;
+	while (write(pmi->inbox_fd, &one, sizeof(one)) < 0 && errno == EINTR);
+}
+static void pmi_take_inbox(PouchMInfo *pmi){
+	// moves the requests pushed by pmi_send() to the end of the backlog
+	PouchReq *pr, *head = NULL, *tail;
+	pr = __atomic_exchange_n(&pmi->inbox, NULL, __ATOMIC_SEQ_CST);
+	tail = pr;
+	while (pr){	// newest first: reverse into submission order
+		PouchReq *next = pr->next;
+		pr->next = head;
+		head = pr;
+		pr = next;
+	}
+	if (head){
+		if (pmi->backlog_tail){
+			pmi->backlog_tail->next = head;
+		} else {
+			pmi->backlog = head;
+		}
+		pmi->backlog_tail = tail;
+	}
+}
+static void pmi_inbox_cb(int fd, short kind, void *userp){
+	PouchMInfo *pmi = (PouchMInfo *)userp;
+	uint64_t n;
+	while (read(fd, &n, sizeof(n)) < 0 && errno == EINTR);
+	// clear the flag before taking the requests, so that any
+	// request pushed after the exchange writes a new wake-up
+	__atomic_store_n(&pmi->inbox_woken, 0, __ATOMIC_SEQ_CST);
+	pmi_take_inbox(pmi);
+	pmi_feed(pmi);
+	if (pmi->worker && __atomic_load_n(&pmi->worker->pool->stopping, __ATOMIC_ACQUIRE)){
+		event_base_loopbreak(pmi->base);
+	}
+}
+int pmi_open_inbox(PouchMInfo *pmi){
+	/*
+		Lets other threads hand requests to this PouchMInfo
+		with pmi_send(). Call it on the thread running
+		pmi->base, before any thread calls pmi_send(). The
+		inbox keeps the event loop running even when no
+		request is in flight, until pmi_close_inbox().
+		Returns 0, or -1 if the eventfd can't be created.
+	*/
+	if (pmi->inbox_fd >= 0){
+		return 0;
+	}
+	if ((pmi->inbox_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0){
+		return -1;
+	}
+	if (!(pmi->inbox_ev = event_new(pmi->base, pmi->inbox_fd, EV_READ | EV_PERSIST, pmi_inbox_cb, pmi))){
+		close(pmi->inbox_fd);
+		pmi->inbox_fd = -1;
+		return -1;
+	}
+	event_add(pmi->inbox_ev, NULL);
+	return 0;
+}
+int pmi_send(PouchMInfo *pmi, PouchReq *pr){
+	/*
+		Hands pr to the thread running pmi->base, which
+		pmi_submit()s it. Unlike every other pmi_ function
+		it may be called from any thread, and it never
+		blocks: pr is pushed onto a lock-free list through
+		pr->next, without copying or allocating, and the
+		loop is woken up through an eventfd (once per batch,
+		not once per request). pmi_open_inbox() must have
+		been called. Returns 0, or -1 if it wasn't.
+	*/
+	PouchReq *head;
+	if (pmi->inbox_fd < 0){
+		return -1;
+	}
+	head = __atomic_load_n(&pmi->inbox, __ATOMIC_RELAXED);
+	do {
+		pr->next = head;
+	} while (!__atomic_compare_exchange_n(&pmi->inbox, &head, pr, 1,
+				__ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+	if (!__atomic_exchange_n(&pmi->inbox_woken, 1, __ATOMIC_SEQ_CST)){
+		pmi_wake(pmi);
+	}
+	return 0;
+}
+static void pmi_free_inbox(PouchMInfo *pmi){
+	event_free(pmi->inbox_ev);
+	close(pmi->inbox_fd);
+	pmi->inbox_ev = NULL;
+	pmi->inbox_fd = -1;
+}
+void pmi_close_inbox(PouchMInfo *pmi){
+	/*
+		Stops accepting pmi_send()s, on the thread running
+		pmi->base, once no other thread can call it any more.
+		Requests already sent are still submitted.
+	*/
+	if (pmi->inbox_fd < 0){
+		return;
+	}
+	pmi_inbox_cb(pmi->inbox_fd, EV_READ, pmi);
+	pmi_free_inbox(pmi);
+}
+
+// Worker thread pools
+static void pw_finished(PouchWorker *w){
+	// called on w's thread once the callback of a pooled request has run
+	PouchPool *pool = w->pool;
+	__atomic_fetch_sub(&w->outstanding, 1, __ATOMIC_RELAXED);
+	if (__atomic_sub_fetch(&pool->outstanding, 1, __ATOMIC_SEQ_CST) == 0){
+		pthread_mutex_lock(&pool->lock);	// pp_wait() checks under the lock
+		pthread_cond_broadcast(&pool->idle);
+		pthread_mutex_unlock(&pool->lock);
+	}
+}
+static void *pw_main(void *arg){
+	PouchWorker *w = (PouchWorker *)arg;
+	event_base_loop(w->pmi->base, 0);	// until pp_free()
+	return NULL;
+}
+PouchPool *pp_init(int nworkers, int policy, pr_proc_cb callback, void *custom){
+	/*
+		Creates a pool of nworkers threads, each with its
+		own event_base and PouchMInfo (pool->workers[i].pmi),
+		which can be configured with pmi_set_limits() and
+		pmi_set_http2() until pp_start() is called. callback
+		gets every finished request on the thread that ran
+		it, with pmi->custom set to custom; it may be called
+		from several threads at once.
+	*/
+	PouchPool *pool;
+	int i;
+	pr_global_init();	// before any thread is started
+	if (nworkers < 1 || !(pool = (PouchPool *)calloc(1, sizeof(PouchPool)))){
+		return NULL;
+	}
+	if (!(pool->workers = (PouchWorker *)calloc(nworkers, sizeof(PouchWorker)))){
+		free(pool);
+		return NULL;
+	}
+	pool->nworkers = nworkers;
+	pool->policy = policy;
+	pool->first_cpu = -1;
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->idle, NULL);
+	for (i = 0; i < nworkers; i++){
+		PouchWorker *w = &pool->workers[i];
+		struct event_base *base;
+		w->pool = pool;
+		w->index = i;
+		if (!(base = event_base_new())
+				|| !(w->pmi = pr_mk_pmi(base, NULL, callback, custom))
+				|| pmi_open_inbox(w->pmi)){
+			if (base && !w->pmi){
+				event_base_free(base);
+			}
+			pool->nworkers = i + 1;
+			pp_free(pool);
+			return NULL;
+		}
+		w->pmi->worker = w;
+	}
+	return pool;
+}
+PouchPool *pp_set_affinity(PouchPool *pool, int first_cpu){
+	/*
+		Pins worker i to CPU (first_cpu + i) modulo the
+		number of CPUs when pp_start() runs, keeping each
+		event loop and its caches on one core. -1 lets
+		the scheduler move them (the default).
+	*/
+	pool->first_cpu = first_cpu;
+	return pool;
+}
+int pp_start(PouchPool *pool){
+	/*
+		Starts the worker threads. Returns 0, or -1 if
+		a thread could not be created.
+	*/
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	int i;
+	for (i = 0; i < pool->nworkers; i++){
+		PouchWorker *w = &pool->workers[i];
+		if (pthread_create(&w->thread, NULL, pw_main, w)){
+			return -1;
+		}
+		w->started = 1;
+		if (pool->first_cpu >= 0 && ncpu > 0){
+			cpu_set_t cpus;
+			CPU_ZERO(&cpus);
+			CPU_SET((pool->first_cpu + i) % ncpu, &cpus);
+			pthread_setaffinity_np(w->thread, sizeof(cpus), &cpus);
+		}
+	}
+	return 0;
+}
+static PouchWorker *pp_pick(PouchPool *pool, const char *url){
+	if (pool->policy == POUCH_POOL_HOST){
+		// FNV-1a of scheme://host:port, as pmi_host() splits it
+		const char *p = strstr(url, "://");
+		const char *end;
+		unsigned int hash = 2166136261u;
+		p = p ? p + 3 : url;
+		end = p + strcspn(p, "/?#");
+		for (p = url; p < end; p++){
+			hash = (hash ^ (unsigned char)*p) * 16777619u;
+		}
+		return &pool->workers[hash % pool->nworkers];
+	} else {
+		PouchWorker *best = &pool->workers[0];
+		size_t least = __atomic_load_n(&best->outstanding, __ATOMIC_RELAXED);
+		int i;
+		for (i = 1; i < pool->nworkers && least; i++){
+			size_t n = __atomic_load_n(&pool->workers[i].outstanding, __ATOMIC_RELAXED);
+			if (n < least){
+				least = n;
+				best = &pool->workers[i];
+			}
+		}
+		return best;
+	}
+}
+int pp_submit(PouchPool *pool, PouchReq *pr){
+	/*
+		Sends pr through one of the workers, chosen by the
+		pool's policy, as pmi_submit() would on its thread.
+		Safe to call from any thread, including from the
+		callback, and lock-free (see pmi_send()). Returns
+		the index of the worker, or -1 if the pool is
+		shutting down.
+	*/
+	PouchWorker *w;
+	if (__atomic_load_n(&pool->stopping, __ATOMIC_ACQUIRE)){
+		return -1;
+	}
+	w = pp_pick(pool, pr->url);
+	__atomic_fetch_add(&w->outstanding, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&pool->outstanding, 1, __ATOMIC_SEQ_CST);
+	pmi_send(w->pmi, pr);
+	return w->index;
+}
+void pp_wait(PouchPool *pool){
+	/*
+		Blocks until every request submitted so far
+		has finished and its callback has returned.
+		Don't call it from a worker thread.
+	*/
+	pthread_mutex_lock(&pool->lock);
+	while (__atomic_load_n(&pool->outstanding, __ATOMIC_SEQ_CST)){
+		pthread_cond_wait(&pool->idle, &pool->lock);
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
+void pp_free(PouchPool *pool){
+	/*
+		Stops and joins the worker threads and frees the
+		pool, including each worker's PouchMInfo and
+		event_base. Requests that no worker has started
+		get the callback, on this thread, as described in
+		pr_del_pmi(); those in flight are dropped without
+		one, so call pp_wait() first.
+	*/
+	int i;
+	if (!pool){
+		return;
+	}
+	__atomic_store_n(&pool->stopping, 1, __ATOMIC_RELEASE);
+	for (i = 0; i < pool->nworkers; i++){
+		PouchWorker *w = &pool->workers[i];
+		if (w->started){
+			pmi_wake(w->pmi);	// its inbox callback sees stopping
+			pthread_join(w->thread, NULL);
+		}
+	}
+	for (i = 0; i < pool->nworkers; i++){
+		pr_del_pmi(pool->workers[i].pmi);	// frees the event_base too
+	}
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->idle);
+	free(pool->workers);
+	free(pool);
+}
+
+// Continuous _changes feeds
+static void pc_connect(PouchChanges *pc);
+static void pc_free(PouchChanges *pc){
+	if (pc->pr->easy && pc->pr->multi){
+		curl_multi_remove_handle(pc->pr->multi, pc->pr->easy);
+		pc->pr->multi = NULL;
+	}
+	pr_free(pc->pr);
+	event_free(pc->watchdog);
+	event_free(pc->retry);
+	free(pc->server);
+	free(pc->db);
+	free(pc->params);
+	free(pc->since);
+	free(pc->line);
+	free(pc);
+}
+static void pc_schedule(PouchChanges *pc, long delay){
+	/*
+		Reopens the feed after delay milliseconds.
+	*/
+	struct timeval timeout;
+	timeout.tv_sec = delay/1000;
+	timeout.tv_usec = (delay%1000)*1000;
+	if (evtimer_pending(pc->watchdog, NULL)){
+		evtimer_del(pc->watchdog);
+	}
+	evtimer_add(pc->retry, &timeout);
+}
+static void pc_kick_watchdog(PouchChanges *pc){
+	struct timeval timeout;
+	long ms = pc->heartbeat*3 > 1000 ? pc->heartbeat*3 : 1000;
+	timeout.tv_sec = ms/1000;
+	timeout.tv_usec = (ms%1000)*1000;
+	evtimer_add(pc->watchdog, &timeout); // re-adding resets the timeout
+}
+static void pc_set_since(PouchChanges *pc, const char *seq, const char *end){
+	/*
+		Remembers the seq value at seq, which is a
+		number in CouchDB 1.x and a string afterwards.
+	*/
+	char *since = pj_dup_string(seq, end);
+	if (!since){
+		since = pj_dup_value(seq, end);
+	}
+	if (since){
+		free(pc->since);
+		pc->since = since;
+	}
+}
+static int pc_line(PouchChanges *pc, char *line, size_t len){
+	/*
+		Handles one complete line of the feed.
+		Returns 0 if pc_stop() was called from cb.
+	*/
+	char *end;
+	const char *seq;
+	while (len && (line[len-1] == '\r' || line[len-1] == ',')){
+		len--; // longpoll rows end with a comma
+	}
+	end = line + len;
+	if (!len || line[0] != '{'){
+		// a heartbeat, or longpoll framing: {"results":[ ], "last_seq":...}
+		if (len > strlen("\"last_seq\"") && !strncmp(line, "\"last_seq\"", strlen("\"last_seq\""))){
+			seq = pj_skip_space(line + strlen("\"last_seq\""), end);
+			if (seq < end && *seq == ':'){
+				pc_set_since(pc, seq + 1, end);
+			}
+		}
+		return 1;
+	}
+	if (!pj_find_member(line, end, "changes")){
+		// {"last_seq":...} ends a continuous feed that timed out
+		if ((seq = pj_find_member(line, end, "last_seq"))){
+			pc_set_since(pc, seq, end);
+		}
+		return 1;
+	}
+	if ((seq = pj_find_member(line, end, "seq"))){
+		pc_set_since(pc, seq, end);
+	}
+	pc->changes++;
+	pc->in_cb = 1;
+	pc->cb(pc, line, len);
+	pc->in_cb = 0;
+	return !pc->stopping;
+}
+static int pc_grow(PouchChanges *pc, size_t cap){
+	// resizes the partial line buffer; -1, leaving it be, if that fails
+	char *line = (char *)realloc(pc->line, cap);
+	if (!line){
+		return -1;
+	}
+	pc->line = line;
+	pc->cap = cap;
+	return 0;
+}
+static size_t pc_sink(PouchReq *pr, char *ptr, size_t len, void *data){
+	/*
+		Splits the feed into lines as chunks arrive. Complete
+		lines are handed over straight from libcurl's buffer;
+		only a line split across chunks is copied.
+	*/
+	PouchChanges *pc = (PouchChanges *)data;
+	char *p = ptr, *end = ptr + len, *nl;
+	if (!ptr){
+		pc->len = 0; // a partial line at the very end is incomplete
+		return 0;
+	}
+	pc_kick_watchdog(pc);
+	while ((nl = memchr(p, '\n', end - p))){
+		int ok;
+		if (pc->len){ // finish the line started in an earlier chunk
+			size_t more = nl - p;
+			if (pc->len + more > pc->cap && pc_grow(pc, pc->len + more)){
+				pc->len = 0;
+				return 0; // out of memory: abort, and reconnect
+			}
+			memcpy(pc->line + pc->len, p, more);
+			ok = pc_line(pc, pc->line, pc->len + more);
+			pc->len = 0;
+		} else {
+			ok = pc_line(pc, p, nl - p);
+		}
+		if (!ok){
+			return 0; // abort the transfer; pc_done() frees pc
+		}
+		p = nl + 1;
+	}
+	if (p < end){ // keep the start of the next line
+		if (pc->len + (end - p) > pc->max_line){
+			fprintf(stderr, "pc_sink: line longer than %zu bytes, reconnecting\n", pc->max_line);
+			pc->len = 0;
+			return 0;
+		}
+		if (pc->len + (end - p) > pc->cap && pc_grow(pc, (pc->len + (end - p))*2)){
+			pc->len = 0;
+			return 0;
+		}
+		memcpy(pc->line + pc->len, p, end - p);
+		pc->len += end - p;
+	}
+	return len;
+}
+static int pc_done(PouchReq *pr, void *data){
+	/*
+		The feed request ended: reopen it from the last
+		seq, right away if it ended cleanly, or after a
+		growing delay if it failed.
+	*/
+	PouchChanges *pc = (PouchChanges *)data;
+	if (pc->stopping){
+		pc_free(pc);
+		return 1;
+	}
+	if (pr->curlcode == CURLE_OK && pr->httpresponse == 200){
+		pc->retry_delay = 1000;
+		pc_schedule(pc, 0);
+	} else {
+		pc_schedule(pc, pc->retry_delay);
+		pc->retry_delay = pc->retry_delay*2 > 30000 ? 30000 : pc->retry_delay*2;
+	}
+	return 1;
+}
+static void pc_watchdog_cb(int fd, short kind, void *userp){
+	/*
+		Nothing (not even a heartbeat) arrived for too long;
+		the connection is probably dead, so drop it.
+	*/
+	PouchChanges *pc = (PouchChanges *)userp;
+	if (pc->pr->multi){
+		curl_multi_remove_handle(pc->pr->multi, pc->pr->easy);
+		pc->pr->multi = NULL;
+	}
+	pc_schedule(pc, 0);
+}
+static void pc_retry_cb(int fd, short kind, void *userp){
+	PouchChanges *pc = (PouchChanges *)userp;
+	pc->reconnects++;
+	pc_connect(pc);
+}
+static void pc_connect(PouchChanges *pc){
+	/*
+		(Re)opens the feed from pc->since.
+	*/
+	char buf[32];
+	PouchReq *pr = pc->pr;
+	if (pr->multi){
+		curl_multi_remove_handle(pr->multi, pr->easy);
+		pr->multi = NULL;
+	}
+	if (pr->headers){ // pr_domulti() adds them again
+		curl_slist_free_all(pr->headers);
+		pr->headers = NULL;
+	}
+	pr = db_get_changes(pr, pc->server, pc->db);
+	pr_add_param(pr, "feed", pc->feed == POUCH_FEED_LONGPOLL ? "longpoll" : "continuous");
+	sprintf(buf, "%ld", pc->heartbeat);
+	pr_add_param(pr, "heartbeat", buf);
+	if (pc->since){
+		char *since = curl_easy_escape(pr->easy, pc->since, strlen(pc->since));
+		pr_add_param(pr, "since", since);
+		curl_free(since);
+	}
+	if (pc->params){
+		pr->url = combine(&(pr->url), pr->url, pc->params, "&");
+	}
+	pc->len = 0;
+	pr_domulti(pr, pc->pmi->multi);
+	pc_kick_watchdog(pc);
+}
+PouchChanges *pc_init(PouchMInfo *pmi, char *server, char *db, pc_change_cb cb, void *custom){
+	/*
+		Creates a consumer for the _changes feed of /db/ on
+		/server/, delivering changes to cb from pmi's event loop.
+		Set authentication on pc->pr, then call pc_start().
+	*/
+	PouchChanges *pc = (PouchChanges *)calloc(1, sizeof(PouchChanges));
+	if (!pc){
+		return NULL;
+	}
+	pc->pmi = pmi;
+	pc->pr = pr_init();
+	pc->pr->easy = curl_easy_init(); // pr_domulti() reuses it; needed for escaping
+	pr_set_timeout(pc->pr, 0);
+	pr_set_sink(pc->pr, pc_sink, pc);
+	pc->pr->done = pc_done;
+	pc->pr->done_data = pc;
+	pc->server = strdup(server);
+	pc->db = strdup(db);
+	pc->feed = POUCH_FEED_CONTINUOUS;
+	pc->heartbeat = 10000;
+	pc->max_line = 16*1024*1024;
+	pc->retry_delay = 1000;
+	pc->cb = cb;
+	pc->custom = custom;
+	pc->watchdog = evtimer_new(pmi->base, pc_watchdog_cb, (void *)pc);
+	pc->retry = evtimer_new(pmi->base, pc_retry_cb, (void *)pc);
+	return pc;
+}
+PouchChanges *pc_set_params(PouchChanges *pc, int feed, long heartbeat, char *params){
+	/*
+		Chooses the feed type (POUCH_FEED_CONTINUOUS or
+		POUCH_FEED_LONGPOLL), the heartbeat interval in ms,
+		and extra query parameters such as "include_docs=true"
+		or "filter=app/important" (may be NULL).
+	*/
+	pc->feed = feed;
+	pc->heartbeat = heartbeat;
+	free(pc->params);
+	pc->params = params ? strdup(params) : NULL;
+	return pc;
+}
+PouchChanges *pc_start(PouchChanges *pc, char *since){
+	/*
+		Opens the feed, starting after the change with
+		seq since ("now" for new changes only, NULL for
+		the beginning of the database).
+	*/
+	free(pc->since);
+	pc->since = since ? strdup(since) : NULL;
+	pc_connect(pc);
+	return pc;
+}
+void pc_stop(PouchChanges *pc){
+	/*
+		Closes the feed and frees the consumer.
+		Safe to call from the change callback.
+	*/
+	if (pc->in_cb){
+		pc->stopping = 1; // pc_sink() aborts the transfer, pc_done() frees
+		return;
+	}
+	pc_free(pc);
+}
+
+// PouchBulk on the multi interface
+typedef struct _PouchBulkExt {
+	PouchMInfo *pmi;
+	struct event *timer;	// flushes a batch after max_latency
+} PouchBulkExt;
+typedef struct _PouchBulkFlush {
+	PouchBulk *pb;
+	size_t count;			// documents in this flush
+} PouchBulkFlush;
+static int pb_multi_done(PouchReq *pr, void *data){
+	/*
+		Reports the results of a finished flush and
+		frees its request.
+	*/
+	PouchBulkFlush *f = (PouchBulkFlush *)data;
+	PouchBulk *pb = f->pb;
+	pb_report(pb, pr, f->count);
+	free(f);
+	pr_free(pr);
+	pb->inflight--;
+	if (pb->closing && !pb->inflight){
+		pb_free(pb);
+	}
+	return 1;
+}
+static void pb_multi_submit(PouchBulk *pb, PouchReq *pr, size_t count){
+	PouchBulkExt *ext = (PouchBulkExt *)pb->ext;
+	PouchBulkFlush *f = (PouchBulkFlush *)malloc(sizeof(PouchBulkFlush));
+	if (!f){	// out of memory: send this batch synchronously instead
+		pr_do(pr);
+		pb_report(pb, pr, count);
+		pr_free(pr);
+		pb->inflight--;	// as pb_multi_done(), but pb_flush() is still running
+		return;
+	}
+	f->pb = pb;
+	f->count = count;
+	pr->done = pb_multi_done;
+	pr->done_data = f;
+	pr_domulti(pr, ext->pmi->multi);
+}
+static void pb_timer_cb(int fd, short kind, void *userp){
+	pb_flush((PouchBulk *)userp);
+}
+static void pb_multi_arm(PouchBulk *pb, int on){
+	PouchBulkExt *ext = (PouchBulkExt *)pb->ext;
+	if (on){
+		struct timeval timeout;
+		timeout.tv_sec = pb->max_latency/1000;
+		timeout.tv_usec = (pb->max_latency%1000)*1000;
+		evtimer_add(ext->timer, &timeout);
+	}
+	else if (evtimer_pending(ext->timer, NULL)){
+		evtimer_del(ext->timer);
+	}
+}
+static void pb_multi_release(PouchBulk *pb){
+	PouchBulkExt *ext = (PouchBulkExt *)pb->ext;
+	event_free(ext->timer);
+	free(ext);
+	pb->ext = NULL;
+}
+PouchBulk *pb_use_pmi(PouchBulk *pb, PouchMInfo *pmi){
+	/*
+		Sends this bulk writer's flushes through the
+		multi interface of pmi instead of pr_do(). Batches
+		are then flushed by a libevent timer once their oldest
+		document is max_latency ms old, and results are reported
+		from the event loop. Flush requests never reach pmi->cb.
+	*/
+	PouchBulkExt *ext = (PouchBulkExt *)calloc(1, sizeof(PouchBulkExt));
+	if (!ext){
+		return pb;
+	}
+	ext->pmi = pmi;
+	ext->timer = evtimer_new(pmi->base, pb_timer_cb, (void *)pb);
+	pb->ext = ext;
+	pb->submit = pb_multi_submit;
+	pb->arm = pb_multi_arm;
+	pb->release = pb_multi_release;
+	return pb;
+}
\ No newline at end of file
@@ -23,6 +23,7 @@
 
 // Pouch helpers
 #include "pouch.h"
+#include "pouch_stats.h"
 
 // Defines
 #define USE_SYS_FILE 0
@@ -33,15 +34,38 @@
 #define COPY "COPY"
 #define DELETE "DELETE"
 
+#define POUCH_FEED_CONTINUOUS 0
+#define POUCH_FEED_LONGPOLL 1
+
+// HTTP versions for pmi_set_http2()
+#define POUCH_HTTP1 0			// one request per connection at a time
+#define POUCH_HTTP2 1			// negotiate HTTP/2 on https URLs (ALPN)
+#define POUCH_HTTP2_PRIOR 2		// cleartext HTTP/2 without negotiation (h2c)
+
+// How pp_submit() picks a worker
+#define POUCH_POOL_LEAST 0		// the one with the fewest requests outstanding
+#define POUCH_POOL_HOST 1		// always the same one for a given host
+
 // Structs
 typedef struct _SockInfo SockInfo;
 typedef struct _PouchMInfo PouchMInfo;
+typedef struct _PouchChanges PouchChanges;
+typedef struct _PouchHost PouchHost;
+typedef struct _PouchRetry PouchRetry;
+typedef struct _PouchWorker PouchWorker;
+typedef struct _PouchPool PouchPool;
 /*
 	If a pr_proc_cb is set by the user, that function
 	becomes responsible for pr_free()'ing the received
 	PouchReq.
 */
 typedef void (*pr_proc_cb)(PouchReq *, PouchMInfo *); // callback function for processing finished PouchReqs
+/*
+	Called once per change received on a _changes feed.
+	line points at the JSON text of the change, which is
+	NOT null terminated and only valid during the call.
+*/
+typedef void (*pc_change_cb)(PouchChanges *, char *line, size_t len);
 struct _SockInfo {
 	/*
 		Used in the multi interface only.
@@ -54,6 +78,18 @@ struct _SockInfo {
 	int ev_is_set;			// whether or not ev is set and being monitored
 	int action;				// what action libcurl wants done
 };
+struct _PouchHost {
+	/*
+		Used by pmi_submit() to limit and queue the
+		requests sent to one scheme://host:port.
+	*/
+	char *name;
+	size_t inflight;		// requests to this host running
+	PouchReq *head;			// oldest request waiting for this host
+	PouchReq *tail;
+	size_t queued;
+	PouchHost *next;
+};
 struct _PouchMInfo {
 	/*
 		Used in the multi interface only.
@@ -72,6 +108,86 @@ struct _PouchMInfo {
 	pr_proc_cb cb;		// USER DEFINED pointer to a callback function for processing finished PouchReqs
 	int has_cb;			// ... tests for existence of callback function
 	void *custom;				// USER DEFINED pointer to some data. 
+	size_t max_inflight;		// requests pmi_submit() lets run at once (0 = no limit) ...
+	size_t max_per_host;		// ... to any one host (0 = no limit) ...
+	size_t max_queued;			// ... and lets wait (0 = no limit)
+	size_t inflight;			// requests from pmi_submit() running
+	size_t queued;				// ... and waiting
+	PouchHost *hosts;			// every host pmi_submit() has seen
+	PouchHost *next_host;		// where the next admission round starts
+	long http_version;			// given to requests started by pmi_submit(), see pmi_set_http2()
+	PouchWorker *worker;		// set if this PouchMInfo belongs to a PouchPool
+	PouchReq *inbox;			// requests pushed by pmi_send(), newest first (atomic)
+	int inbox_woken;			// a wake-up is pending on inbox_fd (atomic)
+	int inbox_fd;				// eventfd that wakes the loop, or -1 (see pmi_open_inbox())
+	struct event *inbox_ev;
+	PouchReq *backlog;			// taken from the inbox, but refused by pmi_submit() for now
+	PouchReq *backlog_tail;
+	PouchStats *stats;			// every finished try is recorded here, if set
+	PouchRetry *retries;		// requests waiting to be tried again
+	int closing;				// set by pr_del_pmi()
+};
+struct _PouchChanges {
+	/*
+		A long-lived consumer of a database's _changes
+		feed, driven by a PouchMInfo. The response is split
+		into lines as it arrives and every change is handed to
+		cb; at most one partial line is ever buffered. When the
+		connection ends, times out, or stays silent for three
+		heartbeats, the feed is reopened from the last seq seen.
+	*/
+	PouchMInfo *pmi;
+	PouchReq *pr;			// the feed request; set usrpwd/share on it before pc_start()
+	char *server;
+	char *db;
+	char *params;			// extra query parameters, e.g. "include_docs=true", or NULL
+	char *since;			// seq of the last change seen, or NULL
+	int feed;				// POUCH_FEED_CONTINUOUS or POUCH_FEED_LONGPOLL
+	long heartbeat;			// milliseconds between heartbeats sent by the server
+	char *line;				// holds a line split across chunks
+	size_t len;				// bytes used in line
+	size_t cap;				// bytes allocated for line
+	size_t max_line;		// longest line accepted
+	long retry_delay;		// ms to wait before reconnecting after an error; doubles up to 30s
+	struct event *watchdog;	// fires when the server has been silent too long
+	struct event *retry;	// reconnects the feed
+	int in_cb;				// inside cb, so pc_stop() must be deferred
+	int stopping;
+	size_t changes;			// number of changes delivered
+	size_t reconnects;		// number of times the feed was reopened
+	pc_change_cb cb;		// USER DEFINED per-change callback
+	void *custom;			// USER DEFINED pointer to some data
+};
+
+struct _PouchWorker {
+	/*
+		One thread of a PouchPool, running its own
+		event_base and PouchMInfo. pp_submit() hands
+		it requests through pmi_send().
+	*/
+	PouchPool *pool;
+	int index;				// position in pool->workers
+	pthread_t thread;
+	int started;
+	PouchMInfo *pmi;		// set limits, HTTP/2, ... on it before pp_start()
+	size_t outstanding;		// submitted and not finished yet (atomic)
+};
+struct _PouchPool {
+	/*
+		A fixed set of worker threads, each with its own
+		event loop and multi handle, so that socket events,
+		libcurl and the callbacks processing responses are
+		spread over several cores. cb runs on the worker
+		thread that made the request.
+	*/
+	PouchWorker *workers;
+	int nworkers;
+	int policy;				// POUCH_POOL_LEAST or POUCH_POOL_HOST
+	int first_cpu;			// pin worker i to CPU first_cpu + i, if >= 0
+	int stopping;			// (atomic)
+	pthread_mutex_t lock;	// taken to signal and wait for idle
+	pthread_cond_t idle;	// signalled when outstanding drops to 0
+	size_t outstanding;		// requests submitted and not finished, in all (atomic)
 };
 
 // libevent/libcurl multi interface helpers and callbacks
@@ -85,5 +201,30 @@ int sock_cb(CURL *e, curl_socket_t s, int action, void *cbp, void *sockp);
 PouchMInfo *pr_mk_pmi(struct event_base *base, struct evdns_base *dns_base, pr_proc_cb callback, void *custom);
 void pmi_multi_cleanup(PouchMInfo *pmi);
 void pr_del_pmi(PouchMInfo *pmi);
+PouchMInfo *pmi_set_limits(PouchMInfo *pmi, size_t max_inflight, size_t max_per_host, size_t max_queued);
+int pmi_submit(PouchMInfo *pmi, PouchReq *pr);
+int pmi_submit_wait(PouchMInfo *pmi, PouchReq *pr);
+PouchMInfo *pmi_set_http2(PouchMInfo *pmi, int mode, long max_streams);
+PouchMInfo *pmi_set_stats(PouchMInfo *pmi, PouchStats *stats);
+int pmi_open_inbox(PouchMInfo *pmi);
+int pmi_send(PouchMInfo *pmi, PouchReq *pr);
+void pmi_close_inbox(PouchMInfo *pmi);
+
+// Worker thread pools
+PouchPool *pp_init(int nworkers, int policy, pr_proc_cb callback, void *custom);
+PouchPool *pp_set_affinity(PouchPool *pool, int first_cpu);
+int pp_start(PouchPool *pool);
+int pp_submit(PouchPool *pool, PouchReq *pr);
+void pp_wait(PouchPool *pool);
+void pp_free(PouchPool *pool);
+
+// Continuous _changes feeds
+PouchChanges *pc_init(PouchMInfo *pmi, char *server, char *db, pc_change_cb cb, void *custom);
+PouchChanges *pc_set_params(PouchChanges *pc, int feed, long heartbeat, char *params);
+PouchChanges *pc_start(PouchChanges *pc, char *since);
+void pc_stop(PouchChanges *pc);
+
+// PouchBulk on the multi interface
+PouchBulk *pb_use_pmi(PouchBulk *pb, PouchMInfo *pmi);
 
 #endif
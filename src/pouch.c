@@ -1,17 +1,103 @@
 // Standard libraries
 #include <sys/stat.h>
 #include <ctype.h>
+#include <limits.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <string.h>
 #include <stdio.h>
 #include <fcntl.h>
 #include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
 
 // Libcurl
 #include <curl/curl.h>
 
+// zlib, to gzip request bodies
+#include <zlib.h>
+
 #include "pouch.h"
 
+static pthread_once_t pouch_once = PTHREAD_ONCE_INIT;
+static void pouch_global_init_once(void){
+	curl_global_init(CURL_GLOBAL_ALL);
+}
+void pr_global_init(void){
+	/*
+	   Initializes libcurl's global state exactly once
+	   per process. Called automatically by pr_init() and
+	   pr_mk_pmi(), but it is safest to call it from
+	   main() before any threads are started.
+	 */
+	pthread_once(&pouch_once, pouch_global_init_once);
+}
+
+// PouchShare functions
+static void share_lock_cb(CURL *handle, curl_lock_data data, curl_lock_access access, void *userptr){
+	PouchShare *ps = (PouchShare *)userptr;
+	pthread_mutex_lock(&ps->locks[data]);
+}
+static void share_unlock_cb(CURL *handle, curl_lock_data data, void *userptr){
+	PouchShare *ps = (PouchShare *)userptr;
+	pthread_mutex_unlock(&ps->locks[data]);
+}
+PouchShare *pr_mk_share(int flags){
+	/*
+	   Creates a share context holding the caches selected
+	   by flags (POUCH_SHARE_DNS, POUCH_SHARE_SSL and/or
+	   POUCH_SHARE_CONNECT). DNS and TLS session caches may be
+	   shared between threads. libcurl does not support using a
+	   shared connection pool from several threads at once, so only
+	   use POUCH_SHARE_CONNECT when every attached request runs
+	   on the same thread (e.g. several PouchMInfos on one loop).
+	 */
+	int i;
+	pr_global_init();
+	PouchShare *ps = (PouchShare *)calloc(1, sizeof(PouchShare));
+	if (!ps){
+		return NULL;
+	}
+	ps->share = curl_share_init();
+	if (!ps->share){
+		free(ps);
+		return NULL;
+	}
+	ps->flags = flags;
+	for (i = 0; i < CURL_LOCK_DATA_LAST; i++){
+		pthread_mutex_init(&ps->locks[i], NULL);
+	}
+	curl_share_setopt(ps->share, CURLSHOPT_LOCKFUNC, share_lock_cb);
+	curl_share_setopt(ps->share, CURLSHOPT_UNLOCKFUNC, share_unlock_cb);
+	curl_share_setopt(ps->share, CURLSHOPT_USERDATA, (void *)ps);
+	if (flags & POUCH_SHARE_DNS)
+		curl_share_setopt(ps->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+	if (flags & POUCH_SHARE_SSL)
+		curl_share_setopt(ps->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+	if (flags & POUCH_SHARE_CONNECT)
+		curl_share_setopt(ps->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+	return ps;
+}
+void pr_del_share(PouchShare *ps){
+	/*
+	   Frees a share context. Every PouchReq attached
+	   to it must have been pr_free()'d first.
+	 */
+	int i;
+	if (!ps){
+		return;
+	}
+	if (curl_share_cleanup(ps->share) != CURLSHE_OK){
+		fprintf(stderr, "pr_del_share: share %p is still in use\n", (void *)ps);
+		return;
+	}
+	for (i = 0; i < CURL_LOCK_DATA_LAST; i++){
+		pthread_mutex_destroy(&ps->locks[i]);
+	}
+	free(ps);
+}
+
 // Miscellaneous helper functions
 char *url_escape(CURL *curl, char *str){
 	/*
@@ -64,12 +150,9 @@ char *doc_get_cur_rev(PouchReq * pr, char *server, char *db, char *id){
 	memset(buf, 0, length + 1);
 	strncpy(buf, etag_begin + 1, length);
 
-	if (pr->resp.data){
-		free(pr->resp.data);
-	}
-	pr->resp.data = (char *)malloc(length + 1);
-	memset(pr->resp.data, 0, length + 1);
-	strncpy(pr->resp.data, buf, length + 1);
+	// the revision is shorter than the headers, so it fits in place
+	memmove(pr->resp.data, buf, length + 1);
+	pr->resp.size = length;
 
 	return buf;
 }
@@ -80,15 +163,22 @@ PouchReq *pr_init(void){
 	   Initializes a new PouchReq
 	   object.
 	 */
+	pr_global_init();
 	PouchReq *pr = calloc(1, sizeof(PouchReq));
 
 	// initializes the request buffer
 	pr->req.offset = pr->req.data = NULL;
 	pr->req.size = 0;
+	pr->req.fd = -1;
 
 	// initializes the response buffer
 	pr->resp.offset = pr->resp.data = NULL;
 	pr->resp.size = 0;
+	pr->resp.fd = -1;
+	pr->resp.cap = 0;
+	pr->resp_keep = 1024*1024;
+	pr->retry_after = -1;
+	pr->encodings = "";	// accept compressed responses
 
 	return pr;
 }
@@ -99,6 +189,21 @@ PouchReq *pr_add_header(PouchReq *pr, char *h){
 	pr->headers = curl_slist_append(pr->headers, h);
 	return pr;
 }
+PouchReq *pr_clear_headers(PouchReq *pr){
+	/*
+	   Removes all custom headers from a request. pr_do()
+	   and the multi interface call it once a request has
+	   finished, so a reused PouchReq starts without them.
+	 */
+	if (pr->headers){
+		if (pr->easy){	// the handle must not point at the freed list
+			curl_easy_setopt(pr->easy, CURLOPT_HTTPHEADER, NULL);
+		}
+		curl_slist_free_all(pr->headers);
+		pr->headers = NULL;
+	}
+	return pr;
+}
 PouchReq *pr_add_usrpwd(PouchReq *pr, char *usrpwd, size_t length){
 	if (pr->usrpwd){
 		free(pr->usrpwd);
@@ -112,18 +217,16 @@ PouchReq *pr_add_param(PouchReq *pr, char *key, char *value){
 	   Adds a parameter to a request's URL string,
 	   regardless of whether or not other parameters already exist.
 	 */
-	pr->url = (char *)realloc(pr->url, // 3: new ? or &, new =, new '\0'
-			strlen(pr->url) + 3 + sizeof(char)*(strlen(key)+strlen(value)));
-	if (strchr(pr->url, '?') == NULL){
-		strcat(pr->url, "?");
-	}
-	else{
-		strcat(pr->url, "&");
+	size_t ulen = strlen(pr->url), klen = strlen(key), vlen = strlen(value);
+	char *url = (char *)realloc(pr->url, ulen + klen + vlen + 3); // 3: new ? or &, new =, new '\0'
+	if (!url){
+		return pr;
 	}
-	strcat(pr->url, key);
-	strcat(pr->url, "=");
-	strcat(pr->url, value);
-	strcat(pr->url, "\0");
+	url[ulen] = strchr(url, '?') ? '&' : '?';
+	memcpy(url + ulen + 1, key, klen);
+	url[ulen + 1 + klen] = '=';
+	memcpy(url + ulen + 2 + klen, value, vlen + 1);	// includes the '\0'
+	pr->url = url;
 	return pr;
 }
 PouchReq *pr_clear_params(PouchReq *pr){
@@ -154,12 +257,15 @@ PouchReq *pr_set_method(PouchReq *pr, char *method){
 	memcpy(pr->method, method, length);	 // copy the method
 	return pr;
 }
+static int pdb_done(PouchReq *pr, void *data);
+static void pdb_drop(PouchReq *pr);
 PouchReq *pr_set_url(PouchReq *pr, char *url){
 	/*
 	   Sets the target URL of
 	   a CouchDB request.
 	 */
 	size_t length = strlen(url)+1; // include '\0' terminator
+	pdb_drop(pr);	// no longer a PouchDb request
 	if (pr->url)	// if there is an older url, get rid of it
 		free(pr->url);
 	pr->url = (char *)malloc(length); // allocate space
@@ -167,6 +273,406 @@ PouchReq *pr_set_url(PouchReq *pr, char *url){
 
 	return pr;
 }
+static size_t path_escape(char *out, const char *seg){
+	/*
+	   Percent-encodes everything but unreserved characters,
+	   writing to out if it isn't NULL. Returns the length
+	   of the encoded segment.
+	   A "_design/" segment keeps all of its slashes, so
+	   "_design/app/_view/by_x" still names the view; a
+	   "_local/" one keeps only the slash after the prefix.
+	 */
+	static const char hex[] = "0123456789ABCDEF";
+	size_t len = 0;
+	const unsigned char *c;
+	int design = !strncmp(seg, "_design/", 8);
+	if (design || !strncmp(seg, "_local/", 7)){
+		len = strchr(seg, '/') - seg + 1;
+		if (out){
+			memcpy(out, seg, len);
+		}
+	}
+	for (c = (const unsigned char *)seg + len; *c; c++){
+		if ((*c >= 'a' && *c <= 'z') || (*c >= 'A' && *c <= 'Z')
+				|| (*c >= '0' && *c <= '9') || strchr("-._~", *c)
+				|| (*c == '/' && design)){
+			if (out){
+				out[len] = *c;
+			}
+			len++;
+		}
+		else {
+			if (out){
+				out[len] = '%';
+				out[len + 1] = hex[*c >> 4];
+				out[len + 2] = hex[*c & 15];
+			}
+			len += 3;
+		}
+	}
+	return len;
+}
+static PouchReq *set_path(PouchReq *pr, const char *base, size_t blen, va_list ap){
+	// base is copied as is, the segments are escaped
+	va_list again;
+	char *seg, *url;
+	size_t len = blen + 1;	// '\0'
+	va_copy(again, ap);
+	while ((seg = va_arg(ap, char *))){
+		len += 1 + path_escape(NULL, seg);
+	}
+	if (!(url = (char *)malloc(len))){
+		va_end(again);
+		return pr;
+	}
+	memcpy(url, base, blen);
+	len = blen;
+	pdb_drop(pr);	// pdb_set_path() sets it again
+	while ((seg = va_arg(again, char *))){
+		url[len++] = '/';
+		len += path_escape(url + len, seg);
+	}
+	va_end(again);
+	url[len] = '\0';
+	if (pr->url){
+		free(pr->url);
+	}
+	pr->url = url;
+	return pr;
+}
+PouchReq *pr_set_path(PouchReq *pr, char *server, ...){
+	/*
+	   Sets the target URL to server followed by a
+	   NULL-terminated list of path segments, each
+	   URL escaped and joined with '/'. The URL is
+	   built in a single allocation, e.g.
+		pr_set_path(pr, server, db, id, NULL);
+	 */
+	va_list ap;
+	size_t slen = strlen(server);
+	if (slen && server[slen - 1] == '/'){
+		slen--;
+	}
+	va_start(ap, server);
+	set_path(pr, server, slen, ap);
+	va_end(ap);
+	return pr;
+}
+PouchReq *pr_set_share(PouchReq *pr, PouchShare *ps){
+	/*
+	   Attaches a request to a share context, so that it
+	   reuses DNS lookups, TLS sessions and (optionally)
+	   connections made by other requests attached to it.
+	   Pass NULL to detach.
+	 */
+	pr->share = ps;
+	return pr;
+}
+PouchReq *pr_set_timeout(PouchReq *pr, long seconds){
+	/*
+	   Sets the maximum time a request may take, overriding
+	   the defaults of pr_do() and pr_domulti(). 0 means
+	   no limit, e.g. for long-lived _changes feeds.
+	 */
+	pr->timeout = seconds;
+	pr->has_timeout = 1;
+	return pr;
+}
+PouchReq *pr_set_retry(PouchReq *pr, int max_attempts, long base_ms, long max_ms, long deadline_ms){
+	/*
+	   Retries requests that fail for transient reasons
+	   (connection errors, timeouts, HTTP 429/502/503/504)
+	   up to max_attempts tries in all. The waits start at
+	   base_ms and double up to max_ms, with random jitter,
+	   or follow the server's Retry-After. No retry starts
+	   after deadline_ms (0 = no limit). POSTs are only
+	   retried if they never reached the server, unless
+	   pr_set_retry_posts() says they are safe to repeat.
+	 */
+	pr->max_attempts = max_attempts;
+	pr->retry_base = base_ms;
+	pr->retry_max = max_ms;
+	pr->retry_deadline = deadline_ms;
+	return pr;
+}
+PouchReq *pr_set_retry_posts(PouchReq *pr, int retry_posts){
+	/*
+	   Marks the POSTs made with pr as safe to repeat,
+	   e.g. the read-only ones of doc_get_many().
+	 */
+	pr->retry_posts = retry_posts;
+	return pr;
+}
+PouchReq *pr_set_http_version(PouchReq *pr, long version){
+	/*
+	   Asks for an HTTP version, e.g. CURL_HTTP_VERSION_2TLS
+	   to negotiate HTTP/2 on https URLs, or
+	   CURL_HTTP_VERSION_2_PRIOR_KNOWLEDGE for servers that
+	   speak cleartext HTTP/2. 0 restores libcurl's default.
+	 */
+	pr->http_version = version;
+	return pr;
+}
+PouchReq *pr_set_encodings(PouchReq *pr, const char *encodings){
+	/*
+	   Sets the Accept-Encoding offered to the server.
+	   By default ("") it lists every encoding libcurl
+	   can decode (gzip, deflate, ...), and compressed
+	   responses are decoded before they reach pr->resp
+	   or the sink. NULL turns compression off. The
+	   string is not copied.
+	 */
+	pr->encodings = encodings;
+	return pr;
+}
+PouchReq *pr_set_gzip(PouchReq *pr, size_t min_bytes, int level){
+	/*
+	   Compresses PUT and POST bodies of at least min_bytes
+	   bytes with gzip at zlib level (1 = fastest, 9 = smallest)
+	   and sends them with Content-Encoding: gzip. Smaller
+	   bodies, bodies read from files and bodies that don't
+	   shrink are sent as they are. 0 turns it off.
+	 */
+	pr->gzip_min = min_bytes;
+	pr->gzip_level = level;
+	return pr;
+}
+void pr_start_tries(PouchReq *pr){
+	// called when a request is first sent
+	pr->attempts = 0;
+	gettimeofday(&pr->first_try, NULL);
+}
+long pr_retry_delay(PouchReq *pr){
+	/*
+	   Called after each try of a request. Returns how
+	   many ms to wait before trying again, or -1 if it
+	   should not be retried.
+	 */
+	struct timeval now;
+	int reached;	// the server may have acted on the request
+	long delay;
+	int i;
+	if (pr->attempts >= pr->max_attempts){
+		return -1;
+	}
+	switch (pr->curlcode){
+		case CURLE_OK:
+			if (pr->httpresponse == 429){	// refused, so never acted on
+				reached = 0;
+			} else if (pr->httpresponse == 502 || pr->httpresponse == 503
+					|| pr->httpresponse == 504){
+				reached = 1;
+			} else {
+				return -1;
+			}
+			break;
+		case CURLE_COULDNT_RESOLVE_HOST:
+		case CURLE_COULDNT_CONNECT:
+			reached = 0;
+			break;
+		case CURLE_OPERATION_TIMEDOUT:
+		case CURLE_SEND_ERROR:
+		case CURLE_RECV_ERROR:
+		case CURLE_GOT_NOTHING:
+		case CURLE_PARTIAL_FILE:
+			reached = 1;
+			break;
+		default:
+			return -1;
+	}
+	if (reached && pr->method && !strcmp(pr->method, POST) && !pr->retry_posts){
+		return -1;	// not idempotent
+	}
+	if (reached && pr->sink){
+		return -1;	// the sink may have seen part of a body already
+	}
+	delay = pr->retry_base;	// base * 2^(attempts - 1), capped
+	for (i = 1; i < pr->attempts && delay < pr->retry_max; i++){
+		delay *= 2;
+	}
+	if (delay > pr->retry_max){
+		delay = pr->retry_max;
+	}
+	if (delay > 1){	// "equal jitter": between half and all of the wait
+		delay = delay/2 + random() % (delay/2 + 1);
+	}
+	if (pr->retry_after > delay){
+		delay = pr->retry_after;
+	}
+	if (pr->retry_deadline){
+		gettimeofday(&now, NULL);
+		if ((now.tv_sec - pr->first_try.tv_sec)*1000
+				+ (now.tv_usec - pr->first_try.tv_usec)/1000 + delay > pr->retry_deadline){
+			return -1;
+		}
+	}
+	return delay;
+}
+static void fd_sink_release(PouchReq *pr);
+PouchReq *pr_set_sink(PouchReq *pr, pr_sink_cb sink, void *data){
+	/*
+	   Streams response bodies to sink as they arrive
+	   instead of collecting them in pr->resp. Pass
+	   NULL to go back to buffering.
+	 */
+	fd_sink_release(pr);
+	pr->sink = sink;
+	pr->sink_data = data;
+	return pr;
+}
+#define FD_SINK_SIZE (1024*1024)	// bytes collected before each write
+#define FD_SINK_ALIGN 4096
+typedef struct {
+	int fd;
+	char *buf;		// FD_SINK_ALIGN aligned, FD_SINK_SIZE long
+	size_t len;		// bytes waiting in buf
+	int bypass;		// the response is an error: buffer it in resp instead
+} PouchFdSink;
+static int resp_append(PouchReq *pr, char *ptr, size_t len);
+static int fd_sink_write(int fd, char *ptr, size_t len){
+#ifdef O_DIRECT
+	int flags = -1;	// the caller's, while O_DIRECT is off
+#endif
+	int ret = 0;
+	while (len > 0){
+		ssize_t n = write(fd, ptr, len);
+		if (n < 0 && errno == EINTR){
+			continue;
+		}
+#ifdef O_DIRECT
+		if (n < 0 && errno == EINVAL && flags < 0
+				&& ((flags = fcntl(fd, F_GETFL)) & O_DIRECT)){
+			// an O_DIRECT file can't take the unaligned tail; write it normally
+			fcntl(fd, F_SETFL, flags & ~O_DIRECT);
+			continue;
+		}
+#endif
+		if (n <= 0){
+			ret = -1;
+			break;
+		}
+		ptr += n;
+		len -= n;
+	}
+#ifdef O_DIRECT
+	if (flags >= 0 && (flags & O_DIRECT)){	// give the fd back as it was
+		fcntl(fd, F_SETFL, flags);
+	}
+#endif
+	return ret;
+}
+static size_t fd_sink(PouchReq *pr, char *ptr, size_t len, void *data){
+	PouchFdSink *fs = (PouchFdSink *)data;
+	size_t done = 0;
+	if (!ptr){	// end of the body: write what is left
+		if (fs->len && !fs->bypass && fd_sink_write(fs->fd, fs->buf, fs->len)
+				&& !pr->curlcode){
+			pr->curlcode = CURLE_WRITE_ERROR;	// the file is short
+		}
+		fs->len = 0;
+		fs->bypass = -1;	// decide again for the next response
+		return 0;
+	}
+	if (fs->bypass < 0){
+		long code = 0;
+		curl_easy_getinfo(pr->easy, CURLINFO_RESPONSE_CODE, &code);
+		fs->bypass = code >= 300;
+	}
+	if (fs->bypass){	// keep error bodies readable in pr->resp
+		return resp_append(pr, ptr, len) ? len : 0;
+	}
+	// always staged: libcurl's buffer isn't aligned for O_DIRECT
+	while (done < len){
+		size_t n = len - done;
+		if (n > FD_SINK_SIZE - fs->len){
+			n = FD_SINK_SIZE - fs->len;
+		}
+		memcpy(fs->buf + fs->len, ptr + done, n);
+		fs->len += n;
+		done += n;
+		if (fs->len == FD_SINK_SIZE){
+			if (fd_sink_write(fs->fd, fs->buf, fs->len)){
+				return 0;	// abort the transfer
+			}
+			fs->len = 0;
+		}
+	}
+	return len;
+}
+static void fd_sink_release(PouchReq *pr){
+	if (pr->sink == fd_sink){
+		PouchFdSink *fs = (PouchFdSink *)pr->sink_data;
+		free(fs->buf);
+		free(fs);
+		pr->sink = NULL;
+		pr->sink_data = NULL;
+	}
+}
+PouchReq *pr_set_fdsink(PouchReq *pr, int fd){
+	/*
+	   Writes response bodies straight to the file
+	   descriptor fd, in large aligned blocks, so
+	   downloads don't have to fit in memory. Error
+	   responses (HTTP >= 300) still go to pr->resp.
+	   If the file can't be written in full, pr->curlcode
+	   is CURLE_WRITE_ERROR. fd may be opened O_DIRECT.
+	   fd is not closed; pass -1 to go back to buffering.
+	 */
+	PouchFdSink *fs;
+	pr_set_sink(pr, NULL, NULL);
+	if (fd < 0){
+		return pr;
+	}
+	if (!(fs = calloc(1, sizeof(PouchFdSink)))){
+		return pr;
+	}
+	if (posix_memalign((void **)&fs->buf, FD_SINK_ALIGN, FD_SINK_SIZE)){
+		free(fs);
+		return pr;
+	}
+	fs->fd = fd;
+	fs->bypass = -1;
+	return pr_set_sink(pr, fd_sink, fs);
+}
+static size_t parser_sink(PouchReq *pr, char *ptr, size_t len, void *data){
+	PouchJsonParser *parser = (PouchJsonParser *)data;
+	if (!ptr){
+		pj_finish(parser);
+		return 0;
+	}
+	return pj_feed(parser, ptr, len) ? 0 : len; // stop the transfer on errors
+}
+PouchReq *pr_set_parser(PouchReq *pr, PouchJsonParser *parser){
+	/*
+	   Feeds response bodies to parser as they arrive,
+	   so rows can be processed while the rest of the
+	   response is still downloading. Resets the parser;
+	   check parser->error once the request has finished.
+	 */
+	pj_parser_reset(parser);
+	return pr_set_sink(pr, parser_sink, parser);
+}
+static void pkt_release(PouchPkt *pkt){
+	/*
+	   Forgets the data of a packet, freeing
+	   it unless it was borrowed.
+	 */
+	if (pkt->data && !pkt->borrowed){
+		free(pkt->data);
+	}
+	if (pkt->fd >= 0){
+		close(pkt->fd);
+	}
+	pkt->fd = -1;
+	pkt->pos = 0;
+	pkt->data = pkt->offset = NULL;
+	pkt->size = 0;
+	pkt->cap = 0;
+	pkt->borrowed = 0;
+	pkt->segs = NULL;
+	pkt->nsegs = pkt->seg = pkt->segoff = 0;
+	pkt->packed = 0;
+}
 PouchReq *pr_set_data(PouchReq *pr, char *str){
 	/*
 	   Sets the data that a request
@@ -176,9 +682,7 @@ PouchReq *pr_set_data(PouchReq *pr, char *str){
 	   just refrain from calling the function.
 	 */
 	size_t length = strlen(str);
-	if (pr->req.data){	// free older data
-		free(pr->req.data);
-	}
+	pkt_release(&pr->req);	// free older data
 	// TODO: use strdup?
 	pr->req.data = (char *)malloc(length+1);	// allocate space, include '\0'
 	memset(pr->req.data, '\0', length+1);		// write nulls to the new space
@@ -193,49 +697,146 @@ PouchReq *pr_set_data(PouchReq *pr, char *str){
 	return pr;
 }
 PouchReq *pr_set_prdata(PouchReq *pr, char *str, size_t len){
-	if(pr->req.data){
-		free(pr->req.data);
-	}
+	pkt_release(&pr->req);
 	pr->req.data = str;
 	pr->req.offset = pr->req.data;
 	pr->req.size = len;
 	return pr;
 }
 PouchReq *pr_set_bdata(PouchReq *pr, void *dat, size_t length){
-	if (pr->req.data){
-		free(pr->req.data);
-	}
+	pkt_release(&pr->req);
 	pr->req.data = (char *)malloc(length);
 	memcpy(pr->req.data, dat, length);
 	pr->req.offset = pr->req.data;
 	pr->req.size = length;
 	return pr;
 }
+PouchReq *pr_borrow_data(PouchReq *pr, const void *dat, size_t length){
+	/*
+	   Sends length bytes at dat without copying them.
+	   pouch never frees borrowed data, so it must stay
+	   valid and unchanged until the request has finished.
+	 */
+	pkt_release(&pr->req);
+	pr->req.data = (char *)dat;
+	pr->req.offset = pr->req.data;
+	pr->req.size = length;
+	pr->req.borrowed = 1;
+	return pr;
+}
+PouchReq *pr_borrow_segs(PouchReq *pr, const struct iovec *segs, size_t nsegs){
+	/*
+	   Sends the concatenation of nsegs segments, e.g.
+	   pre-encoded documents and the separators between
+	   them, without joining them first. Neither the array
+	   nor the segments are copied or freed; both must stay
+	   valid until the request has finished.
+	 */
+	size_t i;
+	pkt_release(&pr->req);
+	pr->req.segs = segs;
+	pr->req.nsegs = nsegs;
+	pr->req.borrowed = 1;
+	for (i = 0; i < nsegs; i++){
+		pr->req.size += segs[i].iov_len;
+	}
+	return pr;
+}
+PouchReq *pr_set_fdata(PouchReq *pr, int fd, size_t length){
+	/*
+	   Sends length bytes read from the file descriptor fd,
+	   starting at its beginning. The file is streamed to CURL
+	   as it is sent, so memory use does not depend on its size.
+	   The request takes ownership of fd and closes it.
+	 */
+	pkt_release(&pr->req);
+	pr->req.fd = fd;
+	pr->req.size = length;
+#ifdef POSIX_FADV_SEQUENTIAL
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+	return pr;
+}
 PouchReq *pr_clear_data(PouchReq *pr){
 	/*
 	   Removes all data from a request's
 	   data buffer, if it exists.
 	 */
-	if (pr->req.data){
-		free(pr->req.data);
-		pr->req.data = NULL;
+	pkt_release(&pr->req);
+	return pr;
+}
+PouchReq *pr_clear_resp(PouchReq *pr){
+	/*
+	   Empties the response buffer. The allocation is
+	   kept for the next response unless it is larger
+	   than pr->resp_keep bytes.
+	 */
+	if (pr->resp.data && pr->resp.cap > pr->resp_keep){
+		free(pr->resp.data);
+		pr->resp.data = NULL;
+		pr->resp.cap = 0;
 	}
-	pr->req.size = 0;
+	if (pr->resp.data){
+		pr->resp.data[0] = '\0';
+	}
+	pr->resp.size = 0;
+	return pr;
+}
+PouchReq *pr_set_resp_keep(PouchReq *pr, size_t bytes){
+	/*
+	   Sets how large a response buffer may be and still
+	   be kept between requests (1 MB by default). Larger
+	   buffers are freed before the next request is made.
+	 */
+	pr->resp_keep = bytes;
 	return pr;
 }
+static int pkt_reserve(PouchPkt *pkt, size_t need){
+	/*
+	   Makes sure pkt->data can hold need bytes, growing
+	   it geometrically so that appending n bytes one
+	   chunk at a time costs O(log n) reallocations.
+	 */
+	size_t cap;
+	char *data;
+	if (need <= pkt->cap){
+		return 1;
+	}
+	cap = pkt->cap ? pkt->cap : 4096;
+	while (cap < need){
+		cap *= 2;
+	}
+	if ((data = (char *)realloc(pkt->data, cap)) == NULL){
+		return 0;
+	}
+	pkt->data = data;
+	pkt->cap = cap;
+	return 1;
+}
 PouchReq *pr_do(PouchReq * pr){
+	/*
+	   Performs a request synchronously. The CURL easy handle
+	   is kept in pr->easy and reused by the next call, so
+	   the connection to the server (and its TLS session)
+	   stays alive between requests made with the same PouchReq.
+	 */
 	CURL *curl;		// CURL object to make the requests
-	//pr->headers= NULL;    // Custom headers for uploading
 
 	// empty the response buffer
-	if (pr->resp.data){
-		free(pr->resp.data);
-	}
-	pr->resp.data = NULL;
-	pr->resp.size = 0;
+	pr_clear_resp(pr);
 
-	// initialize the CURL object
-	curl = curl_easy_init();
+	// reuse the CURL object from an earlier request, if there is one;
+	// curl_easy_reset() clears the options but keeps open connections
+	if (pr->easy){
+		if (pr->multi){	// a handle can't be performed while it's in a multi
+			curl_multi_remove_handle(pr->multi, pr->easy);
+			pr->multi = NULL;
+		}
+		curl_easy_reset(pr->easy);
+	} else {
+		pr->easy = curl_easy_init();
+	}
+	curl = pr->easy;
 	if (curl){
 		// Print the request
 		//printf("%s : %s\n", pr->method, pr->url);
@@ -244,27 +845,28 @@ PouchReq *pr_do(PouchReq * pr){
 		curl_easy_setopt(curl, CURLOPT_USERAGENT, "pouch/0.1");	// add user-agent
 		curl_easy_setopt(curl, CURLOPT_URL, pr->url);	// where to send this request
 		curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 2);	// maximum amount of time to create connection
-		curl_easy_setopt(curl, CURLOPT_TIMEOUT, 60);	// maximum amount of time to send data = 1 minute
+		curl_easy_setopt(curl, CURLOPT_TIMEOUT,	// maximum amount of time to send data = 1 minute
+				pr->has_timeout ? pr->timeout : 60);
 		curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1); // TODO: why? multithreading?
+		curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L); // keep idle connections open
+		if (pr->http_version){
+			curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, pr->http_version);
+		}
+		curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, pr->encodings);	// decompress responses
 		curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, recv_data_callback);	// where to store the response
 		curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)pr);
+		curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, recv_header_callback); // sizes the response buffer
+		curl_easy_setopt(curl, CURLOPT_HEADERDATA, (void *)pr);
+		if (pr->share){	// use the shared caches
+			curl_easy_setopt(curl, CURLOPT_SHARE, pr->share->share);
+		}
 		if (pr->usrpwd){	// if there's a valid auth string, use it
 			curl_easy_setopt(curl, CURLOPT_USERPWD, pr->usrpwd);
 		}
 
-		if (pr->req.data && pr->req.size > 0){	// check for data upload
-			//printf("--> %s\n", pr->req.data);
-			// let CURL know what data to send
-			curl_easy_setopt(curl, CURLOPT_READFUNCTION,
-					send_data_callback);
-			curl_easy_setopt(curl, CURLOPT_READDATA, (void *)pr);
-		}
-
-		if (!strncmp(pr->method, PUT, 3)){	// PUT-specific option
-			curl_easy_setopt(curl, CURLOPT_UPLOAD, 1);
-			// Note: Content-Type: application/json is automatically assumed
-		} else if (!strncmp(pr->method, POST, 4)){	// POST-specific options
-			curl_easy_setopt(curl, CURLOPT_POST, 1);
+		// let CURL know what data to send
+		pr_setopt_body(pr, curl);
+		if (!strncmp(pr->method, POST, 4)){	// POST-specific options
 			pr_add_header(pr, "Content-Type: application/json");
 		}
 
@@ -277,20 +879,35 @@ PouchReq *pr_do(PouchReq * pr){
 		}		// THIS FIXED HEAD REQUESTS
 
 		// add the custom headers
-		pr_add_header(pr, "Transfer-Encoding: chunked");
 		curl_easy_setopt(curl, CURLOPT_HTTPHEADER, pr->headers);
 
-		// make the request and store the response
-		pr->curlcode = curl_easy_perform(curl);
+		// make the request and store the response, trying
+		// again as long as pr_retry_delay() says so
+		pr_start_tries(pr);
+		for (;;){
+			long delay;
+			pr->httpresponse = 0;
+			pr->retry_after = -1;
+			pr->attempts++;
+			pr->curlcode = curl_easy_perform(curl);
+			if (!pr->curlcode){
+				curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &pr->httpresponse);
+			}
+			pr_read_times(pr);
+			if ((delay = pr_retry_delay(pr)) < 0){
+				break;
+			}
+			struct timespec ts = {delay/1000, (delay%1000)*1000000};
+			nanosleep(&ts, NULL);
+			pr_clear_resp(pr);
+			pr_setopt_body(pr, curl);	// rewinds the body
+		}
 	} else {
 		// if we were unable to initialize a CURL object
 		pr->curlcode = 2;
 	}
 	// clean up
-	if (pr->headers){
-		curl_slist_free_all(pr->headers);	// free headers
-		pr->headers = NULL;
-	}
+	pr_clear_headers(pr);
 	if (!pr->curlcode){
 		pr->curlcode =
 			curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE,
@@ -298,7 +915,14 @@ PouchReq *pr_do(PouchReq * pr){
 		if (pr->curlcode != CURLE_OK)
 			pr->httpresponse = 500;
 	}
-	curl_easy_cleanup(curl);	// clean up the curl object
+	// the CURL object is kept for the next request; pr_free() cleans it up
+	pr_clear_data(pr);	// a body is only sent once
+	if (pr->sink){	// tell the sink the body is complete
+		pr->sink(pr, NULL, 0, pr->sink_data);
+	}
+	if (pr->done){
+		pr->done(pr, pr->done_data);
+	}
 
 	// Print the response
 	//printf("Received %d bytes, status = %d\n",
@@ -317,19 +941,17 @@ void pr_free(PouchReq *pr){
 	   leaks secret documents.
 	 */
 	if (pr->easy){	// free request and remove it from multi
-		int ret;
 		if (pr->multi){
-			ret = curl_multi_remove_handle(pr->multi, pr->easy);
-			printf("(%d) remd easy %p from multi %p\n", ret, pr->easy, pr->multi);
+			curl_multi_remove_handle(pr->multi, pr->easy);
 		}
-		curl_easy_cleanup(pr->easy);
-		printf("(?) clnd easy %p\n", pr->easy);
+		curl_easy_cleanup(pr->easy);	// closes any kept-alive connection
 	}
 	if (pr->resp.data){			// free response data
 		free(pr->resp.data);
-	}if (pr->req.data){
-		free(pr->req.data);		// free request data
-	}if (pr->method){			// free method string
+	}
+	pkt_release(&pr->req);		// free request data, unless borrowed
+	fd_sink_release(pr);
+	if (pr->method){			// free method string
 		free(pr->method);
 	}if (pr->url){				// free URL string
 		free(pr->url);
@@ -341,6 +963,682 @@ void pr_free(PouchReq *pr){
 	free(pr);				// free structure
 }
 
+// PouchBulk functions
+#define PB_HEAD "{\"docs\":["
+#define PB_TAIL "]}"
+static int pb_grow(PouchBulk *pb, size_t need){
+	/*
+	   Makes the batch buffer hold at least need bytes,
+	   growing it geometrically. Returns -1, leaving the
+	   batch untouched, if that can't be allocated.
+	 */
+	if (need > pb->cap){
+		size_t cap = pb->cap ? pb->cap : 4096;
+		char *docs;
+		while (cap < need){
+			cap *= 2;
+		}
+		if (!(docs = (char *)realloc(pb->docs, cap))){
+			return -1;
+		}
+		pb->docs = docs;
+		pb->cap = cap;
+	}
+	return 0;
+}
+static void pb_append(PouchBulk *pb, const char *str, size_t length){
+	// appends to the batch buffer, which pb_grow() has made room in
+	memcpy(pb->docs + pb->len, str, length);
+	pb->len += length;
+	pb->docs[pb->len] = '\0';
+}
+static long pb_age(PouchBulk *pb){
+	/*
+	   Milliseconds since the first document of
+	   the current batch was added.
+	 */
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - pb->first.tv_sec)*1000 + (now.tv_usec - pb->first.tv_usec)/1000;
+}
+PouchBulk *pb_init(char *server, char *db, pb_result_cb cb, void *custom){
+	/*
+	   Creates a bulk writer for the database /db/ on
+	   /server/. By default a batch is flushed at 1000 documents,
+	   1 MB or 1 second; change that with pb_set_limits(). Set
+	   authentication or a share context on pb->pr. Flushes are
+	   synchronous (pr_do()) unless pb_use_pmi() is called.
+	 */
+	PouchBulk *pb = (PouchBulk *)calloc(1, sizeof(PouchBulk));
+	if (!pb){
+		return NULL;
+	}
+	pb->pr = pr_init();
+	pr_set_path(pb->pr, server, db, "_bulk_docs", NULL);
+	pb->url = strdup(pb->pr->url);
+	pb->max_docs = 1000;
+	pb->max_bytes = 1024*1024;
+	pb->max_latency = 1000;
+	pb->cb = cb;
+	pb->custom = custom;
+	return pb;
+}
+PouchBulk *pb_set_limits(PouchBulk *pb, size_t max_docs, size_t max_bytes, long max_latency){
+	/*
+	   Sets the flush thresholds: number of documents, size
+	   of the request body in bytes, and how long (in ms) a
+	   document may wait in the buffer. 0 disables a threshold.
+	 */
+	pb->max_docs = max_docs;
+	pb->max_bytes = max_bytes;
+	pb->max_latency = max_latency;
+	return pb;
+}
+PouchBulk *pb_add(PouchBulk *pb, char *doc){
+	/*
+	   Adds a JSON document to the current batch, and
+	   flushes the batch if it has reached a threshold.
+	   The document is copied; include _id (and _rev
+	   for updates) in it as with doc_create_id().
+	   Returns NULL, and leaves the batch as it was,
+	   if the batch can't grow to take doc.
+	 */
+	size_t length = strlen(doc);
+	if (pb->count == 0){
+		pb->len = 0;
+	}
+	// room for the closing PB_TAIL too, so pb_flush() can't fail
+	if (pb_grow(pb, pb->len + (pb->count ? 1 : strlen(PB_HEAD))
+				+ length + strlen(PB_TAIL) + 1)){
+		return NULL;
+	}
+	if (pb->count == 0){
+		pb_append(pb, PB_HEAD, strlen(PB_HEAD));
+		gettimeofday(&pb->first, NULL);
+		if (pb->arm && pb->max_latency > 0){
+			pb->arm(pb, 1);
+		}
+	} else {
+		pb_append(pb, ",", 1);
+	}
+	pb_append(pb, doc, length);
+	pb->count++;
+	if ((pb->max_docs && pb->count >= pb->max_docs)
+			|| (pb->max_bytes && pb->len + strlen(PB_TAIL) >= pb->max_bytes)
+			|| (pb->max_latency && pb_age(pb) >= pb->max_latency)){
+		pb_flush(pb);
+	}
+	return pb;
+}
+PouchBulk *pb_poll(PouchBulk *pb){
+	/*
+	   Flushes the current batch if its oldest document
+	   has waited longer than max_latency. Synchronous users
+	   should call this periodically when documents arrive
+	   slowly; with pb_use_pmi() a timer does it instead.
+	 */
+	if (pb->count && pb->max_latency && pb_age(pb) >= pb->max_latency){
+		pb_flush(pb);
+	}
+	return pb;
+}
+PouchBulk *pb_flush(PouchBulk *pb){
+	/*
+	   Sends the current batch, if there is one, as a single
+	   POST to /db/_bulk_docs. Synchronously, pb->cb has been
+	   called for every document by the time this returns.
+	 */
+	size_t count = pb->count;
+	if (!count){
+		return pb;
+	}
+	if (pb->arm){
+		pb->arm(pb, 0);
+	}
+	pb_append(pb, PB_TAIL, strlen(PB_TAIL));	// pb_add() left room for it
+	pb->count = 0;
+	if (pb->submit){
+		// the new request takes the batch buffer with it
+		PouchReq *pr = pr_init();
+		if (pb->pr->usrpwd){
+			pr_add_usrpwd(pr, pb->pr->usrpwd, strlen(pb->pr->usrpwd) + 1);
+		}
+		pr_set_share(pr, pb->pr->share);
+		pr_set_gzip(pr, pb->pr->gzip_min, pb->pr->gzip_level);
+		pr_set_method(pr, POST);
+		pr_set_url(pr, pb->url);
+		pr_set_prdata(pr, pb->docs, pb->len);
+		pb->docs = NULL;
+		pb->len = pb->cap = 0;
+		pb->inflight++;
+		pb->submit(pb, pr, count);
+		return pb;
+	}
+	pr_set_method(pb->pr, POST);
+	pr_set_url(pb->pr, pb->url);
+	pr_borrow_data(pb->pr, pb->docs, pb->len); // the buffer is reused for the next batch
+	pr_do(pb->pr);
+	pb->len = 0;
+	pb_report(pb, pb->pr, count);
+	return pb;
+}
+void pb_report(PouchBulk *pb, PouchReq *pr, size_t count){
+	/*
+	   Parses the response to a _bulk_docs request holding
+	   count documents and calls pb->cb once for each of them.
+	 */
+	size_t i = 0;
+	const char *row, *end;
+	char *error = NULL, *reason = NULL;
+	if (!pb->cb){
+		return;
+	}
+	end = pr->resp.data + pr->resp.size;
+	if (pr->curlcode == CURLE_OK && pr->resp.data){
+		// one object per document, in the order they were sent
+		for (row = pj_array_first(pr->resp.data, end); row && i < count;
+				row = pj_array_next(row, end), i++){
+			char *id = pj_dup_string(pj_find_member(row, end, "id"), end);
+			char *rev = pj_dup_string(pj_find_member(row, end, "rev"), end);
+			error = pj_dup_string(pj_find_member(row, end, "error"), end);
+			reason = pj_dup_string(pj_find_member(row, end, "reason"), end);
+			pb->cb(pb, i, id, rev, error, reason);
+			free(id);
+			free(rev);
+			free(error);
+			free(reason);
+		}
+		error = reason = NULL;
+		if (i == count){
+			return;
+		}
+		if (i == 0){	// not an array: CouchDB's {"error":...,"reason":...}
+			error = pj_dup_string(pj_find_member(pr->resp.data, end, "error"), end);
+			reason = pj_dup_string(pj_find_member(pr->resp.data, end, "reason"), end);
+		}
+	} else if (pr->curlcode != CURLE_OK){
+		reason = strdup(curl_easy_strerror(pr->curlcode));
+	}
+	if (!error){
+		error = strdup("request_failed");
+	}
+	for (; i < count; i++){	// report whatever is left as failed
+		pb->cb(pb, i, NULL, NULL, error, reason);
+	}
+	free(error);
+	free(reason);
+}
+void pb_free(PouchBulk *pb){
+	/*
+	   Flushes any buffered documents and frees the bulk
+	   writer. If flushes are still in flight on the multi
+	   interface, the writer is freed when the last one finishes,
+	   so keep the event loop running until then.
+	 */
+	pb_flush(pb);
+	if (pb->inflight){
+		pb->closing = 1;
+		return;
+	}
+	if (pb->release){
+		pb->release(pb);
+	}
+	pr_free(pb->pr);
+	free(pb->url);
+	free(pb->docs);
+	free(pb);
+}
+
+// PouchDb functions
+static void get_many_body(PouchReq *pr, char **ids, char **revs, size_t n);
+PouchDb *pdb_init(char *server, char *db, char *usrpwd){
+	/*
+	   Sets up a handle for the database db on server,
+	   optionally authenticating as usrpwd ("user:password",
+	   or NULL). The escaped base URL is built once here;
+	   the pdb_* wrappers only append to it.
+	 */
+	PouchDb *pdb = (PouchDb *)calloc(1, sizeof(PouchDb));
+	if (!pdb){
+		return NULL;
+	}
+	pdb->refs = 1;	// dropped by pdb_free()
+	PouchReq tmp = {0};	// pr_set_path() only touches tmp.url
+	pr_set_path(&tmp, server, db, NULL);
+	pdb->url = tmp.url;
+	pdb->url_len = pdb->url ? strlen(pdb->url) : 0;
+	if (usrpwd){
+		pdb->usrpwd = strdup(usrpwd);
+	}
+	if (!pdb->url || (usrpwd && !pdb->usrpwd)){
+		pdb_free(pdb);
+		return NULL;
+	}
+	return pdb;
+}
+PouchDb *pdb_set_share(PouchDb *pdb, PouchShare *ps){
+	/*
+	   Attaches every request made through pdb to ps.
+	 */
+	pdb->share = ps;
+	return pdb;
+}
+PouchDb *pdb_set_timeout(PouchDb *pdb, long seconds){
+	/*
+	   Sets the timeout of every request made through
+	   pdb, as pr_set_timeout() would.
+	 */
+	pdb->timeout = seconds;
+	pdb->has_timeout = 1;
+	return pdb;
+}
+PouchDb *pdb_set_gzip(PouchDb *pdb, size_t min_bytes, int level){
+	/*
+	   Compresses the request bodies sent through
+	   pdb, as pr_set_gzip() would.
+	 */
+	pdb->gzip_min = min_bytes;
+	pdb->gzip_level = level;
+	return pdb;
+}
+PouchDb *pdb_set_doccache(PouchDb *pdb, size_t budget){
+	/*
+	   Keeps the body of documents read with pdb_doc_get(),
+	   using up to budget bytes. Reading a cached document
+	   again sends If-None-Match with its revision, and a
+	   304 Not Modified answer is served from the cache
+	   (as a 200, with the body in pr->resp). The counters
+	   in pdb->docs tell how often that happened. 0 turns
+	   it off.
+	 */
+	if (pdb->docs){
+		pcache_free(pdb->docs);
+		pdb->docs = NULL;
+	}
+	if (budget){
+		pdb->docs = pcache_init(budget);
+	}
+	return pdb;
+}
+PouchDb *pdb_set_revcache(PouchDb *pdb, size_t budget){
+	/*
+	   Remembers the revision of every document seen in
+	   responses to requests made through pdb (writes,
+	   document GETs and _all_docs rows), using up to
+	   budget bytes. pdb_doc_update() and pdb_doc_remove()
+	   then rarely need a HEAD request. 0 turns it off.
+	 */
+	if (pdb->revs){
+		pcache_free(pdb->revs);
+		pdb->revs = NULL;
+	}
+	if (budget){
+		pdb->revs = pcache_init(budget);
+	}
+	return pdb;
+}
+static void pdb_remember(PouchDb *pdb, const char *obj, const char *end,
+		const char *idkey, const char *revkey, int forget){
+	// stores (or forgets) the revision found in one JSON object
+	char *id = pj_dup_string(pj_find_member(obj, end, idkey), end);
+	char *rev = pj_dup_string(pj_find_member(obj, end, revkey), end);
+	if (id && forget){
+		pcache_del(pdb->revs, id);
+	} else if (id && rev){
+		pcache_put(pdb->revs, id, rev, strlen(rev));
+	}
+	free(id);
+	free(rev);
+}
+static void pdb_done_docs(PouchReq *pr, PouchDb *pdb){
+	// serves 304s from the document cache, and fills it
+	const char *key = pr->url + pdb->url_len;	// the escaped path below the database
+	const char *end, *p;
+	PouchCacheEntry *e;
+	char *rev;
+	if (pr->sink || strcmp(pr->method, GET) || strchr(key, '?')){
+		return;	// only plain document reads are cached
+	}
+	if (pr->httpresponse == 304){
+		if ((e = pcache_peek(pdb->docs, key))){
+			pdb->docs->not_modified++;
+			pr_clear_resp(pr);
+			resp_append(pr, e->val, e->len);
+			pr->httpresponse = 200;
+		}
+		return;
+	}
+	if (pr->httpresponse != 200 || !pr->resp.data){
+		if (pr->httpresponse == 404){
+			pcache_del(pdb->docs, key);
+		}
+		return;
+	}
+	end = pr->resp.data + pr->resp.size;
+	p = pj_skip_space(pr->resp.data, end);
+	if (p < end && *p == '{' && (rev = pj_dup_string(pj_find_member(p, end, "_rev"), end))){
+		pcache_put_tag(pdb->docs, key, rev, pr->resp.data, pr->resp.size);
+		free(rev);
+	}
+}
+static void pdb_learn(PouchReq *pr, PouchDb *pdb){
+	/*
+	   Picks the revisions out of the response of a
+	   request made through pdb, and keeps or serves
+	   cached documents.
+	 */
+	const char *p, *end, *v;
+	if (pr->curlcode || !pr->method){
+		return;
+	}
+	if (pdb->docs){
+		pdb_done_docs(pr, pdb);
+	}
+	if (!pdb->revs || pr->sink || !pr->resp.data
+			|| pr->httpresponse < 200 || pr->httpresponse >= 300
+			|| !strcmp(pr->method, HEAD)){
+		return;
+	}
+	end = pr->resp.data + pr->resp.size;
+	p = pj_skip_space(pr->resp.data, end);
+	if (p < end && *p == '['){	// _bulk_docs results
+		for (v = pj_array_first(p, end); v; v = pj_array_next(v, end)){
+			if (!pj_find_member(v, end, "error")){
+				pdb_remember(pdb, v, end, "id", "rev", 0);
+			}
+		}
+	}
+	if (p >= end || *p != '{'){
+		return;
+	}
+	if ((v = pj_find_member(p, end, "rows"))){	// _all_docs
+		for (v = pj_array_first(v, end); v; v = pj_array_next(v, end)){
+			const char *value = pj_find_member(v, end, "value");
+			char *id = pj_dup_string(pj_find_member(v, end, "id"), end);
+			if (id && value && !pj_is_true(pj_find_member(value, end, "deleted"), end)){
+				char *rev = pj_dup_string(pj_find_member(value, end, "rev"), end);
+				if (rev){
+					pcache_put(pdb->revs, id, rev, strlen(rev));
+				}
+				free(rev);
+			}
+			free(id);
+		}
+	} else if (pj_find_member(p, end, "_id")){	// a document
+		// older revisions asked for with ?rev= are not the latest
+		if (!strstr(pr->url, "?rev=") && !strstr(pr->url, "&rev=")){
+			pdb_remember(pdb, p, end, "_id", "_rev", 0);
+		}
+	} else if (pj_find_member(p, end, "ok")){	// a write
+		pdb_remember(pdb, p, end, "id", "rev", !strcmp(pr->method, DELETE));
+	}
+}
+static void pdb_unref(PouchDb *pdb){
+	if (--pdb->refs){
+		return;
+	}
+	if (pdb->revs){
+		pcache_free(pdb->revs);
+	}
+	if (pdb->docs){
+		pcache_free(pdb->docs);
+	}
+	if (pdb->url){
+		free(pdb->url);
+	}
+	if (pdb->usrpwd){
+		free(pdb->usrpwd);
+	}
+	free(pdb);
+}
+static int pdb_done(PouchReq *pr, void *data){
+	/*
+	   Runs when a request made through a PouchDb with a
+	   cache finishes. The hook only runs once: pr lets
+	   go of pdb here, which may have been pdb_free()'d
+	   while the request was in flight.
+	 */
+	PouchDb *pdb = (PouchDb *)data;
+	pr->done = NULL;
+	pdb_learn(pr, pdb);
+	pdb_unref(pdb);
+	return 0;
+}
+static void pdb_drop(PouchReq *pr){
+	// lets go of the PouchDb whose hook pr carries without running it
+	if (pr->done == pdb_done){
+		pr->done = NULL;
+		pdb_unref((PouchDb *)pr->done_data);
+	}
+}
+static char *etag_rev(const char *headers){
+	/*
+	   Returns a malloc()'d copy of the revision in the
+	   last ETag: line of the response headers, or NULL.
+	   Other headers may be quoted too, so only that line
+	   is looked at.
+	 */
+	const char *line, *etag = NULL, *begin, *stop, *eol;
+	for (line = headers; line && *line; line = strchr(line, '\n') ? strchr(line, '\n') + 1 : NULL){
+		if (!strncasecmp(line, "ETag:", 5)){
+			etag = line + 5;
+		}
+	}
+	if (!etag){
+		return NULL;
+	}
+	eol = etag + strcspn(etag, "\r\n");
+	if (!(begin = memchr(etag, '"', eol - etag))
+			|| !(stop = memchr(begin + 1, '"', eol - begin - 1))){
+		return NULL;
+	}
+	return strndup(begin + 1, stop - begin - 1);
+}
+static char *pdb_rev(PouchReq *pr, PouchDb *pdb, char *id, int fresh){
+	PouchCacheEntry *e;
+	char *rev;
+	if (pdb->revs && !fresh && (e = pcache_get(pdb->revs, id))){
+		return strdup(e->val);
+	}
+	pr_do(pdb_doc_get_info(pr, pdb, id));
+	if (pr->curlcode == CURLE_OK && pr->httpresponse == 404 && pdb->revs){
+		pcache_del(pdb->revs, id);	// gone; a failed request proves nothing
+	}
+	if (pr->httpresponse != 200 || !pr->resp.data){
+		return NULL;
+	}
+	if (!(rev = etag_rev(pr->resp.data))){
+		return NULL;
+	}
+	if (pdb->revs){
+		pcache_put(pdb->revs, id, rev, strlen(rev));
+	}
+	return rev;
+}
+char *pdb_doc_cur_rev(PouchReq *pr, PouchDb *pdb, char *id){
+	/*
+	   Returns a malloc()'d copy of the current revision
+	   of a document, or NULL if it doesn't exist. It
+	   comes from the revision cache when possible, and
+	   from a HEAD request made with pr otherwise.
+	 */
+	return pdb_rev(pr, pdb, id, 0);
+}
+static PouchReq *pdb_write(PouchReq *pr, PouchDb *pdb, char *id, char *data){
+	// PUTs data (or DELETEs, if NULL) at the current revision
+	int tries;
+	for (tries = 0; tries < 2; tries++){
+		char *rev = pdb_rev(pr, pdb, id, tries);	// a conflict means the cache was stale
+		if (data){
+			pdb_doc_create_id(pr, pdb, id, data);
+		} else if (rev){
+			pr_set_method(pr, DELETE);
+			pdb_set_path(pr, pdb, id, NULL);
+		} else {
+			return pr;	// nothing to delete; pr holds the 404
+		}
+		if (rev){
+			pr_add_param(pr, "rev", rev);
+			free(rev);
+		}
+		pr_do(pr);
+		if (pr->httpresponse != 409){
+			break;
+		}
+	}
+	return pr;
+}
+PouchReq *pdb_doc_update(PouchReq *pr, PouchDb *pdb, char *id, char *data){
+	/*
+	   Creates or replaces a document and performs the
+	   request. The current revision is passed as ?rev=,
+	   so data should not contain a _rev of its own. On
+	   a 409 conflict the revision is looked up again
+	   and the write retried once.
+	 */
+	return pdb_write(pr, pdb, id, data);
+}
+PouchReq *pdb_doc_remove(PouchReq *pr, PouchDb *pdb, char *id){
+	/*
+	   Deletes the current revision of a document and
+	   performs the request, retrying once on a 409
+	   conflict like pdb_doc_update().
+	 */
+	return pdb_write(pr, pdb, id, NULL);
+}
+void pdb_free(PouchDb *pdb){
+	/*
+	   Frees a handle. A request still in flight
+	   through a cached handle keeps it (and its
+	   caches) until the request finishes or is
+	   freed; don't make new requests with pdb.
+	 */
+	pdb_unref(pdb);
+}
+PouchReq *pdb_set_path(PouchReq *pr, PouchDb *pdb, ...){
+	/*
+	   Points pr at the database's URL followed by a
+	   NULL-terminated list of escaped path segments,
+	   and applies the handle's credentials and defaults.
+	 */
+	va_list ap;
+	va_start(ap, pdb);
+	set_path(pr, pdb->url, pdb->url_len, ap);
+	va_end(ap);
+	if (pdb->usrpwd && (!pr->usrpwd || strcmp(pr->usrpwd, pdb->usrpwd))){
+		pr_add_usrpwd(pr, pdb->usrpwd, strlen(pdb->usrpwd) + 1);
+	}
+	if (pdb->share){
+		pr->share = pdb->share;
+	}
+	if (pdb->has_timeout){
+		pr_set_timeout(pr, pdb->timeout);
+	}
+	if (pdb->gzip_min){
+		pr_set_gzip(pr, pdb->gzip_min, pdb->gzip_level);
+	}
+	if (pdb->revs || pdb->docs){	// learn from the response
+		pr->done = pdb_done;
+		pr->done_data = pdb;
+		pdb->refs++;	// until the hook runs
+	}
+	return pr;
+}
+PouchReq *pdb_db_get(PouchReq *pr, PouchDb *pdb){
+	/*
+	   db_get() through a PouchDb.
+	 */
+	pr_set_method(pr, GET);
+	return pdb_set_path(pr, pdb, NULL);
+}
+PouchReq *pdb_db_get_changes(PouchReq *pr, PouchDb *pdb){
+	/*
+	   db_get_changes() through a PouchDb.
+	 */
+	pr_set_method(pr, GET);
+	return pdb_set_path(pr, pdb, "_changes", NULL);
+}
+PouchReq *pdb_get_all_docs(PouchReq *pr, PouchDb *pdb){
+	/*
+	   get_all_docs() through a PouchDb.
+	 */
+	pr_set_method(pr, GET);
+	return pdb_set_path(pr, pdb, "_all_docs", NULL);
+}
+PouchReq *pdb_doc_get(PouchReq *pr, PouchDb *pdb, char *id){
+	/*
+	   doc_get() through a PouchDb. With a document
+	   cache, this is a conditional GET if the document
+	   has been read before.
+	 */
+	PouchCacheEntry *e;
+	pr_set_method(pr, GET);
+	pdb_set_path(pr, pdb, id, NULL);
+	if (pdb->docs && (e = pcache_get(pdb->docs, pr->url + pdb->url_len))){
+		char inm[strlen("If-None-Match: \"\"") + strlen(e->tag) + 1];
+		sprintf(inm, "If-None-Match: \"%s\"", e->tag);
+		pr_add_header(pr, inm);
+	}
+	return pr;
+}
+PouchReq *pdb_doc_get_rev(PouchReq *pr, PouchDb *pdb, char *id, char *rev){
+	/*
+	   doc_get_rev() through a PouchDb.
+	 */
+	pr_set_method(pr, GET);
+	pdb_set_path(pr, pdb, id, NULL);
+	return pr_add_param(pr, "rev", rev);
+}
+PouchReq *pdb_doc_get_info(PouchReq *pr, PouchDb *pdb, char *id){
+	/*
+	   doc_get_info() through a PouchDb.
+	 */
+	pr_set_method(pr, HEAD);
+	return pdb_set_path(pr, pdb, id, NULL);
+}
+PouchReq *pdb_doc_create_id(PouchReq *pr, PouchDb *pdb, char *id, char *data){
+	/*
+	   doc_create_id() through a PouchDb.
+	 */
+	pr_set_method(pr, PUT);
+	pr_set_data(pr, data);
+	return pdb_set_path(pr, pdb, id, NULL);
+}
+PouchReq *pdb_doc_create(PouchReq *pr, PouchDb *pdb, char *data){
+	/*
+	   doc_create() through a PouchDb.
+	 */
+	pr_set_method(pr, POST);
+	pr_set_data(pr, data);
+	return pdb_set_path(pr, pdb, NULL);
+}
+PouchReq *pdb_doc_delete(PouchReq *pr, PouchDb *pdb, char *id, char *rev){
+	/*
+	   doc_delete() through a PouchDb.
+	 */
+	pr_set_method(pr, DELETE);
+	pdb_set_path(pr, pdb, id, NULL);
+	return pr_add_param(pr, "rev", rev);
+}
+PouchReq *pdb_doc_get_attachment(PouchReq *pr, PouchDb *pdb, char *id, char *name){
+	/*
+	   doc_get_attachment() through a PouchDb.
+	 */
+	pr_set_method(pr, GET);
+	return pdb_set_path(pr, pdb, id, name, NULL);
+}
+PouchReq *pdb_doc_get_many(PouchReq *pr, PouchDb *pdb, char **ids, char **revs, size_t n){
+	/*
+	   doc_get_many() through a PouchDb.
+	 */
+	get_many_body(pr, ids, revs, n);
+	pdb_set_path(pr, pdb, revs ? "_bulk_get" : "_all_docs", NULL);
+	if (!revs){
+		pr_add_param(pr, "include_docs", "true");
+	}
+	return pr;
+}
+
 // Database Wrapper Functions
 PouchReq *get_all_dbs(PouchReq * p_req, char *server){
 	/*
@@ -348,8 +1646,7 @@ PouchReq *get_all_dbs(PouchReq * p_req, char *server){
 	   CouchDB server.
 	 */
 	pr_set_method(p_req, GET);
-	pr_set_url(p_req, server);
-	p_req->url = combine(&(p_req->url), p_req->url, "_all_dbs", "/");
+	pr_set_path(p_req, server, "_all_dbs", NULL);
 	return p_req;
 }
 PouchReq *db_delete(PouchReq * p_req, char *server, char *db){
@@ -358,8 +1655,7 @@ PouchReq *db_delete(PouchReq * p_req, char *server, char *db){
 	   server /server/
 	 */
 	pr_set_method(p_req, DELETE);
-	pr_set_url(p_req, server);
-	p_req->url = combine(&(p_req->url), p_req->url, db, "/");
+	pr_set_path(p_req, server, db, NULL);
 	return p_req;
 }
 PouchReq *db_create(PouchReq * p_req, char *server, char *db){
@@ -368,8 +1664,7 @@ PouchReq *db_create(PouchReq * p_req, char *server, char *db){
 	   server /server/
 	 */
 	pr_set_method(p_req, PUT);
-	pr_set_url(p_req, server);
-	p_req->url = combine(&(p_req->url), p_req->url, db, "/");
+	pr_set_path(p_req, server, db, NULL);
 	return p_req;
 }
 PouchReq *db_get(PouchReq * p_req, char *server, char *db){
@@ -378,8 +1673,7 @@ PouchReq *db_get(PouchReq * p_req, char *server, char *db){
 	   on the CouchDB server /server/
 	 */
 	pr_set_method(p_req, GET);
-	pr_set_url(p_req, server);
-	p_req->url = combine(&(p_req->url), p_req->url, db, "/");
+	pr_set_path(p_req, server, db, NULL);
 	return p_req;
 }
 PouchReq *db_get_changes(PouchReq * pr, char *server, char *db){
@@ -389,9 +1683,7 @@ PouchReq *db_get_changes(PouchReq * pr, char *server, char *db){
 	   pr_add_param();
 	 */
 	pr_set_method(pr, GET);
-	pr_set_url(pr, server);
-	pr->url = combine(&(pr->url), pr->url, db, "/");
-	pr->url = combine(&(pr->url), pr->url, "_changes", "/");
+	pr_set_path(pr, server, db, "_changes", NULL);
 	return pr;
 }
 PouchReq *db_get_revs_limit(PouchReq * pr, char *server, char *db){
@@ -400,9 +1692,7 @@ PouchReq *db_get_revs_limit(PouchReq * pr, char *server, char *db){
 	   allowed for a database.
 	 */
 	pr_set_method(pr, GET);
-	pr_set_url(pr, server);
-	pr->url = combine(&(pr->url), pr->url, db, "/");
-	pr->url = combine(&(pr->url), pr->url, "_revs_limit", "/");
+	pr_set_path(pr, server, db, "_revs_limit", NULL);
 	return pr;
 }
 PouchReq *db_set_revs_limit(PouchReq * pr, char *server, char *db,char *revs){
@@ -412,9 +1702,7 @@ PouchReq *db_set_revs_limit(PouchReq * pr, char *server, char *db,char *revs){
 	 */
 	pr_set_method(pr, PUT);
 	pr_set_data(pr, revs);
-	pr_set_url(pr, server);
-	pr->url = combine(&(pr->url), pr->url, db, "/");
-	pr->url = combine(&(pr->url), pr->url, "_revs_limit", "/");
+	pr_set_path(pr, server, db, "_revs_limit", NULL);
 	return pr;
 }
 PouchReq *db_compact(PouchReq * pr, char *server, char *db){
@@ -422,10 +1710,8 @@ PouchReq *db_compact(PouchReq * pr, char *server, char *db){
 	   Initiates compaction on a database.
 	 */
 	pr_set_method(pr, POST);
-	pr_set_url(pr, server);
 	pr_set_data(pr, "{}");
-	pr->url = combine(&(pr->url), pr->url, db, "/");
-	pr->url = combine(&(pr->url), pr->url, "_compact", "/");
+	pr_set_path(pr, server, db, "_compact", NULL);
 	return pr;
 }
 
@@ -434,13 +1720,8 @@ PouchReq *doc_get(PouchReq * pr, char *server, char *db, char *id){
 	/*
 	   Retrieves a document.
 	 */
-	/*
-TODO: URL escape database and document names (/'s become %2F's)
-	 */
 	pr_set_method(pr, GET);
-	pr_set_url(pr, server);
-	pr->url = combine(&(pr->url), pr->url, db, "/");
-	pr->url = combine(&(pr->url), pr->url, id, "/");
+	pr_set_path(pr, server, db, id, NULL);
 	return pr;
 }
 PouchReq *doc_get_rev(PouchReq * pr, char *server, char *db, char *id,char *rev){
@@ -448,9 +1729,7 @@ PouchReq *doc_get_rev(PouchReq * pr, char *server, char *db, char *id,char *rev)
 	   Get a specific revision of a document.
 	 */
 	pr_set_method(pr, GET);
-	pr_set_url(pr, server);
-	pr->url = combine(&(pr->url), pr->url, db, "/");
-	pr->url = combine(&(pr->url), pr->url, id, "/");
+	pr_set_path(pr, server, db, id, NULL);
 	pr_add_param(pr, "rev", rev);
 	return pr;
 }
@@ -462,9 +1741,7 @@ PouchReq *doc_get_revs(PouchReq * pr, char *server, char *db,char *id){
 	   of the available revision IDs.
 	 */
 	pr_set_method(pr, GET);
-	pr_set_url(pr, server);
-	pr->url = combine(&(pr->url), pr->url, db, "/");
-	pr->url = combine(&(pr->url), pr->url, id, "/");
+	pr_set_path(pr, server, db, id, NULL);
 	pr_add_param(pr, "revs", "true");
 	return pr;
 }
@@ -473,9 +1750,7 @@ PouchReq *doc_get_info(PouchReq * pr, char *server, char *db,char *id){
 	   A HEAD request returns basic information about the document, including its current revision.
 	 */
 	pr_set_method(pr, HEAD);
-	pr_set_url(pr, server);
-	pr->url = combine(&(pr->url), pr->url, db, "/");
-	pr->url = combine(&(pr->url), pr->url, id, "/");
+	pr_set_path(pr, server, db, id, NULL);
 	return pr;
 }
 PouchReq *doc_create_id(PouchReq * pr, char *server, char *db, char *id, char *data){
@@ -487,9 +1762,7 @@ PouchReq *doc_create_id(PouchReq * pr, char *server, char *db, char *id, char *d
 	   the document is updated.
 	 */
 	pr_set_method(pr, PUT);
-	pr_set_url(pr, server);
-	pr->url = combine(&(pr->url), pr->url, db, "/");
-	pr->url = combine(&(pr->url), pr->url, id, "/");
+	pr_set_path(pr, server, db, id, NULL);
 	pr_set_data(pr, data);
 	return pr;
 }
@@ -498,16 +1771,14 @@ PouchReq *doc_create(PouchReq * pr, char *server, char *db,char *data){
 	   Creates a new document with a server generated DocID.
 	 */
 	pr_set_method(pr, POST);
-	pr_set_url(pr, server);
-	pr->url = combine(&(pr->url), pr->url, db, "/");
+	pr_set_path(pr, server, db, NULL);
 	pr_set_data(pr, data);
 
 	return pr;
 }
 PouchReq *doc_prcreate(PouchReq *pr, char *server, char *db, char *data){
 	pr_set_method(pr, POST);
-	pr_set_url(pr, server);
-	pr->url = combine(&(pr->url), pr->url, db, "/");
+	pr_set_path(pr, server, db, NULL);
 	pr_set_prdata(pr, data, strlen(data));
 	return pr;
 }
@@ -516,9 +1787,7 @@ PouchReq *get_all_docs(PouchReq * pr, char *server, char *db){
 	   Returns all of the docs in a database.
 	 */
 	pr_set_method(pr, GET);
-	pr_set_url(pr, server);
-	pr->url = combine(&(pr->url), pr->url, db, "/");
-	pr->url = combine(&(pr->url), pr->url, "_all_docs", "/");
+	pr_set_path(pr, server, db, "_all_docs", NULL);
 	return pr;
 }
 PouchReq *get_all_docs_by_seq(PouchReq * pr, char *server, char *db){
@@ -527,20 +1796,168 @@ PouchReq *get_all_docs_by_seq(PouchReq * pr, char *server, char *db){
 	   order that they were modified.
 	 */
 	pr_set_method(pr, GET);
-	pr_set_url(pr, server);
-	pr->url = combine(&(pr->url), pr->url, db, "/");
-	pr->url = combine(&(pr->url), pr->url, "_all_docs_by_seq", "/");
+	pr_set_path(pr, server, db, "_all_docs_by_seq", NULL);
+	return pr;
+}
+static void get_many_body(PouchReq *pr, char **ids, char **revs, size_t n){
+	size_t i, length = 0;
+	for (i = 0; i < n; i++){
+		length += pj_quoted_len(ids[i]) + strlen("{\"id\":,\"rev\":},");
+		if (revs && revs[i]){
+			length += pj_quoted_len(revs[i]);
+		}
+	}
+	length += strlen("{\"docs\":[]}") + 1;
+	char *body = (char *)malloc(length);
+	char *out = body;
+	pr_set_method(pr, POST);
+	if (!body){	// sent without a body, the server rejects it
+		pr_clear_data(pr);
+		return;
+	}
+	out += sprintf(out, revs ? "{\"docs\":[" : "{\"keys\":[");
+	for (i = 0; i < n; i++){
+		if (i){
+			*out++ = ',';
+		}
+		if (!revs){
+			out = pj_write_quoted(out, ids[i]);
+			continue;
+		}
+		out += sprintf(out, "{\"id\":");
+		out = pj_write_quoted(out, ids[i]);
+		if (revs[i]){
+			out += sprintf(out, ",\"rev\":");
+			out = pj_write_quoted(out, revs[i]);
+		}
+		*out++ = '}';
+	}
+	out += sprintf(out, "]}");
+	pr_set_prdata(pr, body, out - body);
+}
+PouchReq *doc_get_many(PouchReq *pr, char *server, char *db, char **ids, char **revs, size_t n){
+	/*
+	   Fetches n documents with a single request. Without
+	   revisions (revs == NULL) this POSTs the ids as keys to
+	   _all_docs?include_docs=true, which every CouchDB supports.
+	   With revs (any entry may be NULL for the current revision)
+	   it uses _bulk_get, which needs CouchDB 2.0 or later.
+	   Use doc_parse_many() on the response. If the body
+	   can't be allocated the POST goes without one, and
+	   every document comes back failed.
+	 */
+	get_many_body(pr, ids, revs, n);
+	pr_set_path(pr, server, db, revs ? "_bulk_get" : "_all_docs", NULL);
+	if (!revs){
+		pr_add_param(pr, "include_docs", "true");
+	}
 	return pr;
 }
+static void doc_parse_row(PouchDoc *d, const char *row, const char *end){
+	/*
+	   Fills d from one row of an _all_docs?include_docs=true
+	   response: {"id","key","value":{"rev","deleted"},"doc"}
+	   or {"key","error"}.
+	 */
+	const char *value = pj_find_member(row, end, "value");
+	d->id = pj_dup_string(pj_find_member(row, end, "key"), end);
+	if ((d->error = pj_dup_string(pj_find_member(row, end, "error"), end))){
+		return;
+	}
+	d->rev = pj_dup_string(pj_find_member(value, end, "rev"), end);
+	if (pj_is_true(pj_find_member(value, end, "deleted"), end)){
+		d->deleted = 1;
+		d->error = strdup("deleted");
+		return;
+	}
+	d->doc = pj_dup_value(pj_find_member(row, end, "doc"), end);
+	if (d->doc && !strcmp(d->doc, "null")){
+		free(d->doc);
+		d->doc = NULL;
+	}
+}
+static void doc_parse_result(PouchDoc *d, const char *result, const char *end){
+	/*
+	   Fills d from one entry of a _bulk_get response:
+	   {"id","docs":[{"ok":{...}} or {"error":{"id","rev","error"}}]}
+	 */
+	const char *first = pj_array_first(pj_find_member(result, end, "docs"), end);
+	const char *ok = pj_find_member(first, end, "ok");
+	const char *error = pj_find_member(first, end, "error");
+	d->id = pj_dup_string(pj_find_member(result, end, "id"), end);
+	if (ok){
+		d->rev = pj_dup_string(pj_find_member(ok, end, "_rev"), end);
+		if (pj_is_true(pj_find_member(ok, end, "_deleted"), end)){
+			d->deleted = 1;	// as from _all_docs: no doc, only the tombstone's rev
+			d->error = strdup("deleted");
+		} else {
+			d->doc = pj_dup_value(ok, end);
+		}
+	} else if (error){
+		d->rev = pj_dup_string(pj_find_member(error, end, "rev"), end);
+		d->error = pj_dup_string(pj_find_member(error, end, "error"), end);
+	}
+	if (!d->doc && !d->error){
+		d->error = strdup("bad_response");
+	}
+}
+PouchDoc *doc_parse_many(PouchReq *pr, size_t n){
+	/*
+	   Parses the response to doc_get_many() into an array
+	   of n PouchDocs, in the same order as the ids that
+	   were requested. Documents that could not be fetched
+	   have doc == NULL and error set; if the request failed
+	   as a whole, every entry says why. Free the array with
+	   doc_free_many(). Returns NULL if the array can't be
+	   allocated.
+	 */
+	size_t i = 0;
+	PouchDoc *docs = (PouchDoc *)calloc(n ? n : 1, sizeof(PouchDoc));
+	const char *end = pr->resp.data + pr->resp.size;
+	const char *p;
+	if (!docs){
+		return NULL;
+	}
+	if (pr->curlcode == CURLE_OK && pr->httpresponse == 200 && pr->resp.data){
+		if ((p = pj_find_member(pr->resp.data, end, "rows"))){
+			for (p = pj_array_first(p, end); p && i < n; p = pj_array_next(p, end), i++){
+				doc_parse_row(&docs[i], p, end);
+			}
+		} else if ((p = pj_find_member(pr->resp.data, end, "results"))){
+			for (p = pj_array_first(p, end); p && i < n; p = pj_array_next(p, end), i++){
+				doc_parse_result(&docs[i], p, end);
+			}
+		}
+	}
+	for (; i < n; i++){	// anything without a row failed with the request
+		docs[i].error = strdup("request_failed");
+	}
+	return docs;
+}
+void doc_free_many(PouchDoc *docs, size_t n){
+	/*
+	   Frees an array returned by doc_parse_many().
+	 */
+	size_t i;
+	if (!docs){
+		return;
+	}
+	for (i = 0; i < n; i++){
+		free(docs[i].id);
+		free(docs[i].rev);
+		free(docs[i].doc);
+		free(docs[i].error);
+	}
+	free(docs);
+}
 PouchReq *doc_get_attachment(PouchReq * pr, char *server, char *db,char *id, char *name){
 	/*
-	   Gets an attachment on a document.
+	   Gets an attachment on a document. For large
+	   attachments, use pr_set_fdsink() or pr_set_sink()
+	   first so the body is not held in memory.
 	 */
 	pr_set_method(pr, GET);
-	pr_set_url(pr, server);
-	pr->url = combine(&(pr->url), pr->url, db, "/");
-	pr->url = combine(&(pr->url), pr->url, id, "/");
-	pr->url = combine(&(pr->url), pr->url, name, "/");
+	pr_set_path(pr, server, db, id, name, NULL);
 	return pr;
 }
 PouchReq *doc_copy(PouchReq * pr, char *server, char *db, char *id,char *newid, char *revision){
@@ -549,9 +1966,7 @@ PouchReq *doc_copy(PouchReq * pr, char *server, char *db, char *id,char *newid,
 	   all server side.
 	 */
 	pr_set_method(pr, COPY);
-	pr_set_url(pr, server);
-	pr->url = combine(&(pr->url), pr->url, db, "/");
-	pr->url = combine(&(pr->url), pr->url, id, "/");
+	pr_set_path(pr, server, db, id, NULL);
 	// TODO: add support for document overwrite on copy
 	char *headerstr = NULL;
 	headerstr = combine(&headerstr, "Destination: ", newid, NULL);
@@ -569,9 +1984,7 @@ PouchReq *doc_delete(PouchReq * pr, char *server, char *db, char *id,char *rev){
 	   want to delete.
 	 */
 	pr_set_method(pr, DELETE);
-	pr_set_url(pr, server);
-	pr->url = combine(&(pr->url), pr->url, db, "/");
-	pr->url = combine(&(pr->url), pr->url, id, "/");
+	pr_set_path(pr, server, db, id, NULL);
 	pr_add_param(pr, "rev", rev);
 	return pr;
 }
@@ -579,28 +1992,25 @@ PouchReq *doc_add_attachment(PouchReq * pr, char *server, char *db,char *doc, ch
 	/*
 	   Given a filename, try to read that file and upload it as an attachment to a document.
 	 */
-	// load the file into memory
+	// open the file; it is streamed from disk while the request is sent
 	struct stat file_info;
 	int fd = open(filename, O_RDONLY);
-	if (!fd){
+	if (fd < 0){
 		fprintf(stderr,
 				"doc_upload_attachment: could not open file %s\n",
 				filename);
+		return pr;
 	}
-	if (lstat(filename, &file_info) != 0){
+	if (fstat(fd, &file_info) != 0){
 		fprintf(stderr,
-				"doc_upload_attachment: could not lstat file %s\n",
+				"doc_upload_attachment: could not stat file %s\n",
 				filename);
+		close(fd);
 		return pr;
 		// TODO: include an "error" integer in each PouchReq, to be set
 		//               by different wrapper functions
 	}
-	// read file into buffer
-	size_t fd_len = file_info.st_size;
-	char fd_buf[fd_len];
-	int numbytes = read(fd, fd_buf, fd_len);
-	pr_set_bdata(pr, (void *)fd_buf, fd_len);
-	close(fd);
+	pr_set_fdata(pr, fd, file_info.st_size);
 	// just in case the actual mime-type is weird or broken, add a default
 	// mime-type of application/octet-stream, which is used for binary files.
 	// this way, even if something goes horribly wrong, we'll be able to download
@@ -667,10 +2077,7 @@ PouchReq *doc_add_attachment(PouchReq * pr, char *server, char *db,char *doc, ch
 	}
 	// finish setting request
 	pr_set_method(pr, PUT);
-	pr_set_url(pr, server);
-	pr->url = combine(&(pr->url), pr->url, db, "/");
-	pr->url = combine(&(pr->url), pr->url, doc, "/");
-	pr->url = combine(&(pr->url), pr->url, filename, "/");
+	pr_set_path(pr, server, db, doc, filename, NULL);
 	// TODO: add support for adding to existing documents by auto-fetching the rev parameter
 	//pr_add_param(pr, "rev", rev);
 	return pr;
@@ -685,34 +2092,234 @@ size_t recv_data_callback(char *ptr, size_t size, size_t nmemb, void *data){
 	 */
 	size_t ptrsize = nmemb*size; // this is the size of the data pointed to by ptr
 	PouchReq *pr = (PouchReq *)data;
-	pr->resp.data = (char *)realloc(pr->resp.data, pr->resp.size + ptrsize +1);
-	if (pr->resp.data){	// realloc was successful
-		memcpy(&(pr->resp.data[pr->resp.size]), ptr, ptrsize); // append new data
-		pr->resp.size += ptrsize;
-		pr->resp.data[pr->resp.size] = '\0'; // null terminate the new data
+	if (pr->sink){	// stream it instead of storing it
+		return pr->sink(pr, ptr, ptrsize, pr->sink_data);
 	}
-	else { // realloc was NOT successful
-		fprintf(stderr, "recv_data_callback: realloc failed\n");
+	if (!resp_append(pr, ptr, ptrsize)){
+		return 0; // abort the transfer rather than silently losing data
 	}
 	return ptrsize; // theoretically, this is the amount of processed data
 }
+static int resp_append(PouchReq *pr, char *ptr, size_t len){
+	if (pkt_reserve(&pr->resp, pr->resp.size + len + 1)){	// realloc was successful
+		memcpy(&(pr->resp.data[pr->resp.size]), ptr, len); // append new data
+		pr->resp.size += len;
+		pr->resp.data[pr->resp.size] = '\0'; // null terminate the new data
+		return 1;
+	}
+	fprintf(stderr, "recv_data_callback: realloc failed\n");
+	return 0;
+}
+size_t recv_header_callback(char *ptr, size_t size, size_t nmemb, void *data){
+	/*
+	   Called by CURL for every response header line. When
+	   the server announces a Content-Length, the response
+	   buffer is sized for the whole body up front.
+	 */
+	size_t ptrsize = nmemb*size;
+	PouchReq *pr = (PouchReq *)data;
+	static const char cl[] = "Content-Length:";
+	static const char ra[] = "Retry-After:";
+	if (ptrsize > strlen(ra) && !strncasecmp(ptr, ra, strlen(ra))){
+		// only the delay-seconds form; an HTTP-date gives 0
+		pr->retry_after = atol(ptr + strlen(ra))*1000;
+	}
+	if (ptrsize > strlen(cl) && !strncasecmp(ptr, cl, strlen(cl))
+			&& !pr->sink && pr->method && strcmp(pr->method, HEAD)){
+		char num[32];
+		size_t n = ptrsize - strlen(cl) < sizeof(num) - 1 ? ptrsize - strlen(cl) : sizeof(num) - 1;
+		memcpy(num, ptr + strlen(cl), n);
+		num[n] = '\0';
+		unsigned long long length = strtoull(num, NULL, 10);
+		if (length > 0 && length < (1ULL << 31)){ // don't trust absurd values
+			pkt_reserve(&pr->resp, pr->resp.size + (size_t)length + 1);
+		}
+	}
+	return ptrsize;
+}
 size_t send_data_callback(void *ptr, size_t size, size_t nmemb, void *data){
 	/*
-	   This callback is used to send data for a CURL request. The JSON
-	   string stored in the PouchReq pointed to by data is read out
-	   and sent, piece by piece.
+	   This callback is used to send data for a CURL request. The
+	   data (or the segments) stored in the PouchReq pointed to by
+	   data is read out and sent, piece by piece.
 	 */
 	size_t maxcopysize = nmemb*size;
+	size_t copied = 0;
 	if (maxcopysize < 1){
 		return 0;
 	}
 	PouchReq *pr = (PouchReq *)data;
-	if (pr->req.size > 0){ // only send data if there's data to send
-		size_t tocopy = (pr->req.size > maxcopysize) ? maxcopysize : pr->req.size;
-		memcpy(ptr, pr->req.offset, tocopy);
-		pr->req.offset += tocopy;	// advance our offset by the number of bytes already sent
-		pr->req.size -= tocopy;	//next time there are tocopy fewer bytes to copy
+	PouchPkt *pkt = &pr->req;
+	if (pkt->fd >= 0){	// stream from the file
+		ssize_t numbytes;
+		if ((off_t)pkt->size - pkt->pos < (off_t)maxcopysize){
+			maxcopysize = pkt->size - pkt->pos;
+		}
+		if (maxcopysize == 0){
+			return 0;
+		}
+		if ((numbytes = pread(pkt->fd, ptr, maxcopysize, pkt->pos)) <= 0){
+			fprintf(stderr, "send_data_callback: could not read file\n");
+			return CURL_READFUNC_ABORT;
+		}
+		pkt->pos += numbytes;
+		return numbytes;
+	}
+	if (pkt->segs){
+		while (copied < maxcopysize && pkt->seg < pkt->nsegs){
+			const struct iovec *v = &pkt->segs[pkt->seg];
+			size_t tocopy = v->iov_len - pkt->segoff;
+			if (tocopy > maxcopysize - copied){
+				tocopy = maxcopysize - copied;
+			}
+			memcpy((char *)ptr + copied, (char *)v->iov_base + pkt->segoff, tocopy);
+			copied += tocopy;
+			pkt->segoff += tocopy;
+			if (pkt->segoff == v->iov_len){	// on to the next segment
+				pkt->seg++;
+				pkt->segoff = 0;
+			}
+		}
+		return copied;
+	}
+	if (pkt->data && pkt->offset < pkt->data + pkt->size){ // only send data if there's data to send
+		size_t left = pkt->data + pkt->size - pkt->offset;
+		size_t tocopy = (left > maxcopysize) ? maxcopysize : left;
+		memcpy(ptr, pkt->offset, tocopy);
+		pkt->offset += tocopy;	// advance our offset by the number of bytes already sent
 		return tocopy;
 	}
 	return 0;
 }
+int send_seek_callback(void *data, curl_off_t offset, int origin){
+	/*
+	   Lets CURL rewind the data being sent, e.g. to
+	   resend it after a redirect or an auth challenge.
+	 */
+	PouchReq *pr = (PouchReq *)data;
+	PouchPkt *pkt = &pr->req;
+	size_t left;
+	if (origin != SEEK_SET || offset < 0 || (size_t)offset > pkt->size){
+		return CURL_SEEKFUNC_CANTSEEK;
+	}
+	if (pkt->fd >= 0){
+		pkt->pos = offset;
+		return CURL_SEEKFUNC_OK;
+	}
+	if (!pkt->segs){
+		pkt->offset = pkt->data + offset;
+		return CURL_SEEKFUNC_OK;
+	}
+	left = (size_t)offset;
+	for (pkt->seg = 0; pkt->seg < pkt->nsegs && left >= pkt->segs[pkt->seg].iov_len; pkt->seg++){
+		left -= pkt->segs[pkt->seg].iov_len;
+	}
+	pkt->segoff = left;
+	return CURL_SEEKFUNC_OK;
+}
+static void pkt_gzip(PouchReq *pr){
+	/*
+	   Replaces the data (or the segments) of pr->req
+	   with its gzip encoding, if that is smaller, and
+	   adds the Content-Encoding header. Done once per
+	   body, so retries resend the compressed copy.
+	 */
+	PouchPkt *pkt = &pr->req;
+	z_stream zs;
+	size_t i, cap;
+	char *out;
+	int ret = Z_OK;
+	pkt->packed = 1;
+	if (pkt->size > UINT_MAX/2){	// too large for a single z_stream call
+		return;
+	}
+	memset(&zs, 0, sizeof(zs));
+	if (deflateInit2(&zs, pr->gzip_level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK){	// +16: gzip header
+		return;
+	}
+	cap = deflateBound(&zs, pkt->size);
+	if (!(out = malloc(cap))){
+		deflateEnd(&zs);
+		return;
+	}
+	zs.next_out = (Bytef *)out;
+	zs.avail_out = cap;
+	if (pkt->segs){
+		for (i = 0; i < pkt->nsegs && ret == Z_OK; i++){
+			zs.next_in = (Bytef *)pkt->segs[i].iov_base;
+			zs.avail_in = pkt->segs[i].iov_len;
+			ret = deflate(&zs, Z_NO_FLUSH);
+		}
+	} else {
+		zs.next_in = (Bytef *)pkt->data;
+		zs.avail_in = pkt->size;
+	}
+	if (ret == Z_OK){
+		ret = deflate(&zs, Z_FINISH);
+	}
+	deflateEnd(&zs);
+	if (ret != Z_STREAM_END || zs.total_out >= pkt->size){
+		free(out);
+		return;
+	}
+	pkt_release(pkt);
+	pkt->data = pkt->offset = out;
+	pkt->size = zs.total_out;
+	pkt->cap = cap;
+	pkt->packed = 1;
+	pr_add_header(pr, "Content-Encoding: gzip");
+}
+void pr_read_times(PouchReq *pr){
+	/*
+	   Copies the timings of the transfer that just
+	   finished into pr->times.
+	 */
+	PouchTimes *t = &pr->times;
+	curl_easy_getinfo(pr->easy, CURLINFO_NAMELOOKUP_TIME_T, &t->namelookup);
+	curl_easy_getinfo(pr->easy, CURLINFO_CONNECT_TIME_T, &t->connect);
+	curl_easy_getinfo(pr->easy, CURLINFO_APPCONNECT_TIME_T, &t->appconnect);
+	curl_easy_getinfo(pr->easy, CURLINFO_PRETRANSFER_TIME_T, &t->pretransfer);
+	curl_easy_getinfo(pr->easy, CURLINFO_STARTTRANSFER_TIME_T, &t->starttransfer);
+	curl_easy_getinfo(pr->easy, CURLINFO_TOTAL_TIME_T, &t->total);
+}
+void pr_setopt_body(PouchReq *pr, CURL *curl){
+	/*
+	   Sets up the upload of pr->req for PUT and POST
+	   requests. The size is always known, so it is sent as
+	   Content-Length. A contiguous POST body is handed to CURL
+	   directly (CURLOPT_POSTFIELDS) and never passes through
+	   send_data_callback(); everything else is read from it.
+	 */
+	PouchPkt *pkt = &pr->req;
+	int put = !strncmp(pr->method, PUT, 3);
+	int post = !strncmp(pr->method, POST, 4);
+	if ((put || post) && pr->gzip_min && pkt->size >= pr->gzip_min
+			&& pkt->fd < 0 && !pkt->packed){
+		pkt_gzip(pr);
+	}
+	pkt->offset = pkt->data;	// (re)start from the beginning
+	pkt->seg = pkt->segoff = 0;
+	pkt->pos = 0;
+	if (!put && !post){
+		return;
+	}
+	if (post && !pkt->segs && pkt->fd < 0){
+		curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)pkt->size);
+		curl_easy_setopt(curl, CURLOPT_POSTFIELDS, pkt->data ? pkt->data : "");
+		return;
+	}
+	curl_easy_setopt(curl, CURLOPT_READFUNCTION, send_data_callback);
+	curl_easy_setopt(curl, CURLOPT_READDATA, (void *)pr);
+	curl_easy_setopt(curl, CURLOPT_SEEKFUNCTION, send_seek_callback);
+	curl_easy_setopt(curl, CURLOPT_SEEKDATA, (void *)pr);
+	if (pkt->fd >= 0){	// fewer, larger reads for files
+		curl_easy_setopt(curl, CURLOPT_UPLOAD_BUFFERSIZE, 512*1024L);
+	}
+	if (put){	// Note: Content-Type: application/json is automatically assumed
+		curl_easy_setopt(curl, CURLOPT_UPLOAD, 1L);
+		curl_easy_setopt(curl, CURLOPT_INFILESIZE_LARGE, (curl_off_t)pkt->size);
+	} else {
+		curl_easy_setopt(curl, CURLOPT_POST, 1L);
+		curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)pkt->size);
+	}
+}
@@ -8,10 +8,17 @@
 #include <stdio.h>
 #include <fcntl.h>
 #include <time.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/uio.h>
 
 // Libcurl
 #include <curl/curl.h>
 
+// Pouch helpers
+#include "pouch_json.h"
+#include "pouch_cache.h"
+
 // Defines
 #define USE_SYS_FILE 0
 #define GET "GET"
@@ -21,10 +28,45 @@
 #define COPY "COPY"
 #define DELETE "DELETE"
 
+// What a PouchShare shares between requests
+#define POUCH_SHARE_DNS 1		// resolved host names
+#define POUCH_SHARE_SSL 2		// TLS session ids/tickets
+#define POUCH_SHARE_CONNECT 4	// pool of open connections (one thread only!)
+#define POUCH_SHARE_ALL (POUCH_SHARE_DNS|POUCH_SHARE_SSL|POUCH_SHARE_CONNECT)
+
 // Structs
 
 typedef struct _PouchPkt PouchPkt;
+typedef struct _PouchTimes PouchTimes;
 typedef struct _PouchReq PouchReq;
+typedef struct _PouchShare PouchShare;
+typedef struct _PouchBulk PouchBulk;
+typedef struct _PouchDoc PouchDoc;
+typedef struct _PouchDb PouchDb;
+/*
+	Called when a request has finished, before it is handed
+	back to the user (before pr_do() returns, or before the
+	PouchMInfo callback runs). Used by pouch internally for
+	requests it owns; returning non-zero from the multi interface
+	means the hook took care of the PouchReq (e.g. freed it).
+*/
+typedef int (*pr_done_cb)(PouchReq *, void *);
+/*
+	Receives the body of a response piece by piece, as it
+	arrives, instead of it being stored in resp.data. Must
+	return len to continue the transfer (anything else aborts
+	it). Called once more with ptr == NULL and len == 0 when
+	the transfer has finished.
+*/
+typedef size_t (*pr_sink_cb)(PouchReq *, char *ptr, size_t len, void *);
+/*
+	Called once per document written by a PouchBulk flush,
+	with the position of the document in its batch. On success
+	rev is set and error is NULL; otherwise error and reason
+	describe what went wrong. If the whole request failed,
+	id and rev are NULL for every document in the batch.
+*/
+typedef void (*pb_result_cb)(PouchBulk *, size_t, char *id, char *rev, char *error, char *reason);
 struct _PouchPkt {
 	/*
 	   Holds data to be sent to
@@ -34,6 +76,42 @@ struct _PouchPkt {
 	char *data;
 	char *offset;
 	size_t size;
+	size_t cap;		// bytes allocated for data
+	int borrowed;	// data (or segs) belongs to the caller: never copied or freed
+	const struct iovec *segs;	// the data to send is these segments, in order, if set
+	size_t nsegs;
+	size_t seg;		// segment being sent
+	size_t segoff;	// ... and how much of it has been sent
+	int fd;			// the data to send is read from this file, if >= 0
+	off_t pos;		// ... at this position
+	int packed;		// pr_setopt_body() has already tried to gzip the data
+};
+struct _PouchTimes {
+	/*
+	   When each phase of the last try of a request
+	   ended, in microseconds since it started, as
+	   reported by libcurl (CURLINFO_*_TIME_T). Phases
+	   that didn't happen, e.g. the TLS handshake on
+	   plain http or a reused connection, are 0.
+	 */
+	curl_off_t namelookup;		// name resolved
+	curl_off_t connect;			// TCP connection established
+	curl_off_t appconnect;		// TLS handshake done
+	curl_off_t pretransfer;		// request about to be sent
+	curl_off_t starttransfer;	// first byte of the response received
+	curl_off_t total;			// response complete
+};
+struct _PouchShare {
+	/*
+	   A libcurl share object, plus the locks
+	   libcurl needs to use it from several threads.
+	   Any number of PouchReqs (synchronous or multi,
+	   on any PouchMInfo and any thread) can be attached
+	   to the same PouchShare with pr_set_share().
+	 */
+	CURLSH *share;
+	int flags;		// POUCH_SHARE_* bits
+	pthread_mutex_t locks[CURL_LOCK_DATA_LAST]; // one lock per kind of shared data
 };
 struct _PouchReq {
 	/*
@@ -43,7 +121,7 @@ struct _PouchReq {
 	   save the response, as
 	   well as any error codes.
 	 */
-	CURL *easy;			// CURL easy request
+	CURL *easy;			// CURL easy request, reused across requests
 	CURLcode curlcode;	// CURL easy interface error code
 	CURLM *multi;		// CURL multi object
 	CURLMcode curlmcode; // CURLM multi interface error code
@@ -53,11 +131,100 @@ struct _PouchReq {
 	char *url;			// Destination (e.g., "http://127.0.0.1:5984/test");
 	char *usrpwd;		// Holds a user:password authentication string
 	long httpresponse;	// holds the http response of a request
+	PouchShare *share;	// shared DNS/TLS/connection cache, or NULL
+	long timeout;		// maximum time for the whole request in seconds (0 = none) ...
+	int has_timeout;	// ... if set with pr_set_timeout(), otherwise a default is used
+	pr_sink_cb sink;	// streams the response body somewhere other than resp
+	void *sink_data;	// ... and its argument
+	pr_done_cb done;	// internal hook run when the request finishes
+	void *done_data;	// ... and its argument
 	PouchPkt req;		// holds data to be sent
 	PouchPkt resp;		// holds response
+	size_t resp_keep;	// largest response buffer kept for the next request
+	int max_attempts;	// tries per request, including the first (see pr_set_retry()) ...
+	long retry_base;	// ... waiting this many ms before the first retry, doubling ...
+	long retry_max;		// ... up to this many ms per wait ...
+	long retry_deadline;	// ... for at most this many ms in all (0 = no limit)
+	int retry_posts;	// retry POSTs even when the server may have acted on them
+	int attempts;		// tries made by the last request
+	long retry_after;	// ms the server asked us to wait (Retry-After), or -1
+	struct timeval first_try;	// when the first try of the last request started
+	PouchTimes times;	// timing of the last try, see pr_read_times()
+	long http_version;	// CURL_HTTP_VERSION_* to ask for, or 0 for libcurl's default
+	const char *encodings;	// Accept-Encoding to offer, "" for all libcurl can decode, NULL for none
+	size_t gzip_min;	// gzip request bodies of at least this many bytes (0 = never) ...
+	int gzip_level;		// ... at this zlib level
+	struct _PouchHost *host;	// set while counted against a PouchMInfo host by pmi_submit()
+	PouchReq *next;		// next request waiting in the same pmi_submit() queue
 };
 
 
+// Library setup
+void pr_global_init(void);
+struct _PouchBulk {
+	/*
+	   Accumulates documents and writes them to
+	   a database with a single POST to /db/_bulk_docs.
+	   A batch is flushed once it holds max_docs documents,
+	   max_bytes bytes, or its oldest document has waited
+	   max_latency milliseconds (a limit of 0 is ignored).
+	 */
+	PouchReq *pr;		// request used for synchronous flushes; set usrpwd/share on it
+	char *url;			// server/db/_bulk_docs
+	char *docs;			// request body being built: {"docs":[doc,doc,...
+	size_t len;			// bytes used in docs
+	size_t cap;			// bytes allocated for docs
+	size_t count;		// documents in the current batch
+	size_t max_docs;	// flush thresholds
+	size_t max_bytes;
+	long max_latency;	// milliseconds
+	struct timeval first;	// when the first document of the batch was added
+	pb_result_cb cb;	// USER DEFINED per-document result callback
+	void *custom;		// USER DEFINED pointer to some data
+	size_t inflight;	// flushes sent through the multi interface, not yet finished
+	int closing;		// pb_free() was called while flushes were in flight
+	// set by pb_use_pmi() to send flushes through the multi interface
+	void (*submit)(PouchBulk *, PouchReq *, size_t);
+	void (*arm)(PouchBulk *, int);	// start (1) or stop (0) the latency timer
+	void (*release)(PouchBulk *);
+	void *ext;
+};
+struct _PouchDb {
+	/*
+	   A database on a CouchDB server, set up once
+	   with pdb_init(). The pdb_* wrappers build
+	   their URLs by appending to url, and apply
+	   the credentials and defaults kept here.
+	 */
+	char *url;		// escaped "server/db", without a trailing '/'
+	size_t url_len;	// ... and its length
+	char *usrpwd;	// "user:password", or NULL
+	PouchShare *share;	// share context for every request, or NULL
+	long timeout;	// timeout for every request, if has_timeout is set
+	int has_timeout;
+	size_t gzip_min;	// gzip settings for every request (see pr_set_gzip())
+	int gzip_level;
+	PouchCache *revs;	// latest known revision of each document id, or NULL
+	PouchCache *docs;	// documents read with pdb_doc_get() and their revisions, or NULL
+	int refs;	// 1 until pdb_free(), plus one per request that will run pdb_done()
+};
+struct _PouchDoc {
+	/*
+	   One document fetched by doc_get_many(), as
+	   returned by doc_parse_many(). Every string is
+	   malloc()'d and freed by doc_free_many().
+	 */
+	char *id;		// id of the document
+	char *rev;		// its revision, or NULL
+	char *doc;		// the document as JSON text, or NULL
+	char *error;	// why there's no document ("not_found", "deleted", ...), or NULL
+	int deleted;	// the document exists but has been deleted
+};
+
+// PouchShare functions
+PouchShare *pr_mk_share(int flags);
+void pr_del_share(PouchShare *ps);
+
 // Miscellaneous helper functions
 char *url_escape(CURL *curl, char *str);
 char *combine(char **out, char *f, char *s, char *sep);
@@ -66,19 +233,69 @@ char *doc_get_cur_rev(PouchReq *pr, char *server, char *db, char *id);
 // PouchReq functions
 PouchReq *pr_init(void);
 PouchReq *pr_add_header(PouchReq *pr, char *h);
+PouchReq *pr_clear_headers(PouchReq *pr);
 PouchReq *pr_add_usrpwd(PouchReq *pr, char *usrpwd, size_t length);
 PouchReq *pr_add_param(PouchReq *pr, char *key, char *value);
 PouchReq *pr_clear_params(PouchReq *pr);
 PouchReq *pr_set_method(PouchReq *pr, char *method);
 PouchReq *pr_set_url(PouchReq *pr, char *url);
+PouchReq *pr_set_path(PouchReq *pr, char *server, ...);
+PouchReq *pr_set_share(PouchReq *pr, PouchShare *ps);
+PouchReq *pr_set_timeout(PouchReq *pr, long seconds);
+PouchReq *pr_set_retry(PouchReq *pr, int max_attempts, long base_ms, long max_ms, long deadline_ms);
+PouchReq *pr_set_retry_posts(PouchReq *pr, int retry_posts);
+PouchReq *pr_set_http_version(PouchReq *pr, long version);
+PouchReq *pr_set_encodings(PouchReq *pr, const char *encodings);
+PouchReq *pr_set_gzip(PouchReq *pr, size_t min_bytes, int level);
+PouchReq *pr_set_sink(PouchReq *pr, pr_sink_cb sink, void *data);
+PouchReq *pr_set_fdsink(PouchReq *pr, int fd);
+PouchReq *pr_set_parser(PouchReq *pr, PouchJsonParser *parser);
 PouchReq *pr_set_data(PouchReq *pr, char *str);
 PouchReq *pr_set_prdata(PouchReq *pr, char *str, size_t len);
 PouchReq *pr_set_bdata(PouchReq *pr, void *dat, size_t length);
+PouchReq *pr_borrow_data(PouchReq *pr, const void *dat, size_t length);
+PouchReq *pr_borrow_segs(PouchReq *pr, const struct iovec *segs, size_t nsegs);
+PouchReq *pr_set_fdata(PouchReq *pr, int fd, size_t length);
 PouchReq *pr_clear_data(PouchReq *pr);
+PouchReq *pr_clear_resp(PouchReq *pr);
+PouchReq *pr_set_resp_keep(PouchReq *pr, size_t bytes);
 PouchReq *pr_do(PouchReq *pr);
 PouchReq *pr_domulti(PouchReq *pr, CURLM *multi);
 void pr_free(PouchReq *pr);
 
+// PouchBulk functions
+PouchBulk *pb_init(char *server, char *db, pb_result_cb cb, void *custom);
+PouchBulk *pb_set_limits(PouchBulk *pb, size_t max_docs, size_t max_bytes, long max_latency);
+PouchBulk *pb_add(PouchBulk *pb, char *doc);
+PouchBulk *pb_poll(PouchBulk *pb);
+PouchBulk *pb_flush(PouchBulk *pb);
+void pb_report(PouchBulk *pb, PouchReq *pr, size_t count);
+void pb_free(PouchBulk *pb);
+
+// PouchDb functions
+PouchDb *pdb_init(char *server, char *db, char *usrpwd);
+PouchDb *pdb_set_share(PouchDb *pdb, PouchShare *ps);
+PouchDb *pdb_set_timeout(PouchDb *pdb, long seconds);
+PouchDb *pdb_set_gzip(PouchDb *pdb, size_t min_bytes, int level);
+PouchDb *pdb_set_revcache(PouchDb *pdb, size_t budget);
+PouchDb *pdb_set_doccache(PouchDb *pdb, size_t budget);
+char *pdb_doc_cur_rev(PouchReq *pr, PouchDb *pdb, char *id);
+PouchReq *pdb_doc_update(PouchReq *pr, PouchDb *pdb, char *id, char *data);
+PouchReq *pdb_doc_remove(PouchReq *pr, PouchDb *pdb, char *id);
+void pdb_free(PouchDb *pdb);
+PouchReq *pdb_set_path(PouchReq *pr, PouchDb *pdb, ...);
+PouchReq *pdb_db_get(PouchReq *pr, PouchDb *pdb);
+PouchReq *pdb_db_get_changes(PouchReq *pr, PouchDb *pdb);
+PouchReq *pdb_get_all_docs(PouchReq *pr, PouchDb *pdb);
+PouchReq *pdb_doc_get(PouchReq *pr, PouchDb *pdb, char *id);
+PouchReq *pdb_doc_get_rev(PouchReq *pr, PouchDb *pdb, char *id, char *rev);
+PouchReq *pdb_doc_get_info(PouchReq *pr, PouchDb *pdb, char *id);
+PouchReq *pdb_doc_create_id(PouchReq *pr, PouchDb *pdb, char *id, char *data);
+PouchReq *pdb_doc_create(PouchReq *pr, PouchDb *pdb, char *data);
+PouchReq *pdb_doc_delete(PouchReq *pr, PouchDb *pdb, char *id, char *rev);
+PouchReq *pdb_doc_get_attachment(PouchReq *pr, PouchDb *pdb, char *id, char *name);
+PouchReq *pdb_doc_get_many(PouchReq *pr, PouchDb *pdb, char **ids, char **revs, size_t n);
+
 // Database Wrapper Functions
 PouchReq *get_all_dbs(PouchReq *p_req, char *server);
 PouchReq *db_delete(PouchReq *p_req, char *server, char *db);
@@ -99,6 +316,9 @@ PouchReq *doc_create(PouchReq *pr, char *server, char *db, char *data);
 PouchReq *doc_prcreate(PouchReq *pr, char *server, char *db, char *data);
 PouchReq *get_all_docs(PouchReq *pr, char *server, char *db);
 PouchReq *get_all_docs_by_seq(PouchReq *pr, char *server, char *db);
+PouchReq *doc_get_many(PouchReq *pr, char *server, char *db, char **ids, char **revs, size_t n);
+PouchDoc *doc_parse_many(PouchReq *pr, size_t n);
+void doc_free_many(PouchDoc *docs, size_t n);
 PouchReq *doc_get_attachment(PouchReq *pr, char *server, char *db, char *id, char *name);
 PouchReq *doc_copy(PouchReq *pr, char *server, char *db, char *id, char *newid, char *revision);
 PouchReq *doc_delete(PouchReq *pr, char *server, char *db, char *id, char *rev);
@@ -106,6 +326,12 @@ PouchReq *doc_add_attachment(PouchReq *pr, char *server, char *db, char *doc, ch
 
 // Generic curl callback functions
 size_t recv_data_callback(char *ptr, size_t size, size_t nmemb, void *data);
+size_t recv_header_callback(char *ptr, size_t size, size_t nmemb, void *data);
 size_t send_data_callback(void *ptr, size_t size, size_t nmemb, void *data);
+int send_seek_callback(void *data, curl_off_t offset, int origin);
+void pr_setopt_body(PouchReq *pr, CURL *curl);
+void pr_read_times(PouchReq *pr);
+void pr_start_tries(PouchReq *pr);
+long pr_retry_delay(PouchReq *pr);
 
 #endif
@@ -0,0 +1,191 @@
+// Standard libraries
+#include <stdlib.h>
+#include <string.h>
+
+#include "pouch_cache.h"
+
+static size_t pcache_hash(const char *key){
+	// FNV-1a
+	size_t h = 2166136261u;
+	while (*key){
+		h = (h ^ (unsigned char)*key++) * 16777619u;
+	}
+	return h;
+}
+static void lru_unlink(PouchCache *c, PouchCacheEntry *e){
+	if (e->prev){
+		e->prev->next = e->next;
+	} else {
+		c->head = e->next;
+	}
+	if (e->next){
+		e->next->prev = e->prev;
+	} else {
+		c->tail = e->prev;
+	}
+	e->prev = e->next = NULL;
+}
+static void lru_push(PouchCache *c, PouchCacheEntry *e){
+	e->prev = NULL;
+	e->next = c->head;
+	if (c->head){
+		c->head->prev = e;
+	} else {
+		c->tail = e;
+	}
+	c->head = e;
+}
+static PouchCacheEntry **pcache_slot(PouchCache *c, const char *key){
+	// the pointer to key's entry, or to the NULL ending its bucket
+	PouchCacheEntry **slot = &c->buckets[pcache_hash(key) & (c->nbuckets - 1)];
+	while (*slot && strcmp((*slot)->key, key)){
+		slot = &(*slot)->hnext;
+	}
+	return slot;
+}
+static void pcache_remove(PouchCache *c, PouchCacheEntry **slot){
+	PouchCacheEntry *e = *slot;
+	*slot = e->hnext;
+	lru_unlink(c, e);
+	c->used -= e->cost;
+	c->count--;
+	free(e);
+}
+static void pcache_grow(PouchCache *c){
+	size_t i, n = c->nbuckets*2;
+	PouchCacheEntry **b = (PouchCacheEntry **)calloc(n, sizeof(PouchCacheEntry *));
+	if (!b){
+		return;	// keep the longer chains
+	}
+	for (i = 0; i < c->nbuckets; i++){
+		PouchCacheEntry *e = c->buckets[i], *next;
+		for (; e; e = next){
+			size_t h = pcache_hash(e->key) & (n - 1);
+			next = e->hnext;
+			e->hnext = b[h];
+			b[h] = e;
+		}
+	}
+	free(c->buckets);
+	c->buckets = b;
+	c->nbuckets = n;
+}
+PouchCache *pcache_init(size_t budget){
+	/*
+	   Creates an empty cache whose entries may
+	   use up to budget bytes in total.
+	 */
+	PouchCache *c = (PouchCache *)calloc(1, sizeof(PouchCache));
+	if (!c){
+		return NULL;
+	}
+	c->nbuckets = 64;
+	if (!(c->buckets = (PouchCacheEntry **)calloc(c->nbuckets, sizeof(PouchCacheEntry *)))){
+		free(c);
+		return NULL;
+	}
+	c->budget = budget;
+	return c;
+}
+PouchCacheEntry *pcache_get(PouchCache *c, const char *key){
+	/*
+	   Returns key's entry, or NULL. The entry is only
+	   valid until the cache is changed.
+	 */
+	PouchCacheEntry *e = *pcache_slot(c, key);
+	if (!e){
+		c->misses++;
+		return NULL;
+	}
+	c->hits++;
+	if (c->head != e){
+		lru_unlink(c, e);
+		lru_push(c, e);
+	}
+	return e;
+}
+PouchCacheEntry *pcache_peek(PouchCache *c, const char *key){
+	/*
+	   Like pcache_get(), but leaves the counters
+	   and the LRU order alone.
+	 */
+	return *pcache_slot(c, key);
+}
+PouchCacheEntry *pcache_put(PouchCache *c, const char *key, const char *val, size_t len){
+	/*
+	   Stores a copy of the len bytes at val under key,
+	   replacing any older value, and evicts the least
+	   recently used entries to stay within the budget.
+	   Returns the new entry, or NULL if it doesn't fit.
+	 */
+	return pcache_put_tag(c, key, NULL, val, len);
+}
+PouchCacheEntry *pcache_put_tag(PouchCache *c, const char *key, const char *tag, const char *val, size_t len){
+	/*
+	   pcache_put(), also storing a copy of tag.
+	 */
+	PouchCacheEntry **slot = pcache_slot(c, key);
+	size_t klen = strlen(key), tlen = tag ? strlen(tag) + 1 : 0;
+	size_t cost = sizeof(PouchCacheEntry) + klen + 1 + len + 1 + tlen;
+	PouchCacheEntry *e;
+	if (*slot){
+		pcache_remove(c, slot);
+	}
+	if (cost > c->budget){
+		return NULL;
+	}
+	while (c->used + cost > c->budget){
+		pcache_remove(c, pcache_slot(c, c->tail->key));
+		c->evictions++;
+	}
+	if (!(e = (PouchCacheEntry *)malloc(cost))){
+		return NULL;
+	}
+	e->key = (char *)(e + 1);
+	e->val = e->key + klen + 1;
+	memcpy(e->key, key, klen + 1);
+	memcpy(e->val, val, len);
+	e->val[len] = '\0';
+	e->len = len;
+	e->tag = NULL;
+	if (tag){
+		e->tag = e->val + len + 1;
+		memcpy(e->tag, tag, tlen);
+	}
+	e->cost = cost;
+	if (c->count >= c->nbuckets){
+		pcache_grow(c);
+	}
+	slot = pcache_slot(c, key);	// the buckets may have changed
+	e->hnext = NULL;
+	*slot = e;
+	lru_push(c, e);
+	c->used += cost;
+	c->count++;
+	return e;
+}
+void pcache_del(PouchCache *c, const char *key){
+	/*
+	   Forgets key, if it is stored.
+	 */
+	PouchCacheEntry **slot = pcache_slot(c, key);
+	if (*slot){
+		pcache_remove(c, slot);
+	}
+}
+void pcache_clear(PouchCache *c){
+	/*
+	   Removes every entry. The counters are kept.
+	 */
+	while (c->head){
+		pcache_remove(c, pcache_slot(c, c->head->key));
+	}
+}
+void pcache_free(PouchCache *c){
+	/*
+	   Frees the cache and all of its entries.
+	 */
+	pcache_clear(c);
+	free(c->buckets);
+	free(c);
+}
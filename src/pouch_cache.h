@@ -0,0 +1,51 @@
+#ifndef __POUCH_CACHE_H
+#define __POUCH_CACHE_H
+
+// Standard libraries
+#include <stdlib.h>
+#include <string.h>
+
+/*
+   A string to string map with a memory budget and least
+   recently used eviction. PouchDb uses it to remember
+   document revisions, so that updates and deletes don't
+   need a HEAD request first, and to keep document bodies
+   for conditional GETs.
+ */
+
+typedef struct _PouchCache PouchCache;
+typedef struct _PouchCacheEntry PouchCacheEntry;
+
+struct _PouchCacheEntry {
+	char *key;		// null terminated, stored after the entry
+	char *val;		// ... as is the value
+	size_t len;		// length of val, not counting its '\0'
+	char *tag;		// ... and the tag (e.g. a revision), or NULL
+	size_t cost;	// bytes charged against the budget
+	PouchCacheEntry *hnext;	// next entry in the same bucket
+	PouchCacheEntry *prev;	// LRU list, most recently used first
+	PouchCacheEntry *next;
+};
+struct _PouchCache {
+	PouchCacheEntry **buckets;
+	size_t nbuckets;	// always a power of two
+	size_t count;		// entries stored
+	size_t used;		// bytes used by the entries
+	size_t budget;		// ... and how many they may use
+	PouchCacheEntry *head;	// most recently used
+	PouchCacheEntry *tail;	// least recently used, evicted first
+	unsigned long hits;		// pcache_get() found the key
+	unsigned long misses;	// ... or didn't
+	unsigned long evictions;
+	unsigned long not_modified;	// cached values confirmed by the server (HTTP 304)
+};
+
+PouchCache *pcache_init(size_t budget);
+PouchCacheEntry *pcache_get(PouchCache *c, const char *key);
+PouchCacheEntry *pcache_peek(PouchCache *c, const char *key);
+PouchCacheEntry *pcache_put(PouchCache *c, const char *key, const char *val, size_t len);
+PouchCacheEntry *pcache_put_tag(PouchCache *c, const char *key, const char *tag, const char *val, size_t len);
+void pcache_del(PouchCache *c, const char *key);
+void pcache_clear(PouchCache *c);
+void pcache_free(PouchCache *c);
+#endif
@@ -0,0 +1,657 @@
+// Standard libraries
+#include <stdlib.h>
+#include <string.h>
+
+#include "pouch_json.h"
+
+const char *pj_skip_space(const char *p, const char *end){
+	/*
+	   Returns the first non-whitespace character
+	   at or after p (or end).
+	 */
+	while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')){
+		p++;
+	}
+	return p;
+}
+static const char *pj_skip_string(const char *p, const char *end){
+	/*
+	   p points at an opening quote. Returns the
+	   character after the closing quote, or NULL.
+	 */
+	for (p++; p < end; p++){
+		if (*p == '\\'){
+			p++;	// skip the escaped character
+		} else if (*p == '"'){
+			return p + 1;
+		}
+	}
+	return NULL;
+}
+const char *pj_skip_value(const char *p, const char *end){
+	/*
+	   Returns a pointer just past the JSON value
+	   starting at p (leading whitespace is skipped),
+	   or NULL if the value is truncated or malformed.
+	 */
+	int depth = 0;
+	if (!p){
+		return NULL;
+	}
+	p = pj_skip_space(p, end);
+	if (p >= end){
+		return NULL;
+	}
+	if (*p != '{' && *p != '['){ // scalar
+		if (*p == '"'){
+			return pj_skip_string(p, end);
+		}
+		while (p < end && *p != ',' && *p != '}' && *p != ']'
+				&& *p != ' ' && *p != '\t' && *p != '\n' && *p != '\r'){
+			p++;
+		}
+		return p;
+	}
+	while (p < end){ // object or array: find the matching bracket
+		if (*p == '"'){
+			if ((p = pj_skip_string(p, end)) == NULL){
+				return NULL;
+			}
+			continue;
+		}
+		if (*p == '{' || *p == '['){
+			depth++;
+		} else if (*p == '}' || *p == ']'){
+			if (--depth == 0){
+				return p + 1;
+			}
+		}
+		p++;
+	}
+	return NULL;
+}
+static int pj_key_equals(const char *p, const char *end, const char *key){
+	/*
+	   p points at the opening quote of an object key.
+	   Keys used by CouchDB never contain escapes, so
+	   a plain comparison is enough.
+	 */
+	size_t length = strlen(key);
+	p++;
+	return (size_t)(end - p) > length && !strncmp(p, key, length) && p[length] == '"';
+}
+const char *pj_find_member(const char *obj, const char *end, const char *key){
+	/*
+	   Returns a pointer to the value of the top level
+	   member named key in the object starting at obj,
+	   or NULL if there is no such member.
+	 */
+	if (!obj){
+		return NULL;
+	}
+	const char *p = pj_skip_space(obj, end);
+	if (p >= end || *p != '{'){
+		return NULL;
+	}
+	p++;
+	while (1){
+		p = pj_skip_space(p, end);
+		if (p >= end || *p != '"'){
+			return NULL;	// end of object, or malformed
+		}
+		int match = pj_key_equals(p, end, key);
+		if ((p = pj_skip_string(p, end)) == NULL){
+			return NULL;
+		}
+		p = pj_skip_space(p, end);
+		if (p >= end || *p != ':'){
+			return NULL;
+		}
+		p = pj_skip_space(p + 1, end);
+		if (match){
+			return p;
+		}
+		if ((p = pj_skip_value(p, end)) == NULL){
+			return NULL;
+		}
+		p = pj_skip_space(p, end);
+		if (p < end && *p == ','){
+			p++;
+		}
+	}
+}
+const char *pj_array_first(const char *arr, const char *end){
+	/*
+	   Returns the first element of the array starting
+	   at arr, or NULL if it is empty or not an array.
+	 */
+	if (!arr){
+		return NULL;
+	}
+	const char *p = pj_skip_space(arr, end);
+	if (p >= end || *p != '['){
+		return NULL;
+	}
+	p = pj_skip_space(p + 1, end);
+	if (p >= end || *p == ']'){
+		return NULL;
+	}
+	return p;
+}
+const char *pj_array_next(const char *elem, const char *end){
+	/*
+	   Given an element returned by pj_array_first()
+	   or pj_array_next(), returns the next element of
+	   the array, or NULL after the last one.
+	 */
+	const char *p = pj_skip_value(elem, end);
+	if (p == NULL){
+		return NULL;
+	}
+	p = pj_skip_space(p, end);
+	if (p >= end || *p != ','){
+		return NULL;
+	}
+	return pj_skip_space(p + 1, end);
+}
+static char *pj_put_utf8(char *out, unsigned long c){
+	if (c < 0x80){
+		*out++ = (char)c;
+	} else if (c < 0x800){
+		*out++ = (char)(0xC0 | (c >> 6));
+		*out++ = (char)(0x80 | (c & 0x3F));
+	} else if (c < 0x10000){
+		*out++ = (char)(0xE0 | (c >> 12));
+		*out++ = (char)(0x80 | ((c >> 6) & 0x3F));
+		*out++ = (char)(0x80 | (c & 0x3F));
+	} else {
+		*out++ = (char)(0xF0 | (c >> 18));
+		*out++ = (char)(0x80 | ((c >> 12) & 0x3F));
+		*out++ = (char)(0x80 | ((c >> 6) & 0x3F));
+		*out++ = (char)(0x80 | (c & 0x3F));
+	}
+	return out;
+}
+static int pj_hex4(const char *p, const char *end, unsigned long *c){
+	int i;
+	*c = 0;
+	if (end - p < 4){
+		return 0;
+	}
+	for (i = 0; i < 4; i++){
+		char h = p[i];
+		*c <<= 4;
+		if (h >= '0' && h <= '9')		*c |= h - '0';
+		else if (h >= 'a' && h <= 'f')	*c |= h - 'a' + 10;
+		else if (h >= 'A' && h <= 'F')	*c |= h - 'A' + 10;
+		else return 0;
+	}
+	return 1;
+}
+static size_t pj_unescape(char *out, const char *p, const char *stop){
+	/*
+	   Decodes the contents of a JSON string, [p, stop)
+	   without the quotes, into out. Returns the decoded
+	   length, which is never more than stop - p.
+	 */
+	char *start = out;
+	for (; p < stop; p++){
+		if (*p != '\\'){
+			*out++ = *p;
+			continue;
+		}
+		p++;
+		switch (*p){
+			case 'b': *out++ = '\b'; break;
+			case 'f': *out++ = '\f'; break;
+			case 'n': *out++ = '\n'; break;
+			case 'r': *out++ = '\r'; break;
+			case 't': *out++ = '\t'; break;
+			case 'u': {
+				unsigned long c, lo;
+				if (!pj_hex4(p + 1, stop, &c)){
+					break;
+				}
+				p += 4;
+				if (c >= 0xD800 && c < 0xDC00 && stop - p > 6 && p[1] == '\\' && p[2] == 'u'
+						&& pj_hex4(p + 3, stop, &lo) && lo >= 0xDC00 && lo < 0xE000){
+					c = 0x10000 + ((c - 0xD800) << 10) + (lo - 0xDC00);
+					p += 6;
+				}
+				out = pj_put_utf8(out, c);
+				break;
+			}
+			default: *out++ = *p;	// \" \\ \/
+		}
+	}
+	return out - start;
+}
+char *pj_dup_string(const char *p, const char *end){
+	/*
+	   Returns a malloc()'d, null terminated and
+	   unescaped copy of the JSON string at p, or
+	   NULL if p does not point at a string.
+	 */
+	const char *close;
+	if (!p){
+		return NULL;
+	}
+	p = pj_skip_space(p, end);
+	if (p >= end || *p != '"' || (close = pj_skip_string(p, end)) == NULL){
+		return NULL;
+	}
+	char *str = (char *)malloc(close - p); // unescaping never grows a string
+	str[pj_unescape(str, p + 1, close - 1)] = '\0';
+	return str;
+}
+char *pj_dup_value(const char *p, const char *end){
+	/*
+	   Returns a malloc()'d, null terminated copy of the
+	   raw text of the JSON value at p, or NULL.
+	 */
+	if (!p){
+		return NULL;
+	}
+	const char *stop;
+	p = pj_skip_space(p, end);
+	if ((stop = pj_skip_value(p, end)) == NULL || stop == p){
+		return NULL;
+	}
+	char *str = (char *)malloc(stop - p + 1);
+	memcpy(str, p, stop - p);
+	str[stop - p] = '\0';
+	return str;
+}
+int pj_is_true(const char *p, const char *end){
+	/*
+	   Whether the value at p is the literal true.
+	 */
+	if (!p){
+		return 0;
+	}
+	p = pj_skip_space(p, end);
+	return end - p >= 4 && !strncmp(p, "true", 4);
+}
+size_t pj_quoted_len(const char *str){
+	/*
+	   Length of str once escaped and quoted
+	   by pj_write_quoted().
+	 */
+	size_t length = 2;
+	for (; *str; str++){
+		unsigned char c = (unsigned char)*str;
+		if (c == '"' || c == '\\'){
+			length += 2;
+		} else if (c < 0x20){
+			length += 6;	// \u00XX
+		} else {
+			length++;
+		}
+	}
+	return length;
+}
+char *pj_write_quoted(char *out, const char *str){
+	/*
+	   Writes str to out as a quoted JSON string and
+	   returns the end of what was written. out must
+	   have room for pj_quoted_len(str) characters.
+	 */
+	static const char hex[] = "0123456789abcdef";
+	*out++ = '"';
+	for (; *str; str++){
+		unsigned char c = (unsigned char)*str;
+		if (c == '"' || c == '\\'){
+			*out++ = '\\';
+			*out++ = c;
+		} else if (c < 0x20){
+			*out++ = '\\';
+			*out++ = 'u';
+			*out++ = '0';
+			*out++ = '0';
+			*out++ = hex[c >> 4];
+			*out++ = hex[c & 0xF];
+		} else {
+			*out++ = c;
+		}
+	}
+	*out++ = '"';
+	return out;
+}
+
+// Incremental parsing
+#define PJ_TOK_STRING 1
+#define PJ_TOK_BARE 2	// number, true, false or null
+// what pj_feed() accepts next
+#define PJ_EXPECT_VALUE 0		// a value: at the start, after ':' or after ',' in an array
+#define PJ_EXPECT_FIRST_VALUE 1	// a value or ']', after '['
+#define PJ_EXPECT_KEY 2			// a key, after ',' in an object
+#define PJ_EXPECT_FIRST_KEY 3	// a key or '}', after '{'
+#define PJ_EXPECT_COLON 4		// after a key
+#define PJ_EXPECT_COMMA 5		// ',' or the end of the container, after a value; nothing at the top level
+PouchJsonParser *pj_parser_new(pj_event_cb on_event, pj_row_cb on_row, int row_depth, void *custom){
+	/*
+	   Creates a parser reporting tokens to on_event and
+	   whole rows found row_depth containers deep to on_row
+	   (either may be NULL). Use 2 for the rows of _all_docs
+	   and views, or the results of a normal _changes feed.
+	 */
+	PouchJsonParser *p = (PouchJsonParser *)calloc(1, sizeof(PouchJsonParser));
+	if (!p){
+		return NULL;
+	}
+	p->on_event = on_event;
+	p->on_row = on_row;
+	p->row_depth = row_depth;
+	p->custom = custom;
+	return p;
+}
+void pj_parser_reset(PouchJsonParser *p){
+	/*
+	   Gets a parser ready for a new document,
+	   keeping its buffers and callbacks.
+	 */
+	p->depth = 0;
+	p->expect = PJ_EXPECT_VALUE;
+	p->token = 0;
+	p->escape = p->has_escape = 0;
+	p->tok_len = 0;
+	p->in_row = 0;
+	p->row_len = 0;
+	p->rows = 0;
+	p->offset = 0;
+	p->error = 0;
+}
+void pj_parser_free(PouchJsonParser *p){
+	if (!p){
+		return;
+	}
+	free(p->tok);
+	free(p->str);
+	free(p->row);
+	free(p);
+}
+static void pj_keep(char **buf, size_t *len, size_t *cap, const char *from, const char *to){
+	/*
+	   Appends [from, to) to a growing buffer.
+	 */
+	size_t more = to - from;
+	if (*len + more > *cap){
+		*cap = (*len + more)*2;
+		*buf = (char *)realloc(*buf, *cap);
+	}
+	memcpy(*buf + *len, from, more);
+	*len += more;
+}
+static int pj_emit(PouchJsonParser *p, int event, const char *text, size_t len){
+	if (p->on_event && p->on_event(p, event, text, len)){
+		p->error = 1;
+	}
+	return !p->error;
+}
+static int pj_is_number(const char *s, size_t len){
+	// -?(0|[1-9][0-9]*)(\.[0-9]+)?([eE][+-]?[0-9]+)?
+	const char *end = s + len, *digits;
+	if (s < end && *s == '-'){
+		s++;
+	}
+	if (s < end && *s == '0'){
+		s++;
+	} else {
+		for (digits = s; s < end && *s >= '0' && *s <= '9'; s++);
+		if (s == digits){
+			return 0;
+		}
+	}
+	if (s < end && *s == '.'){
+		for (digits = ++s; s < end && *s >= '0' && *s <= '9'; s++);
+		if (s == digits){
+			return 0;
+		}
+	}
+	if (s < end && (*s == 'e' || *s == 'E')){
+		if (++s < end && (*s == '+' || *s == '-')){
+			s++;
+		}
+		for (digits = s; s < end && *s >= '0' && *s <= '9'; s++);
+		if (s == digits){
+			return 0;
+		}
+	}
+	return s == end;
+}
+static int pj_emit_token(PouchJsonParser *p, const char *start, const char *stop){
+	/*
+	   Reports the string or bare token [start, stop), whose
+	   beginning may have been saved from earlier chunks.
+	 */
+	const char *text = start;
+	size_t len = stop - start;
+	int event;
+	if (p->tok_len){
+		pj_keep(&p->tok, &p->tok_len, &p->tok_cap, start, stop);
+		text = p->tok;
+		len = p->tok_len;
+		p->tok_len = 0;
+	}
+	if (p->token == PJ_TOK_STRING){
+		event = p->expect == PJ_EXPECT_COLON ? PJ_KEY : PJ_STRING;
+		if (p->has_escape){
+			if (len > p->str_cap){
+				p->str_cap = len*2;
+				p->str = (char *)realloc(p->str, p->str_cap);
+			}
+			len = pj_unescape(p->str, text, text + len);
+			text = p->str;
+			p->has_escape = 0;
+		}
+	} else if (len == 4 && !strncmp(text, "true", 4)){
+		event = PJ_TRUE;
+	} else if (len == 5 && !strncmp(text, "false", 5)){
+		event = PJ_FALSE;
+	} else if (len == 4 && !strncmp(text, "null", 4)){
+		event = PJ_NULL;
+	} else if (pj_is_number(text, len)){
+		event = PJ_NUMBER;
+	} else {
+		p->error = 1;
+		return 0;
+	}
+	p->token = 0;
+	if (event != PJ_NUMBER && event != PJ_KEY && event != PJ_STRING){
+		return pj_emit(p, event, NULL, 0);
+	}
+	return pj_emit(p, event, text, len);
+}
+static int pj_value_start(PouchJsonParser *p){
+	// a value starting directly inside a row array is a row
+	return !p->in_row && p->depth == p->row_depth && p->depth > 0
+		&& p->stack[p->depth-1] == '[';
+}
+static int pj_value_end(PouchJsonParser *p, const char *row_start, const char *stop){
+	/*
+	   A value just ended at stop; report the row if
+	   it was one.
+	 */
+	const char *text = row_start;
+	size_t len = stop - row_start;
+	if (!p->in_row || p->depth != p->row_depth){
+		return 1;
+	}
+	p->in_row = 0;
+	if (p->row_len){
+		pj_keep(&p->row, &p->row_len, &p->row_cap, row_start, stop);
+		text = p->row;
+		len = p->row_len;
+		p->row_len = 0;
+	}
+	p->rows++;
+	if (p->on_row && p->on_row(p, text, len)){
+		p->error = 1;
+	}
+	return !p->error;
+}
+int pj_feed(PouchJsonParser *p, const char *buf, size_t len){
+	/*
+	   Parses the next len bytes of a document, reporting
+	   every token and row that is complete. Returns 0, or
+	   -1 if the document is malformed (including a missing
+	   ':' or ',', a trailing comma, a bad number or anything
+	   after the top level value) or a callback asked to
+	   stop (after which the parser must be reset).
+	 */
+	const char *c = buf, *end = buf + len;
+	const char *tok_start = p->token ? buf : NULL;	// token carried over from the last chunk
+	const char *row_start = p->in_row ? buf : NULL;	// ... and row
+	if (p->error){
+		return -1;
+	}
+	while (c < end && !p->error){
+		if (p->token == PJ_TOK_STRING){
+			for (; c < end; c++){
+				if (p->escape){
+					p->escape = 0;
+				} else if (*c == '\\'){
+					p->escape = p->has_escape = 1;
+				} else if (*c == '"'){
+					break;
+				}
+			}
+			if (c == end){
+				break;	// the string continues in the next chunk
+			}
+			if (!pj_emit_token(p, tok_start, c)){
+				break;
+			}
+			c++;
+			if (p->expect == PJ_EXPECT_COLON){
+				continue;	// that was a key
+			}
+			p->expect = PJ_EXPECT_COMMA;
+			pj_value_end(p, row_start, c);
+			continue;
+		}
+		if (p->token == PJ_TOK_BARE){
+			for (; c < end; c++){
+				if (*c == ',' || *c == '}' || *c == ']' || *c == ' '
+						|| *c == '\n' || *c == '\r' || *c == '\t'){
+					break;
+				}
+			}
+			if (c == end){
+				break;
+			}
+			if (pj_emit_token(p, tok_start, c)){
+				p->expect = PJ_EXPECT_COMMA;
+				pj_value_end(p, row_start, c);
+			}
+			continue;
+		}
+		switch (*c){	// anything but whitespace must fit p->expect
+			case ' ': case '\t': case '\n': case '\r':
+				c++;
+				break;
+			case ':':
+				if (p->expect != PJ_EXPECT_COLON){
+					p->error = 1;
+					break;
+				}
+				p->expect = PJ_EXPECT_VALUE;
+				c++;
+				break;
+			case ',':
+				if (p->expect != PJ_EXPECT_COMMA || !p->depth){
+					p->error = 1;
+					break;
+				}
+				p->expect = p->stack[p->depth-1] == '{' ? PJ_EXPECT_KEY : PJ_EXPECT_VALUE;
+				c++;
+				break;
+			case '"':
+				if (p->expect == PJ_EXPECT_KEY || p->expect == PJ_EXPECT_FIRST_KEY){
+					p->expect = PJ_EXPECT_COLON;	// once it has been read
+				} else if (p->expect == PJ_EXPECT_VALUE || p->expect == PJ_EXPECT_FIRST_VALUE){
+					if (pj_value_start(p)){
+						p->in_row = 1;
+						row_start = c;
+					}
+				} else {
+					p->error = 1;
+					break;
+				}
+				p->token = PJ_TOK_STRING;
+				tok_start = ++c;
+				break;
+			case '{': case '[':
+				if (p->expect != PJ_EXPECT_VALUE && p->expect != PJ_EXPECT_FIRST_VALUE){
+					p->error = 1;
+					break;
+				}
+				if (pj_value_start(p)){
+					p->in_row = 1;
+					row_start = c;
+				}
+				if (p->depth == PJ_MAX_DEPTH){
+					p->error = 1;
+					break;
+				}
+				p->stack[p->depth++] = *c;
+				p->expect = *c == '{' ? PJ_EXPECT_FIRST_KEY : PJ_EXPECT_FIRST_VALUE;
+				pj_emit(p, *c == '{' ? PJ_OBJECT_START : PJ_ARRAY_START, NULL, 0);
+				c++;
+				break;
+			case '}': case ']':
+				if (!p->depth || p->stack[p->depth-1] != (*c == '}' ? '{' : '[')
+						|| (p->expect != PJ_EXPECT_COMMA
+							&& p->expect != (*c == '}' ? PJ_EXPECT_FIRST_KEY : PJ_EXPECT_FIRST_VALUE))){
+					p->error = 1;
+					break;
+				}
+				p->depth--;
+				p->expect = PJ_EXPECT_COMMA;
+				if (pj_emit(p, *c == '}' ? PJ_OBJECT_END : PJ_ARRAY_END, NULL, 0)){
+					pj_value_end(p, row_start, c + 1);
+				}
+				c++;
+				break;
+			default:
+				if (p->expect != PJ_EXPECT_VALUE && p->expect != PJ_EXPECT_FIRST_VALUE){
+					p->error = 1;
+					break;
+				}
+				if (pj_value_start(p)){
+					p->in_row = 1;
+					row_start = c;
+				}
+				p->token = PJ_TOK_BARE;
+				tok_start = c;
+		}
+	}
+	if (p->error){
+		return -1;
+	}
+	// save whatever straddles the end of this chunk
+	if (p->token){
+		pj_keep(&p->tok, &p->tok_len, &p->tok_cap, tok_start, end);
+	}
+	if (p->in_row){
+		pj_keep(&p->row, &p->row_len, &p->row_cap, row_start, end);
+	}
+	p->offset += len;
+	return 0;
+}
+int pj_finish(PouchJsonParser *p){
+	/*
+	   Call after the last chunk. Returns 0 if a
+	   complete document was parsed, -1 otherwise.
+	 */
+	if (!p->error && p->token == PJ_TOK_BARE && p->depth == 0){
+		if (pj_emit_token(p, p->tok, p->tok)){ // a top level number ends with the input
+			p->expect = PJ_EXPECT_COMMA;
+		}
+	}
+	if (p->error || p->token || p->depth || p->expect != PJ_EXPECT_COMMA){
+		p->error = 1;
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,94 @@
+#ifndef __POUCH_JSON_H
+#define __POUCH_JSON_H
+// Standard libraries
+#include <stdlib.h>
+#include <string.h>
+
+/*
+   Minimal JSON scanning helpers used internally by pouch
+   to pick a few fields (id, rev, error, ...) out of CouchDB
+   responses without building a document tree. Every function
+   takes an end pointer, so the input does not need to be
+   null terminated. Use the JSON library of your choice for
+   the documents themselves.
+ */
+
+#define PJ_MAX_DEPTH 64
+
+// Events reported by a PouchJsonParser
+#define PJ_OBJECT_START 1
+#define PJ_OBJECT_END 2
+#define PJ_ARRAY_START 3
+#define PJ_ARRAY_END 4
+#define PJ_KEY 5
+#define PJ_STRING 6
+#define PJ_NUMBER 7
+#define PJ_TRUE 8
+#define PJ_FALSE 9
+#define PJ_NULL 10
+
+typedef struct _PouchJsonParser PouchJsonParser;
+/*
+	Called for every token. For PJ_KEY and PJ_STRING, text
+	is the unescaped string; for PJ_NUMBER, its digits; it is
+	NULL otherwise. text is NOT null terminated and only valid
+	during the call. Return non-zero to stop parsing.
+*/
+typedef int (*pj_event_cb)(PouchJsonParser *, int event, const char *text, size_t len);
+/*
+	Called with the complete JSON text of every element of the
+	arrays found row_depth levels deep (e.g. each row of
+	{"rows":[...]} with row_depth 2), as soon as its last byte
+	has been fed. Return non-zero to stop parsing.
+*/
+typedef int (*pj_row_cb)(PouchJsonParser *, const char *row, size_t len);
+struct _PouchJsonParser {
+	/*
+	   A resumable, event based JSON parser. It can be fed
+	   a document in chunks split at arbitrary boundaries,
+	   e.g. straight from a libcurl write callback, and only
+	   copies the token (and row) that straddles a chunk.
+	 */
+	pj_event_cb on_event;	// USER DEFINED, may be NULL
+	pj_row_cb on_row;		// USER DEFINED, may be NULL
+	int row_depth;			// depth of the arrays whose elements are rows
+	void *custom;			// USER DEFINED pointer to some data
+	int depth;				// containers currently open
+	char stack[PJ_MAX_DEPTH];	// '{' or '[' for each of them
+	int expect;				// what the grammar allows next (a key, a value, ':', ...)
+	int token;				// type of the token being read, or 0
+	int escape;				// the last character of the string was a backslash
+	int has_escape;			// the current string needs unescaping
+	char *tok;				// the part of a token that was in earlier chunks
+	size_t tok_len;
+	size_t tok_cap;
+	char *str;				// scratch space for unescaping strings
+	size_t str_cap;
+	int in_row;				// a row is being read
+	char *row;				// the part of a row that was in earlier chunks
+	size_t row_len;
+	size_t row_cap;
+	size_t rows;			// rows reported so far
+	size_t offset;			// bytes fed so far
+	int error;				// set once the input was malformed or a callback stopped
+};
+
+const char *pj_skip_space(const char *p, const char *end);
+const char *pj_skip_value(const char *p, const char *end);
+const char *pj_find_member(const char *obj, const char *end, const char *key);
+const char *pj_array_first(const char *arr, const char *end);
+const char *pj_array_next(const char *elem, const char *end);
+char *pj_dup_string(const char *p, const char *end);
+char *pj_dup_value(const char *p, const char *end);
+int pj_is_true(const char *p, const char *end);
+size_t pj_quoted_len(const char *str);
+char *pj_write_quoted(char *out, const char *str);
+
+// Incremental parsing
+PouchJsonParser *pj_parser_new(pj_event_cb on_event, pj_row_cb on_row, int row_depth, void *custom);
+void pj_parser_reset(PouchJsonParser *p);
+int pj_feed(PouchJsonParser *p, const char *buf, size_t len);
+int pj_finish(PouchJsonParser *p);
+void pj_parser_free(PouchJsonParser *p);
+
+#endif
@@ -0,0 +1,275 @@
+// Standard libraries
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "pouch_stats.h"
+
+// Histograms
+static int phist_bucket(uint64_t v){
+	int shift;
+	if (v < 2*POUCH_HIST_SUB){
+		return (int)v;
+	}
+	if (v >> 32){
+		return POUCH_HIST_BUCKETS - 1;	// clamp
+	}
+	shift = 63 - __builtin_clzll(v) - POUCH_HIST_SUB_BITS;
+	return shift*POUCH_HIST_SUB + (int)(v >> shift);
+}
+static uint64_t phist_highest(int bucket){
+	// the largest value that falls in bucket
+	int shift;
+	if (bucket < 2*POUCH_HIST_SUB){
+		return bucket;
+	}
+	shift = bucket/POUCH_HIST_SUB - 1;
+	return (((uint64_t)(bucket - shift*POUCH_HIST_SUB) + 1) << shift) - 1;
+}
+void phist_record(PouchHist *h, uint64_t value){
+	h->counts[phist_bucket(value)]++;
+	if (!h->count || value < h->min){
+		h->min = value;
+	}
+	if (value > h->max){
+		h->max = value;
+	}
+	h->count++;
+	h->sum += value;
+}
+uint64_t phist_percentile(const PouchHist *h, double percentile){
+	/*
+	   Returns the value below which percentile percent
+	   of the recorded values fall (e.g. 99.9), rounded up
+	   to the end of its bucket, or 0 if h is empty.
+	 */
+	uint64_t target, seen = 0;
+	int i;
+	if (!h || !h->count){
+		return 0;
+	}
+	target = (uint64_t)(percentile/100.0*h->count);
+	if (target < percentile/100.0*h->count){	// round up
+		target++;
+	}
+	if (target < 1){
+		target = 1;
+	}
+	for (i = 0; i < POUCH_HIST_BUCKETS; i++){
+		if ((seen += h->counts[i]) >= target){
+			uint64_t v = phist_highest(i);
+			return v < h->max ? v : h->max;
+		}
+	}
+	return h->max;
+}
+void phist_merge(PouchHist *dst, const PouchHist *src){
+	int i;
+	if (!src->count){
+		return;
+	}
+	for (i = 0; i < POUCH_HIST_BUCKETS; i++){
+		dst->counts[i] += src->counts[i];
+	}
+	if (!dst->count || src->min < dst->min){
+		dst->min = src->min;
+	}
+	if (src->max > dst->max){
+		dst->max = src->max;
+	}
+	dst->count += src->count;
+	dst->sum += src->sum;
+}
+void phist_reset(PouchHist *h){
+	memset(h, 0, sizeof(*h));
+}
+
+// Request statistics
+static const char *method_names[POUCH_M_COUNT] = {
+	"GET", "HEAD", "PUT", "POST", "DELETE", "COPY", "other"
+};
+static const char *endpoint_names[POUCH_EP_COUNT] = {
+	"server", "db", "doc", "attachment", "_all_docs", "_bulk", "_changes", "view", "db/_other"
+};
+static const char *phase_names[POUCH_T_COUNT] = {
+	"dns", "connect", "tls", "server", "transfer", "total"
+};
+static int pstats_method(const char *method){
+	int i;
+	if (!method){
+		return POUCH_M_OTHER;
+	}
+	for (i = 0; i < POUCH_M_OTHER; i++){
+		if (!strcmp(method, method_names[i])){
+			return i;
+		}
+	}
+	return POUCH_M_OTHER;
+}
+static int seg_is(const char *seg, size_t len, const char *name){
+	return len == strlen(name) && !strncmp(seg, name, len);
+}
+static int pstats_endpoint(const char *url){
+	/*
+	   Sorts a request by its path: /db/doc, /db/_changes, ...
+	   Document ids are escaped, so a '/' always separates
+	   segments, except after _design/ and _local/.
+	 */
+	const char *p = url ? strstr(url, "://") : NULL;
+	const char *seg[4];
+	size_t len[4];
+	int n = 0;
+	if (!p){
+		return POUCH_EP_OTHER;
+	}
+	p += 3;
+	p += strcspn(p, "/?#");	// skip the host
+	while (n < 4 && *p == '/'){
+		seg[n] = ++p;
+		len[n] = strcspn(p, "/?#");
+		p += len[n];
+		if (len[n]){
+			n++;
+		}
+	}
+	if (!n || seg[0][0] == '_'){
+		return POUCH_EP_SERVER;
+	}
+	if (n == 1){
+		return POUCH_EP_DB;
+	}
+	if (seg[1][0] != '_'){
+		return n == 2 ? POUCH_EP_DOC : POUCH_EP_ATTACHMENT;
+	}
+	if (seg_is(seg[1], len[1], "_design") || seg_is(seg[1], len[1], "_local")){
+		if (n == 4 && (seg_is(seg[3], len[3], "_view") || seg_is(seg[3], len[3], "_list")
+					|| seg_is(seg[3], len[3], "_show"))){
+			return POUCH_EP_VIEW;
+		}
+		return n <= 3 ? POUCH_EP_DOC : POUCH_EP_ATTACHMENT;
+	}
+	if (seg_is(seg[1], len[1], "_all_docs")){
+		return POUCH_EP_ALL_DOCS;
+	}
+	if (seg_is(seg[1], len[1], "_bulk_docs") || seg_is(seg[1], len[1], "_bulk_get")){
+		return POUCH_EP_BULK;
+	}
+	if (seg_is(seg[1], len[1], "_changes")){
+		return POUCH_EP_CHANGES;
+	}
+	if (seg_is(seg[1], len[1], "_find")){
+		return POUCH_EP_VIEW;
+	}
+	return POUCH_EP_OTHER;
+}
+PouchStats *pstats_init(void){
+	return (PouchStats *)calloc(1, sizeof(PouchStats));
+}
+static uint64_t span(curl_off_t from, curl_off_t to){
+	return to > from ? (uint64_t)(to - from) : 0;
+}
+void pstats_record(PouchStats *s, PouchReq *pr){
+	/*
+	   Adds the timings of the last try of pr (pr->times)
+	   to the histograms of its method and endpoint. Tries
+	   that failed without a response only count as errors.
+	 */
+	int m = pstats_method(pr->method), ep = pstats_endpoint(pr->url);
+	PouchTimingSet *set = s->sets[m][ep];
+	PouchTimes *t = &pr->times;
+	if (!set && !(set = s->sets[m][ep] = (PouchTimingSet *)calloc(1, sizeof(PouchTimingSet)))){
+		return;
+	}
+	if (pr->curlcode){
+		set->errors++;
+		return;
+	}
+	phist_record(&set->phase[POUCH_T_DNS], t->namelookup);
+	phist_record(&set->phase[POUCH_T_CONNECT], span(t->namelookup, t->connect));
+	phist_record(&set->phase[POUCH_T_TLS], t->appconnect ? span(t->connect, t->appconnect) : 0);
+	phist_record(&set->phase[POUCH_T_SERVER], span(t->pretransfer, t->starttransfer));
+	phist_record(&set->phase[POUCH_T_TRANSFER], span(t->starttransfer, t->total));
+	phist_record(&set->phase[POUCH_T_TOTAL], t->total);
+}
+PouchHist *pstats_hist(PouchStats *s, int method, int endpoint, int phase){
+	/*
+	   The histogram of one phase of the requests with a
+	   POUCH_M_* method to a POUCH_EP_* endpoint, or NULL
+	   if there has been none.
+	 */
+	PouchTimingSet *set = s->sets[method][endpoint];
+	return set ? &set->phase[phase] : NULL;
+}
+void pstats_merge(PouchStats *dst, const PouchStats *src){
+	// adds the counts of src to dst, e.g. to report on a PouchPool
+	int m, ep, ph;
+	for (m = 0; m < POUCH_M_COUNT; m++){
+		for (ep = 0; ep < POUCH_EP_COUNT; ep++){
+			PouchTimingSet *from = src->sets[m][ep], *to = dst->sets[m][ep];
+			if (!from){
+				continue;
+			}
+			if (!to && !(to = dst->sets[m][ep] = (PouchTimingSet *)calloc(1, sizeof(PouchTimingSet)))){
+				return;
+			}
+			for (ph = 0; ph < POUCH_T_COUNT; ph++){
+				phist_merge(&to->phase[ph], &from->phase[ph]);
+			}
+			to->errors += from->errors;
+		}
+	}
+}
+void pstats_print(PouchStats *s, FILE *out){
+	/*
+	   Writes a table of the count, mean, p50, p99, p99.9
+	   and maximum of every phase, in microseconds.
+	 */
+	int m, ep, ph;
+	fprintf(out, "%-7s %-11s %-9s %9s %9s %9s %9s %9s %9s %7s\n",
+			"method", "endpoint", "phase", "count", "mean", "p50", "p99", "p99.9", "max", "errors");
+	for (m = 0; m < POUCH_M_COUNT; m++){
+		for (ep = 0; ep < POUCH_EP_COUNT; ep++){
+			PouchTimingSet *set = s->sets[m][ep];
+			if (!set){
+				continue;
+			}
+			for (ph = 0; ph < POUCH_T_COUNT; ph++){
+				PouchHist *h = &set->phase[ph];
+				fprintf(out, "%-7s %-11s %-9s %9llu %9.0f %9llu %9llu %9llu %9llu",
+						method_names[m], endpoint_names[ep], phase_names[ph],
+						(unsigned long long)h->count, h->count ? (double)h->sum/h->count : 0.0,
+						(unsigned long long)phist_percentile(h, 50),
+						(unsigned long long)phist_percentile(h, 99),
+						(unsigned long long)phist_percentile(h, 99.9),
+						(unsigned long long)h->max);
+				if (ph == POUCH_T_TOTAL){
+					fprintf(out, " %7llu", (unsigned long long)set->errors);
+				}
+				fputc('\n', out);
+			}
+		}
+	}
+}
+void pstats_reset(PouchStats *s){
+	// empties every histogram, keeping them allocated
+	int m, ep;
+	for (m = 0; m < POUCH_M_COUNT; m++){
+		for (ep = 0; ep < POUCH_EP_COUNT; ep++){
+			if (s->sets[m][ep]){
+				memset(s->sets[m][ep], 0, sizeof(PouchTimingSet));
+			}
+		}
+	}
+}
+void pstats_free(PouchStats *s){
+	int m, ep;
+	if (!s){
+		return;
+	}
+	for (m = 0; m < POUCH_M_COUNT; m++){
+		for (ep = 0; ep < POUCH_EP_COUNT; ep++){
+			free(s->sets[m][ep]);
+		}
+	}
+	free(s);
+}
@@ -0,0 +1,101 @@
+#ifndef __POUCH_STATS_H
+#define __POUCH_STATS_H
+
+// Standard libraries
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#include "pouch.h"
+
+/*
+   Latency histograms of finished requests, kept per
+   HTTP method and kind of endpoint, for every phase of
+   a request (DNS, connect, TLS, server time, transfer
+   and the total). Recording a request costs a few
+   hundred nanoseconds and never allocates once its
+   method and endpoint have been seen.
+ */
+
+// Histogram resolution: 2^POUCH_HIST_SUB_BITS buckets per power of two
+// (about 3% relative error), from 1us up to 2^32us (71 minutes)
+#define POUCH_HIST_SUB_BITS 5
+#define POUCH_HIST_SUB (1 << POUCH_HIST_SUB_BITS)
+#define POUCH_HIST_BUCKETS ((32 - POUCH_HIST_SUB_BITS + 1)*POUCH_HIST_SUB)
+
+// Methods
+#define POUCH_M_GET 0
+#define POUCH_M_HEAD 1
+#define POUCH_M_PUT 2
+#define POUCH_M_POST 3
+#define POUCH_M_DELETE 4
+#define POUCH_M_COPY 5
+#define POUCH_M_OTHER 6
+#define POUCH_M_COUNT 7
+
+// Kinds of endpoint, from the path of the URL
+#define POUCH_EP_SERVER 0		// /, /_all_dbs, /_uuids, ...
+#define POUCH_EP_DB 1			// /db
+#define POUCH_EP_DOC 2			// /db/doc, /db/_design/ddoc, /db/_local/doc
+#define POUCH_EP_ATTACHMENT 3	// /db/doc/attachment
+#define POUCH_EP_ALL_DOCS 4		// /db/_all_docs
+#define POUCH_EP_BULK 5			// /db/_bulk_docs, /db/_bulk_get
+#define POUCH_EP_CHANGES 6		// /db/_changes
+#define POUCH_EP_VIEW 7			// /db/_design/ddoc/_view/view, /db/_find
+#define POUCH_EP_OTHER 8		// any other /db/_endpoint
+#define POUCH_EP_COUNT 9
+
+// Phases, in microseconds
+#define POUCH_T_DNS 0			// resolving the name
+#define POUCH_T_CONNECT 1		// TCP handshake
+#define POUCH_T_TLS 2			// TLS handshake
+#define POUCH_T_SERVER 3		// request sent until the first byte of the response
+#define POUCH_T_TRANSFER 4		// first byte of the response until the last
+#define POUCH_T_TOTAL 5
+#define POUCH_T_COUNT 6
+
+typedef struct _PouchHist PouchHist;
+typedef struct _PouchTimingSet PouchTimingSet;
+typedef struct _PouchStats PouchStats;
+
+struct _PouchHist {
+	/*
+	   A log-linear (HDR style) histogram: values below
+	   2*POUCH_HIST_SUB get a bucket each, larger ones
+	   share a bucket with values within about 3%.
+	 */
+	uint64_t counts[POUCH_HIST_BUCKETS];
+	uint64_t count;
+	uint64_t sum;
+	uint64_t min;
+	uint64_t max;
+};
+struct _PouchTimingSet {
+	// the histograms of one method and kind of endpoint
+	PouchHist phase[POUCH_T_COUNT];
+	uint64_t errors;	// tries that failed before getting a response
+};
+struct _PouchStats {
+	/*
+	   Not thread safe: record and query on the thread
+	   running the PouchMInfo it is attached to, and use
+	   one per PouchPool worker, merged for reporting.
+	 */
+	PouchTimingSet *sets[POUCH_M_COUNT][POUCH_EP_COUNT];	// NULL until recorded
+};
+
+// Histograms
+void phist_record(PouchHist *h, uint64_t value);
+uint64_t phist_percentile(const PouchHist *h, double percentile);
+void phist_merge(PouchHist *dst, const PouchHist *src);
+void phist_reset(PouchHist *h);
+
+// Request statistics
+PouchStats *pstats_init(void);
+void pstats_record(PouchStats *s, PouchReq *pr);
+PouchHist *pstats_hist(PouchStats *s, int method, int endpoint, int phase);
+void pstats_merge(PouchStats *dst, const PouchStats *src);
+void pstats_print(PouchStats *s, FILE *out);
+void pstats_reset(PouchStats *s);
+void pstats_free(PouchStats *s);
+#endif